@@ -15,66 +15,83 @@
 #ifndef MULTIGAIN_DECODE_HPP
 #define MULTIGAIN_DECODE_HPP
 
+#include <cassert>
 #include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <memory>
+#include <vector>
 
 #include <multigain/errors.hpp>
 
 // hip_global_struct* == hip_t
 struct hip_global_struct;
+struct FLAC__StreamDecoder;
+// mpg123_handle_struct* == mpg123_handle*
+struct mpg123_handle_struct;
 
 namespace multigain {
 
+/** Samples decoded, one plane per channel */
 class Audio_buffer {
 public:
-	Audio_buffer(size_t len) :
+	enum class format_type {
+		S16,
+		/** Floating point, in [-1.0,1.0] */
+		F32
+	};
+
+	Audio_buffer(size_t len, format_type format = format_type::S16) :
 		_samples(),
 		_sample_ptrs(),
+		_float_samples(),
+		_float_sample_ptrs(),
 		_len(len),
 		_freq(0),
-		_chan(0)
+		_chan(0),
+		_format(format)
 	{}
 
-	void init(uint8_t channels, int16_t freq) {
-		using std::swap;
-
+	void init(uint8_t channels, uint32_t freq) {
 		assert(channels && freq);
 
+		_freq = freq;
 		if (channels == _chan) return;
 
-		size_t total = _len * channels;
-
-		std::unique_ptr<int16_t> new_samples(new int16_t[total]);
-
-		std::unique_ptr<int16_t *> new_sample_ptrs(
-		    new int16_t *[channels]);
-
-		size_t off = 0;
-		for (size_t i = 0; i < channels; i++) {
-			new_sample_ptrs.get()[i] = new_samples.get() + off;
-			off += _len;
-		}
-
-		std::swap(_sample_ptrs, new_sample_ptrs);
-		std::swap(_samples, new_samples);
+		if (_format == format_type::F32)
+			alloc(channels, _float_samples, _float_sample_ptrs);
+		else
+			alloc(channels, _samples, _sample_ptrs);
 		_chan = channels;
-		_freq = freq;
 	}
 
+	/** The planes of an S16 buffer */
 	int16_t **samples() {
+		assert(_format == format_type::S16);
 		return _sample_ptrs.get();
 	}
 
 	const int16_t *const *samples() const {
+		assert(_format == format_type::S16);
 		return _sample_ptrs.get();
 	}
 
+	/** The planes of an F32 buffer */
+	float **float_samples() {
+		assert(_format == format_type::F32);
+		return _float_sample_ptrs.get();
+	}
+
+	const float *const *float_samples() const {
+		assert(_format == format_type::F32);
+		return _float_sample_ptrs.get();
+	}
+
 	size_t len() const {
 		return _len;
 	}
 
-	uint16_t frequency() const {
+	uint32_t frequency() const {
 		return _freq;
 	}
 
@@ -82,34 +99,99 @@ public:
 		return _chan;
 	}
 
-	std::unique_ptr<int16_t>	_samples;
-	std::unique_ptr<int16_t *>	_sample_ptrs;
+	format_type format() const {
+		return _format;
+	}
+
+	template <typename T>
+	void alloc(uint8_t channels, std::unique_ptr<T[]> &samples,
+	    std::unique_ptr<T *[]> &sample_ptrs) {
+		std::unique_ptr<T[]> new_samples(new T[_len * channels]);
+		std::unique_ptr<T *[]> new_sample_ptrs(new T *[channels]);
+
+		for (size_t i = 0; i < channels; i++)
+			new_sample_ptrs[i] = new_samples.get() + i * _len;
+
+		std::swap(sample_ptrs, new_sample_ptrs);
+		std::swap(samples, new_samples);
+	}
+
+	std::unique_ptr<int16_t[]>	_samples;
+	std::unique_ptr<int16_t *[]>	_sample_ptrs;
+	std::unique_ptr<float[]>	_float_samples;
+	std::unique_ptr<float *[]>	_float_sample_ptrs;
 	size_t		_len;
-	uint16_t 	_freq;
+	uint32_t 	_freq;
 	uint8_t 	_chan;
+	format_type	_format;
 };
 
 class Decoder {
 public:
 	virtual ~Decoder() noexcept {}
 
+	/// \throw Bad_format	Not a buffer format the decoder gives
 	/// \throw Decode_error
 	/// \throw Disk_error
 	virtual std::pair<size_t, size_t> decode(Audio_buffer *)
 	    = 0;
 };
 
+/** FLAC frame-by-frame decoder
+ *
+ * Into an F32 buffer, samples of any width are kept whole.  Into an S16
+ * one, samples wider than 16 bits lose their low bits; narrower ones are
+ * scaled up.
+ */
 class Flac_decoder : public Decoder {
 public:
-	/// \throw Disk_error
-	/// \throw Lame_decode_error
+	/** Create a FLAC decoder
+	 *
+	 * \param fp	The opened FLAC file, which the decoder closes when
+	 *	destroyed, or when this throws
+	 * \throw Decode_error	libFLAC failed to start
+	 * \throw Disk_error	No file
+	 */
 	Flac_decoder(FILE *fp);
 	~Flac_decoder() noexcept;
 
-	/// \throw Decode_error
-	/// \throw Disk_error
-	/// \throw Lame_decode_error
+	Flac_decoder(const Flac_decoder &) = delete;
+	void operator=(const Flac_decoder &) = delete;
+
+	/** Decode samples straight into the planes of a buffer
+	 *
+	 * The buffer is filled but for the end of the stream, or a change
+	 * in channels or sample frequency, which starts the next buffer.
+	 *
+	 * \throw Decode_error	Bad FLAC stream
+	 * \throw Disk_error	Read error
+	 * \return	Input bytes consumed, samples decoded
+	 */
 	std::pair<size_t, size_t> decode(Audio_buffer *) override;
+
+private:
+	struct Callbacks;
+	friend struct Callbacks;
+
+	/// Move pending samples to the buffer
+	void drain();
+
+	FILE				*_file;
+	struct FLAC__StreamDecoder	*_dec;
+	// what decode() is filling, and how far
+	Audio_buffer			*_buf;
+	size_t				_filled;
+	// the part of a frame that did not fit, one plane per channel
+	std::vector<int32_t>		_pending;
+	size_t				_pending_len;
+	size_t				_pending_pos;
+	unsigned			_pending_bits;
+	uint32_t			_pending_freq;
+	uint8_t				_pending_chan;
+	// decoding position [bytes]
+	uint64_t			_pos;
+	// from the error callback
+	const char			*_error;
 };
 
 class Mpeg_frame_header;
@@ -138,6 +220,7 @@ public:
 	 * \param[out] right	Samples of the stereo-right channel
 	 * \param[out] info	Optional.  Basic information about the samples
 	 *	just returned
+	 * \throw Bad_format	Not an S16 buffer
 	 * \throw Decode_error	So far, this really should not happen
 	 * \throw Disk_error	Seek or read error
 	 * \throw Lame_error	The LAME library has some error
@@ -165,6 +248,60 @@ private:
 	uint16_t			_skip_front;
 };
 
+/** MPEG audio decoder on libmpg123
+ *
+ * This gives what Mpeg_decoder does, to the same gapless bounds, but
+ * faster, as floating point, and without the LAME library.
+ */
+class Mpg123_decoder : public Decoder {
+public:
+	/** Create an MPEG audio decoder
+	 *
+	 * \param file	The opened MPEG audio file
+	 * \throw Bad_format	Not an MPEG audio file
+	 * \throw Decode_error	libmpg123 failed to start
+	 * \throw Disk_error	Problem searching tags
+	 */
+	Mpg123_decoder(std::ifstream &file);
+	~Mpg123_decoder() noexcept;
+
+	Mpg123_decoder(const Mpg123_decoder &) = delete;
+	void operator=(const Mpg123_decoder &) = delete;
+
+	/** Decode samples into a buffer of either format
+	 *
+	 * The buffer is filled but for the end of the stream, or a change
+	 * in channels or sample frequency, which starts the next buffer.
+	 *
+	 * \throw Decode_error	libmpg123 has some error
+	 * \throw Disk_error	Seek or read error
+	 * \return	Input bytes consumed, samples decoded
+	 */
+	std::pair<size_t, size_t> decode(Audio_buffer *) override;
+
+private:
+	/// Feed the next of the file to libmpg123
+	/// \throw Decode_error
+	/// \throw Disk_error
+	/// \retval false	Nothing left
+	bool feed();
+
+	std::ifstream			&_file;
+	struct mpg123_handle_struct	*_mh;
+	// decoded, interleaved, in the format of the last frame
+	std::vector<float>		_sample_buf;
+	off_t				_end;
+	off_t				_pos;
+	// frames in _sample_buf
+	size_t				_samples;
+	long				_freq;
+	int				_chan;
+	uint16_t			_skip_back;
+	uint16_t			_skip_front;
+	// a new format comes after what _sample_buf holds
+	bool				_new_format;
+};
+
 class Mpeg_frame_header {
 public:
 	struct Bad_header : std::exception {};
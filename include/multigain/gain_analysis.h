@@ -73,8 +73,10 @@
 
 #ifdef __cplusplus
 #	include <cstddef>
+#	include <cstdint>
 #else
 #	include <stddef.h>
+#	include <stdint.h>
 #endif
 
 const double	GAIN_NOT_ENOUGH_SAMPLES = -24601.;
@@ -90,13 +92,17 @@ const double	GAIN_NOT_ENOUGH_SAMPLES = -24601.;
 	/** Not to be used directly. */
 	const size_t	ANALYZE_SIZE = STEPS_PER_DB * MAX_DB;
 
-#	define	__INLINE	inline
+	/** Warm-up for replaygain_discard() [ms] */
+	const unsigned	REPLAYGAIN_WARMUP_MS = 200;
+
+	/** Most channels a context analyzes */
+	const unsigned	REPLAYGAIN_MAX_CHANNELS = 8;
 #else
 #	define		STEPS_PER_DB	100
 #	define		MAX_DB		120
 #	define		ANALYZE_SIZE	(STEPS_PER_DB * MAX_DB)
-
-#	define	__INLINE	static inline
+#	define		REPLAYGAIN_WARMUP_MS	200
+#	define		REPLAYGAIN_MAX_CHANNELS	8
 #endif
 
 enum replaygain_status {
@@ -106,6 +112,41 @@ enum replaygain_status {
 	REPLAYGAIN_ERR_SAMPLEFREQ,	/**< Unsupported sampling frequency */
 };
 
+/** Implementations of the analysis loops
+ *
+ * Each context uses the best set the CPU supports, unless the environment
+ * variable MULTIGAIN_KERNEL names another (<code>scalar</code>,
+ * <code>sse2</code>, <code>avx2</code> or <code>avx512</code>).  All of them
+ * give identical results, except that the true peak of the AVX2 and AVX-512
+ * kernels may differ in the last bits of single precision.
+ */
+enum replaygain_kernel {
+	REPLAYGAIN_KERNEL_AUTO,		/**< The default for new contexts */
+	REPLAYGAIN_KERNEL_SCALAR,	/**< The portable reference code */
+	REPLAYGAIN_KERNEL_SSE2,
+	REPLAYGAIN_KERNEL_AVX2,
+	REPLAYGAIN_KERNEL_AVX512,
+};
+
+/** Arithmetic used by the filters */
+enum replaygain_mode {
+	REPLAYGAIN_MODE_DOUBLE,	/**< Double precision; the reference */
+	/** Single precision, with the filter sums regrouped for speed
+	 *
+	 * Compared with <code>REPLAYGAIN_MODE_DOUBLE</code>, the filter
+	 * output differs by roughly 1e-5 dB RMS, so an RMS window moves to a
+	 * neighbouring 0.01 dB bin only when it lies that close to the
+	 * boundary.  Adjustments differ by at most one bin, 0.01 dB; on pink
+	 * noise at every tabled sampling frequency they are identical to
+	 * the double-precision ones.  In our measurements about one window in
+	 * 2500 moved a bin.
+	 *
+	 * Above 64 kHz, the filters need double precision, and a context in
+	 * this mode uses it.
+	 */
+	REPLAYGAIN_MODE_FLOAT,
+};
+
 struct replaygain_ctx;
 
 /** The accumulated value of a set of samples */
@@ -113,9 +154,31 @@ struct replaygain_value {
 	uint32_t value[ANALYZE_SIZE];
 };
 
+/** Sample peaks of a set of samples, per channel
+ *
+ * Magnitudes are in the scale of <code>replaygain_analyze()</code>; divide
+ * by 32768 for the ReplayGain peak.  A mono analysis reports the same for
+ * the first two channels; channels not analyzed are zero.
+ */
+struct replaygain_peak {
+	/** Largest magnitude */
+	double		peak[REPLAYGAIN_MAX_CHANNELS];
+	/** Samples of magnitude 32767 or more */
+	uint64_t	clipped[REPLAYGAIN_MAX_CHANNELS];
+	/** Largest magnitude of the signal oversampled 4x (ITU-R BS.1770
+	 * true peak); zero unless <code>replaygain_set_true_peak()</code>
+	 * enabled the meter */
+	double		true_peak[REPLAYGAIN_MAX_CHANNELS];
+};
+
 __BEGIN_DECLS
 
 /** Initialize the analyzing context
+ *
+ * Any sampling frequency from 8 to 384 kHz is accepted.  The published
+ * filters serve 8, 11.025, 12, 16, 22.05, 24, 32, 44.1 and 48 kHz; the
+ * filters for other frequencies are derived from those when the context is
+ * set up, and give results within about 0.1 dB of them for the same audio.
  *
  * \param[in] samplefreq	The sampling frequency
  * \param[out] out_status	An error/success indicator
@@ -128,19 +191,147 @@ struct replaygain_ctx *
 		replaygain_alloc(long samplefreq,
 		    enum replaygain_status *out_status);
 
-__INLINE void	replaygain_free(struct replaygain_ctx *ctx);
+/** Size of a context in the caller's memory
+ *
+ * The buffers are sized for the given limits, so that the context never
+ * allocates.  Room for the decimator is included if the frequency is high
+ * enough to use it.
+ *
+ * \param samplefreq	The highest sampling frequency it will be reset to
+ * \param channels	The most channels it will analyze at once
+ * \return	Bytes for <code>replaygain_init_in_place()</code>, or 0 if
+ *	either limit is out of range
+ */
+size_t		replaygain_ctx_size(long samplefreq, int channels);
+
+/** Initialize an analyzing context in the caller's memory
+ *
+ * The context works as one from <code>replaygain_alloc()</code>, except
+ * that it stays within the memory: resetting it to a higher frequency, or
+ * analyzing more channels, than it was sized for fails with
+ * <code>REPLAYGAIN_ERR_MEM</code>.  It needs no
+ * <code>replaygain_free()</code> (which does nothing to it); the memory
+ * may simply be reused.
+ *
+ * \param mem	<code>replaygain_ctx_size(samplefreq, channels)</code>
+ *	bytes, aligned as from <code>malloc()</code>
+ * \param samplefreq	The sampling frequency, and the highest it may be
+ *	reset to
+ * \param channels	The most channels it will analyze at once
+ * \param[out] out_status	An error/success indicator;
+ *	<code>REPLAYGAIN_ERROR</code> for a bad number of channels
+ * \retval NULL	An error occurred
+ * \return	The context, at <code>mem</code>
+ */
+struct replaygain_ctx *
+		replaygain_init_in_place(void *mem, long samplefreq,
+		    int channels, enum replaygain_status *out_status);
+
+void		replaygain_free(struct replaygain_ctx *ctx);
+
+/** Copy an analyzing context, with all its settings and state
+ *
+ * The copy is allocated, even of a context in place, and goes on from
+ * where the original is as if it had analyzed the same samples.
+ *
+ * \param ctx	The context to copy
+ * \param[out] out_status	An error/success indicator
+ * \retval NULL	Out of memory
+ * \return	The copy, to be passed to <code>replaygain_free()</code>
+ */
+struct replaygain_ctx *
+		replaygain_clone(const struct replaygain_ctx *ctx,
+		    enum replaygain_status *out_status);
+
+/** Encode the settings and state of a context, to resume its analysis
+ *
+ * Everything the analysis of the next samples depends on is kept: the
+ * filter and decimator histories, the partial window, the histogram, the
+ * horizon's windows and the peaks.  Analysis resumed from a checkpoint
+ * gives exactly what it would have without one, given the samples after
+ * those analyzed (so a decoder's position needs keeping alongside).  The
+ * encoding is versioned and the same on every platform.
+ *
+ * \param ctx	Analyzing context
+ * \param[out] out	The encoding, or null to only measure it
+ * \return	The length of the encoding in bytes
+ */
+size_t		replaygain_checkpoint(const struct replaygain_ctx *ctx,
+		    uint8_t *out);
+
+/** Resume from a checkpoint
+ *
+ * The context takes the settings and state of the checkpoint, all but the
+ * kernels, which stay its own.
+ *
+ * \param ctx	Analyzing context
+ * \param data	What <code>replaygain_checkpoint()</code> encoded
+ * \param len	Its length in bytes
+ * \retval REPLAYGAIN_ERROR	Malformed encoding, or of a version not known;
+ *	the context is unchanged
+ * \retval REPLAYGAIN_ERR_MEM	Out of memory, or more than a context in
+ *	place has room for; the context is reset
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_restore(struct replaygain_ctx *ctx,
+		    const uint8_t *data, size_t len);
+
+/** Forget the samples analyzed so far, and the filter state
+ *
+ * This is <code>replaygain_pop()</code> without the result, to start a new
+ * track after an abandoned one.  Nothing is allocated.
+ *
+ * \param ctx	The replaygain context
+ */
+void		replaygain_reset(struct replaygain_ctx *ctx);
 
 /** Reset the sampling frequency
+ *
+ * The context is left as it was on failure.
  *
  * \param ctx	    The replaygain context
  * \param freq	    The frequency to reset to
  * \retval REPLAYGAIN_ERR_SAMPLEFREQ
+ * \retval REPLAYGAIN_ERR_MEM	Its buffers could not be enlarged
  * \retval REPLAYGAIN_OK
  */
 enum replaygain_status
 		replaygain_reset_frequency(struct replaygain_ctx *ctx,
 		    long freq);
 
+/** Choose the analysis kernels for a context
+ *
+ * \param ctx	The replaygain context
+ * \param kernel	The kernels to use
+ * \retval REPLAYGAIN_ERROR	Not supported by this CPU or build
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_set_kernel(struct replaygain_ctx *ctx,
+		    enum replaygain_kernel kernel);
+
+/** The analysis kernels a context uses */
+enum replaygain_kernel
+		replaygain_get_kernel(const struct replaygain_ctx *ctx);
+
+/** Choose the arithmetic for a context
+ *
+ * This may change at any point; the filter state carries over.
+ *
+ * \param ctx	The replaygain context
+ * \param mode	The arithmetic to use
+ * \retval REPLAYGAIN_ERROR	Unknown mode
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_set_mode(struct replaygain_ctx *ctx,
+		    enum replaygain_mode mode);
+
+/** The arithmetic a context uses */
+enum replaygain_mode
+		replaygain_get_mode(const struct replaygain_ctx *ctx);
+
 /** Accumulate samples into a calculation
  *
  * The range of the samples should be is [-32767.0,32767.0].
@@ -150,7 +341,8 @@ enum replaygain_status
  * \param right_samples	Samples for the right channel; ignored for
  *	single-channel
  * \param num_samples	Number of samples
- * \param num_channels	Number of channels
+ * \param num_channels	Number of channels, 1 or 2; see
+ *	<code>replaygain_analyze_planar()</code> for more
  * \retval REPLAYGAIN_ERROR	Bad number of channels or some exceptional
  *	error
  */
@@ -159,6 +351,328 @@ enum replaygain_status
 		    const double *left_samples, const double *right_samples,
 		    size_t num_samples, int num_channels);
 
+/** Accumulate samples of any number of channels into a calculation
+ *
+ * Each window's mean square is the sum of the channels' mean squares,
+ * weighted as by <code>replaygain_set_weight()</code> and halved, so a
+ * stereo pair measures as with <code>replaygain_analyze()</code>.  The
+ * channels are filtered side by side in SIMD registers, two or four at a
+ * time, in a single pass over the buffers.
+ *
+ * The number of channels may change from one call to the next; the
+ * channels of a window are those of the call that fills it.
+ *
+ * \param ctx	Analyzing context
+ * \param samples	One array of samples for each channel
+ * \param num_samples	Number of samples per channel
+ * \param num_channels	Number of channels, 1 to
+ *	<code>REPLAYGAIN_MAX_CHANNELS</code>
+ * \retval REPLAYGAIN_ERROR	Bad number of channels or some exceptional
+ *	error
+ * \retval REPLAYGAIN_ERR_MEM	The filters of more channels could not be
+ *	allocated
+ * \see replaygain_analyze()
+ */
+enum replaygain_status
+		replaygain_analyze_planar(struct replaygain_ctx *ctx,
+		    const double *const *samples, size_t num_samples,
+		    int num_channels);
+
+/** Accumulate 16-bit samples of any number of channels
+ *
+ * \see replaygain_analyze_planar(), replaygain_analyze_s16()
+ */
+enum replaygain_status
+		replaygain_analyze_planar_s16(struct replaygain_ctx *ctx,
+		    const int16_t *const *samples, size_t num_samples,
+		    int num_channels);
+
+/** Accumulate 32-bit samples of any number of channels
+ *
+ * \see replaygain_analyze_planar(), replaygain_analyze_s32()
+ */
+enum replaygain_status
+		replaygain_analyze_planar_s32(struct replaygain_ctx *ctx,
+		    const int32_t *const *samples, size_t num_samples,
+		    int num_channels);
+
+/** Accumulate floating-point samples of any number of channels
+ *
+ * \see replaygain_analyze_planar(), replaygain_analyze_f32()
+ */
+enum replaygain_status
+		replaygain_analyze_planar_f32(struct replaygain_ctx *ctx,
+		    const float *const *samples, size_t num_samples,
+		    int num_channels);
+
+/** Accumulate samples of a number of tracks, each into its own context
+ *
+ * Consecutive tracks whose contexts have the same frequency, mode and
+ * kernels, and no decimator, are filtered in step, up to sixteen at a
+ * time, with the channel pairs of different tracks side by side in the
+ * SIMD registers.  In the double mode with AVX2, a mono or stereo track
+ * fills half a register, so such tracks go up to twice as fast as one by
+ * one.  Other tracks are analyzed as by
+ * <code>replaygain_analyze_planar()</code>.
+ *
+ * Each context keeps its own histogram and peaks.  The gains may differ
+ * from those of separate calls in the last bits, as the windows' sums are
+ * taken in different pieces.
+ *
+ * \param ctxs	One analyzing context per track, all different
+ * \param samples	Per track, one array of samples for each channel
+ * \param num_samples	Per track, the number of samples per channel
+ * \param num_tracks	Number of tracks
+ * \param num_channels	Number of channels of every track, 1 to
+ *	<code>REPLAYGAIN_MAX_CHANNELS</code>
+ * \retval REPLAYGAIN_ERROR	Bad number of channels or some exceptional
+ *	error
+ * \retval REPLAYGAIN_ERR_MEM	The filters of more channels could not be
+ *	allocated
+ * \see replaygain_analyze_planar()
+ */
+enum replaygain_status
+		replaygain_analyze_batch(struct replaygain_ctx *const *ctxs,
+		    const double *const *const *samples,
+		    const size_t *num_samples, size_t num_tracks,
+		    int num_channels);
+
+/** Change the weight of a channel
+ *
+ * Unless changed, the weights are 1.0, except as for
+ * <code>r128_alloc()</code>: with five channels (L, R, C, Ls, Rs), the
+ * surround channels weigh 1.41; with six (L, R, C, LFE, Ls, Rs) the LFE
+ * channel is also left out; and with eight (L, R, C, LFE, Lb, Rb, Ls, Rs)
+ * the LFE channel is left out and the side channels weigh 1.41.  A weight
+ * once set holds for any number of channels.
+ *
+ * \param ctx	Analyzing context
+ * \param channel	The channel, from zero
+ * \param weight	Its weight; 0.0 leaves it out
+ * \retval REPLAYGAIN_ERROR	No such channel
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_set_weight(struct replaygain_ctx *ctx, int channel,
+		    double weight);
+
+/** Accumulate 16-bit samples into a calculation
+ *
+ * The samples are converted in small blocks as they are filtered, so no
+ * <code>double</code> copy of the input is needed.
+ *
+ * \see replaygain_analyze()
+ */
+enum replaygain_status
+		replaygain_analyze_s16(struct replaygain_ctx *ctx,
+		    const int16_t *left_samples, const int16_t *right_samples,
+		    size_t num_samples, int num_channels);
+
+/** Accumulate 32-bit samples into a calculation
+ *
+ * The full range of <code>int32_t</code> is scaled to that of 16-bit
+ * samples.
+ *
+ * \see replaygain_analyze_s16()
+ */
+enum replaygain_status
+		replaygain_analyze_s32(struct replaygain_ctx *ctx,
+		    const int32_t *left_samples, const int32_t *right_samples,
+		    size_t num_samples, int num_channels);
+
+/** Accumulate floating-point samples into a calculation
+ *
+ * The range of the samples should be [-1.0,1.0].
+ *
+ * \see replaygain_analyze_s16()
+ */
+enum replaygain_status
+		replaygain_analyze_f32(struct replaygain_ctx *ctx,
+		    const float *left_samples, const float *right_samples,
+		    size_t num_samples, int num_channels);
+
+/** Accumulate interleaved frames into a calculation
+ *
+ * Frames are split into channels in small blocks as they are filtered.
+ *
+ * \param ctx	Analyzing context
+ * \param frames	Samples, one from each channel per frame (LRLR...)
+ * \param num_frames	Number of frames
+ * \param num_channels	Number of channels, 1 to
+ *	<code>REPLAYGAIN_MAX_CHANNELS</code>
+ * \retval REPLAYGAIN_ERROR	Bad number of channels or some exceptional
+ *	error
+ * \see replaygain_analyze()
+ */
+enum replaygain_status
+		replaygain_analyze_interleaved(struct replaygain_ctx *ctx,
+		    const double *frames, size_t num_frames,
+		    int num_channels);
+
+/** Accumulate interleaved 16-bit frames into a calculation
+ *
+ * \see replaygain_analyze_interleaved(), replaygain_analyze_s16()
+ */
+enum replaygain_status
+		replaygain_analyze_interleaved_s16(
+		    struct replaygain_ctx *ctx, const int16_t *frames,
+		    size_t num_frames, int num_channels);
+
+/** Accumulate interleaved 32-bit frames into a calculation
+ *
+ * \see replaygain_analyze_interleaved(), replaygain_analyze_s32()
+ */
+enum replaygain_status
+		replaygain_analyze_interleaved_s32(
+		    struct replaygain_ctx *ctx, const int32_t *frames,
+		    size_t num_frames, int num_channels);
+
+/** Accumulate interleaved floating-point frames into a calculation
+ *
+ * \see replaygain_analyze_interleaved(), replaygain_analyze_f32()
+ */
+enum replaygain_status
+		replaygain_analyze_interleaved_f32(
+		    struct replaygain_ctx *ctx, const float *frames,
+		    size_t num_frames, int num_channels);
+
+/** Peaks of the samples analyzed since the last pop
+ *
+ * These are tracked in the filter loops, so cost next to nothing.  Read
+ * them before <code>replaygain_pop()</code>, which clears them.
+ *
+ * \param ctx	Analyzing context
+ * \param[out] out	The peaks
+ */
+void		replaygain_get_peak(const struct replaygain_ctx *ctx,
+		    struct replaygain_peak *out);
+
+/** Enable or disable the true-peak meter
+ *
+ * The meter oversamples the input 4x with the interpolating filter of
+ * ITU-R BS.1770 and keeps the largest magnitude, as
+ * <code>replaygain_peak.true_peak</code>.  It is off by default; with the
+ * AVX2 kernels it adds about a quarter to the time of the analysis.
+ *
+ * \param ctx	Analyzing context
+ * \param enable	Nonzero to run the meter
+ */
+void		replaygain_set_true_peak(struct replaygain_ctx *ctx,
+		    int enable);
+
+/** Enable or disable the dual-mono detector
+ *
+ * A mono input, or a stereo one given the same array twice, is filtered
+ * only once.  With the detector, each block of a pair of channels is also
+ * compared, and two that have held the same samples since the analysis
+ * began are filtered as one too, the result being exactly that of filtering
+ * both.  It is off by default; the comparison is cheap next to the
+ * filters, but gains nothing for true stereo.  The gain depends on the
+ * kernel: the scalar one takes half the time, and the SSE2 one a fifth
+ * less in single precision or with the true-peak meter; otherwise the two
+ * channels share a register and cost what one does.
+ *
+ * \param ctx	Analyzing context
+ * \param enable	Nonzero to compare the channels
+ */
+void		replaygain_set_dual_mono(struct replaygain_ctx *ctx,
+		    int enable);
+
+/** Keep only the most recent windows, for a stream without end
+ *
+ * With a horizon, the context counts only the RMS windows of the last
+ * <code>ms</code> milliseconds of samples: as each window completes, the
+ * oldest beyond the horizon is taken out of the histogram.  The memory
+ * stays the same however long the stream runs, two bytes per 50 ms window,
+ * or about 140 kB a day of horizon.  Read the gain as the stream goes with
+ * <code>replaygain_running_adjustment()</code>; <code>replaygain_pop()</code>
+ * gives the windows within the horizon.
+ *
+ * The windows counted so far are forgotten; the filter state, the window
+ * being filled and the peaks are kept.
+ *
+ * \param ctx	Analyzing context
+ * \param ms	The horizon [ms], rounded up to whole windows; 0 to count
+ *	every window, the default
+ * \retval REPLAYGAIN_ERR_MEM	The ring of windows could not be
+ *	allocated, or the context is in the caller's memory; the horizon is
+ *	unchanged
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_set_horizon(struct replaygain_ctx *ctx,
+		    unsigned long ms);
+
+/** Enable or disable the decimator
+ *
+ * At 88.2 kHz and up, the decimator halves the sampling frequency with
+ * half-band filters, as often as it takes to reach 44.1 or 48 kHz, ahead
+ * of the analysis, which takes a third to half off the time at 176.4 kHz
+ * and up.  The half-band filters are flat to 16 kHz and block what would
+ * alias below it; the adjustment then comes out as it would for a 44.1 or
+ * 48 kHz recording, within about 0.1 dB of the undecimated one.
+ * Sample peaks are still of the input, but the true peak is measured on
+ * the decimated signal.  At other frequencies this has no effect.  It is
+ * off by default.
+ *
+ * The context is reset, as by <code>replaygain_reset_frequency()</code>.
+ *
+ * \param ctx	Analyzing context
+ * \param enable	Nonzero to decimate
+ * \retval REPLAYGAIN_ERR_MEM	Its buffers could not be allocated
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_set_decimate(struct replaygain_ctx *ctx,
+		    int enable);
+
+/** Combine the peaks of one sample with another
+ *
+ * \param sum	The accumulated peaks
+ * \param addition	The peaks to add to <code>sum</code>
+ */
+void		replaygain_peak_accum(struct replaygain_peak *sum,
+		    const struct replaygain_peak *addition);
+
+/** Forget the windows analyzed so far, keeping the filter state
+ *
+ * This warms a context up: analyze some samples preceding the ones of
+ * interest, discard, then analyze the rest.  The filters forget their
+ * initial state quickly; <code>REPLAYGAIN_WARMUP_MS</code> of warm-up is
+ * enough for the analysis of a chunk of a stream to match that of the
+ * whole stream as described for <code>analyze_parallel()</code> in
+ * gain_analysis.hpp.  A partly-filled RMS window is dropped too.
+ *
+ * Peaks are forgotten as well.
+ *
+ * \param ctx	Analyzing context
+ */
+void		replaygain_discard(struct replaygain_ctx *ctx);
+
+/** Samples per channel in an RMS window
+ *
+ * Chunks of a stream analyzed separately and accumulated give the same
+ * windows as the whole stream only if they begin on a window boundary.
+ *
+ * \param ctx	Analyzing context
+ */
+size_t		replaygain_window_size(const struct replaygain_ctx *ctx);
+
+/** Decibal adjustment for the windows analyzed so far
+ *
+ * This is <code>replaygain_adjustment()</code> of what
+ * <code>replaygain_pop()</code> would return, without resetting the
+ * context.  The context keeps its histogram as a Fenwick tree too, so this
+ * takes time logarithmic in the number of bins rather than a scan of them,
+ * and may be called as often as a display needs.
+ *
+ * \param ctx	Analyzing context
+ * \return	How many decibals to adjust by, or
+ *	<code>GAIN_NOT_ENOUGH_SAMPLES</code> if no window is complete
+ */
+double		replaygain_running_adjustment(
+		    const struct replaygain_ctx *ctx);
+
 /** Return current calculation, reset context
  *
  * \param ctx	Analyzing context
@@ -172,33 +686,106 @@ void		replaygain_pop(struct replaygain_ctx *ctx,
  * \param sum	The accumulated value
  * \param addition	The value to add to <code>sum</code>
  */
-__INLINE void	replaygain_accum(struct replaygain_value *sum,
+void		replaygain_accum(struct replaygain_value *sum,
 		    const struct replaygain_value *addition);
 
-/** Decibal adjustment for a sample
+/** Encode a value in compact form
  *
- * \param value	A value calculation
- * \return	How many decibals to adjust by
+ * The compact form keeps only the occupied bins, typically a few bytes
+ * each; a track's value takes a few kilobytes instead of
+ * <code>sizeof(struct replaygain_value)</code>.
+ *
+ * \param value	The value to encode
+ * \param[out] out	The encoding, or null to only measure it
+ * \return	The length of the encoding in bytes
  */
-double		replaygain_adjustment(const struct replaygain_value *value);
+size_t		replaygain_compact(const struct replaygain_value *value,
+		    uint8_t *out);
+
+/** Decode a value from compact form
+ *
+ * \param bins	The encoding
+ * \param len	Its length in bytes
+ * \param[out] out	The value
+ * \retval REPLAYGAIN_ERROR	Malformed encoding
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_expand(const uint8_t *bins, size_t len,
+		    struct replaygain_value *out);
 
+/** Return current calculation in compact form, reset context
+ *
+ * \param ctx	Analyzing context
+ * \param[out] out	The encoding
+ * \param capacity	The room at <code>out</code> in bytes
+ * \return	The length of the encoding; if greater than
+ *	<code>capacity</code>, nothing is written and the context is
+ *	unchanged
+ */
+size_t		replaygain_pop_compact(struct replaygain_ctx *ctx,
+		    uint8_t *out, size_t capacity);
 
+/** Combine two values in compact form
+ *
+ * This takes time proportional to the occupied bins.
+ *
+ * \param a	One encoding
+ * \param alen	Its length
+ * \param b	The other encoding
+ * \param blen	Its length
+ * \param[out] out	The encoding of the sum, or null to only measure it;
+ *	never longer than <code>alen + blen</code>
+ * \return	The length of the sum's encoding
+ */
+size_t		replaygain_compact_merge(const uint8_t *a, size_t alen,
+		    const uint8_t *b, size_t blen, uint8_t *out);
 
+/** Decibal adjustment for a value in compact form
+ *
+ * \see replaygain_adjustment()
+ */
+double		replaygain_compact_adjustment(const uint8_t *bins,
+		    size_t len);
 
-__INLINE void
-replaygain_free(struct replaygain_ctx *ctx) {
-	free(ctx);
-}
+/** Encode a value in compact form and its peaks for storage
+ *
+ * The encoding is versioned and the same on every platform, so the values
+ * of a library's tracks may be kept and an album's adjustment found again
+ * from them, without decoding any audio.
+ *
+ * \param bins	The value in compact form
+ * \param len	Its length in bytes
+ * \param peak	The peaks
+ * \param[out] out	The encoding, or null to only measure it
+ * \return	The length of the encoding in bytes
+ */
+size_t		replaygain_serialize(const uint8_t *bins, size_t len,
+		    const struct replaygain_peak *peak, uint8_t *out);
 
-__INLINE void
-replaygain_accum(struct replaygain_value *sum,
-    const struct replaygain_value *addition) {
-	for (size_t i = 0; i < ANALYZE_SIZE; i++)
-		sum->value[i] += addition->value[i];
-}
+/** Decode a value and its peaks from <code>replaygain_serialize()</code>
+ *
+ * \param data	The encoding
+ * \param len	Its length in bytes
+ * \param[out] bins	The value in compact form, pointing into
+ *	<code>data</code>
+ * \param[out] bins_len	Its length in bytes
+ * \param[out] peak	The peaks
+ * \retval REPLAYGAIN_ERROR	Malformed encoding, or of a version not known
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		replaygain_deserialize(const uint8_t *data, size_t len,
+		    const uint8_t **bins, size_t *bins_len,
+		    struct replaygain_peak *peak);
 
-__END_DECLS
+/** Decibal adjustment for a sample
+ *
+ * \param value	A value calculation
+ * \return	How many decibals to adjust by
+ */
+double		replaygain_adjustment(const struct replaygain_value *value);
 
-#undef __INLINE
+__END_DECLS
 
 #endif /* GAIN_ANALYSIS_H */
@@ -61,21 +61,38 @@
 #ifndef GAIN_ANALYSIS_HPP
 #define GAIN_ANALYSIS_HPP
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <memory>
 #include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <multigain/errors.hpp>
 #include <multigain/gain_analysis.h>
 
 namespace multigain {
 
-/** A sample of a Replaygain calculation */
+/** A linear true peak in decibels relative to full scale */
+inline double
+true_peak_db(double peak) {
+	return 20 * std::log10(peak / 32768);
+}
+
+/** A sample of a Replaygain calculation
+ *
+ * The value is held in the compact form of <code>replaygain_compact()</code>,
+ * a few kilobytes per track.
+ */
 class Sample {
 public:
 	/** Real initialization comes from Analyzer::pop(). */
-	Sample() : _dirty(true) {}
+	Sample() : _peak(), _dirty(true) {}
 
 	/** How much to adjust by
 	 *
@@ -88,7 +105,8 @@ public:
 	double adjustment() const {
 		double	v;
 		if (_dirty) {
-			v = replaygain_adjustment(&_value);
+			v = replaygain_compact_adjustment(_value.data(),
+			    _value.size());
 			const_cast<Sample *>(this)->_cached = v;
 			const_cast<Sample *>(this)->_dirty = false;
 		} else
@@ -97,11 +115,80 @@ public:
 		return v;
 	}
 
+	/** Largest sample magnitude of any channel
+	 *
+	 * \see replaygain_peak
+	 */
+	double peak() const {
+		return *std::max_element(_peak.peak,
+		    _peak.peak + REPLAYGAIN_MAX_CHANNELS);
+	}
+
+	/** Largest sample magnitude of a channel (0 left, 1 right, ...) */
+	double peak(int channel) const {
+		return _peak.peak[channel];
+	}
+
+	/** Samples of a channel at full scale (0 left, 1 right, ...) */
+	uint64_t clipped(int channel) const {
+		return _peak.clipped[channel];
+	}
+
+	/** True peak of any channel [dBTP]
+	 *
+	 * Minus infinity unless Analyzer::true_peak() enabled the meter.
+	 */
+	double true_peak() const {
+		return true_peak_db(*std::max_element(_peak.true_peak,
+		    _peak.true_peak + REPLAYGAIN_MAX_CHANNELS));
+	}
+
+	/** True peak of a channel (0 left, 1 right, ...) [dBTP] */
+	double true_peak(int channel) const {
+		return true_peak_db(_peak.true_peak[channel]);
+	}
+
+	/** Expand to the full histogram */
+	void value(struct replaygain_value *out) const {
+		replaygain_expand(_value.data(), _value.size(), out);
+	}
+
+	/** Encode the value and peaks for storage
+	 *
+	 * \see replaygain_serialize()
+	 */
+	std::vector<uint8_t> save() const {
+		std::vector<uint8_t> out(replaygain_serialize(_value.data(),
+		    _value.size(), &_peak, 0));
+
+		replaygain_serialize(_value.data(), _value.size(), &_peak,
+		    out.data());
+		return out;
+	}
+
+	/** Decode what save() of a Sample or a Sample_accum encoded
+	 *
+	 * \throw Bad_format	Malformed encoding, or of a version not known
+	 */
+	void load(const uint8_t *data, size_t len) {
+		struct replaygain_peak	peak;
+		const uint8_t		*bins;
+		size_t			bins_len;
+
+		if (replaygain_deserialize(data, len, &bins, &bins_len,
+		    &peak) != REPLAYGAIN_OK)
+			throw Bad_format("bad ReplayGain value");
+		_value.assign(bins, bins + bins_len);
+		_peak = peak;
+		_dirty = true;
+	}
+
 private:
 	friend class Analyzer;
 	friend class Sample_accum;
 
-	struct replaygain_value	_value;
+	std::vector<uint8_t>	_value;
+	struct replaygain_peak	_peak;
 	double			_cached;
 	bool			_dirty;
 };
@@ -117,7 +204,8 @@ public:
 	/** Reset the sum to zero */
 	void reset() {
 		_dirty = true;
-		memset(&_sum, 0, sizeof(_sum));
+		_sum.clear();
+		_peak = replaygain_peak();
 	}
 
 	/** Combine result of one sample with another
@@ -129,11 +217,19 @@ public:
 	}
 
 	/** Combine result of one sample with another
+	 *
+	 * This takes time proportional to the occupied bins.
 	 *
 	 * \param value	The value to add
 	 */
 	Sample_accum &operator+=(const Sample &value) {
-		replaygain_accum(&_sum, &value._value);
+		std::vector<uint8_t> sum(_sum.size() + value._value.size());
+
+		sum.resize(replaygain_compact_merge(_sum.data(), _sum.size(),
+		    value._value.data(), value._value.size(), sum.data()));
+		_sum.swap(sum);
+		replaygain_peak_accum(&_peak, &value._peak);
+		_dirty = true;
 		return *this;
 	}
 
@@ -148,7 +244,8 @@ public:
 	double adjustment() const {
 		double	v;
 		if (_dirty) {
-			v = replaygain_adjustment(&_sum);
+			v = replaygain_compact_adjustment(_sum.data(),
+			    _sum.size());
 			const_cast<Sample_accum *>(this)->_cached = v;
 			const_cast<Sample_accum *>(this)->_dirty = false;
 		} else
@@ -157,8 +254,75 @@ public:
 		return v;
 	}
 
+	/** Largest sample magnitude of any channel
+	 *
+	 * \see replaygain_peak
+	 */
+	double peak() const {
+		return *std::max_element(_peak.peak,
+		    _peak.peak + REPLAYGAIN_MAX_CHANNELS);
+	}
+
+	/** Largest sample magnitude of a channel (0 left, 1 right, ...) */
+	double peak(int channel) const {
+		return _peak.peak[channel];
+	}
+
+	/** Samples of a channel at full scale (0 left, 1 right, ...) */
+	uint64_t clipped(int channel) const {
+		return _peak.clipped[channel];
+	}
+
+	/** True peak of any channel [dBTP]
+	 *
+	 * Minus infinity unless Analyzer::true_peak() enabled the meter.
+	 */
+	double true_peak() const {
+		return true_peak_db(*std::max_element(_peak.true_peak,
+		    _peak.true_peak + REPLAYGAIN_MAX_CHANNELS));
+	}
+
+	/** True peak of a channel (0 left, 1 right, ...) [dBTP] */
+	double true_peak(int channel) const {
+		return true_peak_db(_peak.true_peak[channel]);
+	}
+
+	/** Encode the sum for storage, readable by Sample::load() too
+	 *
+	 * \see replaygain_serialize()
+	 */
+	std::vector<uint8_t> save() const {
+		std::vector<uint8_t> out(replaygain_serialize(_sum.data(),
+		    _sum.size(), &_peak, 0));
+
+		replaygain_serialize(_sum.data(), _sum.size(), &_peak,
+		    out.data());
+		return out;
+	}
+
+	/** Replace the sum with what save() of a Sample or a Sample_accum
+	 * encoded, to go on adding to it
+	 *
+	 * \throw Bad_format	Malformed encoding, or of a version not known
+	 */
+	void load(const uint8_t *data, size_t len) {
+		struct replaygain_peak	peak;
+		const uint8_t		*bins;
+		size_t			bins_len;
+
+		if (replaygain_deserialize(data, len, &bins, &bins_len,
+		    &peak) != REPLAYGAIN_OK)
+			throw Bad_format("bad ReplayGain value");
+		_sum.assign(bins, bins + bins_len);
+		_peak = peak;
+		_dirty = true;
+	}
+
 private:
-	struct replaygain_value	_sum;
+	friend class Analyzer;
+
+	std::vector<uint8_t>	_sum;
+	struct replaygain_peak	_peak;
 	double			_cached;
 	bool			_dirty;
 };
@@ -169,9 +333,11 @@ public:
 	/** Construct the analyzer object
 	 *
 	 * \param samplefreq	The input sample frequency
+	 * \param mode		The filter arithmetic
 	 * \throw Bad_samplefreq
 	 */
-	Analyzer(long freq) : _ctx(0) {
+	Analyzer(long freq,
+	    enum replaygain_mode mode = REPLAYGAIN_MODE_DOUBLE) : _ctx(0) {
 		enum replaygain_status	status;
 		_ctx = replaygain_alloc(freq, &status);
 		switch (status) {
@@ -184,13 +350,86 @@ public:
 		default:
 			assert(0);
 		}
+		replaygain_set_mode(_ctx, mode);
+	}
+
+	/** Take over the context of another analyzer
+	 *
+	 * The other is left empty, fit only to be destroyed or assigned to.
+	 */
+	Analyzer(Analyzer &&other) noexcept : _ctx(other._ctx) {
+		other._ctx = 0;
 	}
 
 	~Analyzer() noexcept {
 		replaygain_free(_ctx);
 	}
 
+	Analyzer(const Analyzer &) = delete;
+	void operator=(const Analyzer &) = delete;
+
+	/** Exchange contexts with another analyzer */
+	Analyzer &operator=(Analyzer &&other) noexcept {
+		std::swap(_ctx, other._ctx);
+		return *this;
+	}
+
+	/** A copy that goes on from where this analyzer is
+	 *
+	 * \throw std::bad_alloc
+	 * \see replaygain_clone()
+	 */
+	Analyzer clone() const {
+		struct replaygain_ctx	*ctx = replaygain_clone(_ctx, 0);
+
+		if (!ctx)
+			throw std::bad_alloc();
+		return Analyzer(ctx);
+	}
+
+	/** Encode the settings and state, to resume from later
+	 *
+	 * \see replaygain_checkpoint()
+	 */
+	std::vector<uint8_t> checkpoint() const {
+		std::vector<uint8_t> out(replaygain_checkpoint(_ctx, 0));
+
+		replaygain_checkpoint(_ctx, out.data());
+		return out;
+	}
+
+	/** Resume from what checkpoint() encoded
+	 *
+	 * \throw Bad_format	Malformed encoding, or of a version not known
+	 * \throw std::bad_alloc
+	 * \see replaygain_restore()
+	 */
+	void restore(const uint8_t *data, size_t len) {
+		switch (replaygain_restore(_ctx, data, len)) {
+		case REPLAYGAIN_OK:
+			break;
+		case REPLAYGAIN_ERR_MEM:
+			throw std::bad_alloc();
+		default:
+			throw Bad_format("bad analyzer checkpoint");
+		}
+	}
+
+	/** Forget everything analyzed, for a new track
+	 *
+	 * Nothing is allocated; together with reset_sample_frequency(), this
+	 * lets one analyzer serve any number of files.
+	 *
+	 * \see replaygain_reset()
+	 */
+	void reset() {
+		replaygain_reset(_ctx);
+	}
+
 	/** Reset the sampling frequency
+	 *
+	 * The buffers are only reallocated for a higher frequency than any
+	 * before.
 	 *
 	 * \param freq	    The frequency to reset to
 	 * \retval false    Bad sample frequency
@@ -200,6 +439,36 @@ public:
 		    REPLAYGAIN_OK;
 	}
 
+	/** Choose the analysis kernels
+	 *
+	 * \param kernel	The kernels to use;
+	 *	<code>REPLAYGAIN_KERNEL_SCALAR</code> forces the reference
+	 *	code
+	 * \retval false	Not supported by this CPU or build
+	 */
+	bool kernel(enum replaygain_kernel kernel) {
+		return replaygain_set_kernel(_ctx, kernel) == REPLAYGAIN_OK;
+	}
+
+	/** The analysis kernels in use */
+	enum replaygain_kernel kernel() const {
+		return replaygain_get_kernel(_ctx);
+	}
+
+	/** Choose the filter arithmetic
+	 *
+	 * \param mode	The arithmetic to use from the next samples on
+	 * \retval false	Unknown mode
+	 */
+	bool mode(enum replaygain_mode mode) {
+		return replaygain_set_mode(_ctx, mode) == REPLAYGAIN_OK;
+	}
+
+	/** The filter arithmetic in use */
+	enum replaygain_mode mode() const {
+		return replaygain_get_mode(_ctx);
+	}
+
 	/** Accumulate samples into a calculation
 	 *
 	 * The range of the samples should be is [-32767.0,32767.0].
@@ -221,18 +490,325 @@ public:
 		return status == REPLAYGAIN_OK;
 	}
 
+	/** Accumulate 16-bit samples into a calculation
+	 *
+	 * \see add(const double *, const double *, size_t, int)
+	 */
+	bool add(const int16_t *left_samples, const int16_t *right_samples,
+	    size_t num_samples, int num_channels) {
+		return replaygain_analyze_s16(_ctx, left_samples,
+		    right_samples, num_samples, num_channels) ==
+		    REPLAYGAIN_OK;
+	}
+
+	/** Accumulate 32-bit samples into a calculation
+	 *
+	 * The full range of <code>int32_t</code> is scaled to that of
+	 * 16-bit samples.
+	 */
+	bool add(const int32_t *left_samples, const int32_t *right_samples,
+	    size_t num_samples, int num_channels) {
+		return replaygain_analyze_s32(_ctx, left_samples,
+		    right_samples, num_samples, num_channels) ==
+		    REPLAYGAIN_OK;
+	}
+
+	/** Accumulate floating-point samples into a calculation
+	 *
+	 * The range of the samples should be [-1.0,1.0].
+	 */
+	bool add(const float *left_samples, const float *right_samples,
+	    size_t num_samples, int num_channels) {
+		return replaygain_analyze_f32(_ctx, left_samples,
+		    right_samples, num_samples, num_channels) ==
+		    REPLAYGAIN_OK;
+	}
+
+	/** Accumulate samples of any number of channels into a calculation
+	 *
+	 * \param samples	One array per channel; <code>double</code>,
+	 *	<code>float</code>, <code>int16_t</code>, or
+	 *	<code>int32_t</code>, scaled as for add()
+	 * \param num_samples	Number of samples per channel
+	 * \param num_channels	Number of channels, 1 to
+	 *	<code>REPLAYGAIN_MAX_CHANNELS</code>
+	 * \retval false	Bad number of channels or some exceptional
+	 *	event
+	 * \see replaygain_analyze_planar()
+	 */
+	bool add(const double *const *samples, size_t num_samples,
+	    int num_channels) {
+		return replaygain_analyze_planar(_ctx, samples,
+		    num_samples, num_channels) == REPLAYGAIN_OK;
+	}
+
+	bool add(const int16_t *const *samples, size_t num_samples,
+	    int num_channels) {
+		return replaygain_analyze_planar_s16(_ctx, samples,
+		    num_samples, num_channels) == REPLAYGAIN_OK;
+	}
+
+	bool add(const int32_t *const *samples, size_t num_samples,
+	    int num_channels) {
+		return replaygain_analyze_planar_s32(_ctx, samples,
+		    num_samples, num_channels) == REPLAYGAIN_OK;
+	}
+
+	bool add(const float *const *samples, size_t num_samples,
+	    int num_channels) {
+		return replaygain_analyze_planar_f32(_ctx, samples,
+		    num_samples, num_channels) == REPLAYGAIN_OK;
+	}
+
+	/** Change the weight of a channel
+	 *
+	 * \retval false	No such channel
+	 * \see replaygain_set_weight()
+	 */
+	bool weight(int channel, double weight) {
+		return replaygain_set_weight(_ctx, channel, weight) ==
+		    REPLAYGAIN_OK;
+	}
+
+	/** Accumulate interleaved frames into a calculation
+	 *
+	 * \param frames	Samples, one from each channel per frame
+	 *	(LRLR...); <code>double</code>, <code>float</code>,
+	 *	<code>int16_t</code>, or <code>int32_t</code>, scaled as for
+	 *	add()
+	 * \param num_frames	Number of frames
+	 * \param num_channels	Number of channels
+	 * \retval false	Bad number of channels or some exceptional
+	 *	event
+	 */
+	bool add_interleaved(const double *frames, size_t num_frames,
+	    int num_channels) {
+		return replaygain_analyze_interleaved(_ctx, frames,
+		    num_frames, num_channels) == REPLAYGAIN_OK;
+	}
+
+	bool add_interleaved(const int16_t *frames, size_t num_frames,
+	    int num_channels) {
+		return replaygain_analyze_interleaved_s16(_ctx, frames,
+		    num_frames, num_channels) == REPLAYGAIN_OK;
+	}
+
+	bool add_interleaved(const int32_t *frames, size_t num_frames,
+	    int num_channels) {
+		return replaygain_analyze_interleaved_s32(_ctx, frames,
+		    num_frames, num_channels) == REPLAYGAIN_OK;
+	}
+
+	bool add_interleaved(const float *frames, size_t num_frames,
+	    int num_channels) {
+		return replaygain_analyze_interleaved_f32(_ctx, frames,
+		    num_frames, num_channels) == REPLAYGAIN_OK;
+	}
+
+	/** Enable or disable the true-peak meter
+	 *
+	 * \see replaygain_set_true_peak()
+	 */
+	void true_peak(bool enable) {
+		replaygain_set_true_peak(_ctx, enable);
+	}
+
+	/** Enable or disable the dual-mono detector
+	 *
+	 * \see replaygain_set_dual_mono()
+	 */
+	void dual_mono(bool enable) {
+		replaygain_set_dual_mono(_ctx, enable);
+	}
+
+	/** Count only the windows of the last <code>ms</code> milliseconds,
+	 * forgetting those so far; 0 for all of them
+	 *
+	 * \throw std::bad_alloc
+	 * \see replaygain_set_horizon()
+	 */
+	void horizon(unsigned long ms) {
+		if (replaygain_set_horizon(_ctx, ms) != REPLAYGAIN_OK)
+			throw std::bad_alloc();
+	}
+
+	/** Enable or disable the decimator, resetting the analysis
+	 *
+	 * \throw std::bad_alloc
+	 * \see replaygain_set_decimate()
+	 */
+	void decimate(bool enable) {
+		if (replaygain_set_decimate(_ctx, enable) != REPLAYGAIN_OK)
+			throw std::bad_alloc();
+	}
+
+	/** Forget the windows analyzed so far, keeping the filter state
+	 *
+	 * \see replaygain_discard()
+	 */
+	void discard() {
+		replaygain_discard(_ctx);
+	}
+
+	/** Adjustment for the samples analyzed so far, without a pop()
+	 *
+	 * \return	The adjustment
+	 * \throw Not_enough_samples	...
+	 * \see replaygain_running_adjustment()
+	 */
+	double running_adjustment() const {
+		double	v = replaygain_running_adjustment(_ctx);
+
+		if (v == GAIN_NOT_ENOUGH_SAMPLES) throw Not_enough_samples();
+		return v;
+	}
+
+	/** Samples per channel in an RMS window */
+	size_t window_size() const {
+		return replaygain_window_size(_ctx);
+	}
+
 	/** Return current calculation, reset context
 	 *
-	 * \param[out] out	The accumulated Replaygain value
+	 * \param[out] out	The accumulated Replaygain value and peaks
 	 */
 	void pop(Sample *out) {
-		replaygain_pop(_ctx, &out->_value);
+		size_t	len;
+
+		replaygain_get_peak(_ctx, &out->_peak);
+		len = replaygain_pop_compact(_ctx, 0, 0);
+		if (len) {
+			out->_value.resize(len);
+			replaygain_pop_compact(_ctx, out->_value.data(), len);
+		} else
+			out->_value.clear();
+		out->_dirty = true;
+	}
+
+	/** Analyze a whole stream on several threads
+	 *
+	 * The stream is cut into chunks on RMS window boundaries, and each
+	 * chunk is analyzed on its own thread. Before every chunk but the
+	 * first, <code>REPLAYGAIN_WARMUP_MS</code> of the preceding samples
+	 * are run through the filters and discarded, so the filters have
+	 * settled. The chunks' values are then merged.
+	 *
+	 * Each window's level differs from that of a serial analysis by far
+	 * less than one 0.01 dB bin, so only a window lying on a bin edge
+	 * can land in the neighbouring bin. The adjustment is within
+	 * 0.01 dB of the serial one; in our tests it was identical.
+	 *
+	 * Programs using this need <code>-pthread</code>.
+	 *
+	 * \param freq	The input sample frequency
+	 * \param left_samples	Samples for the left (or mono) channel, of
+	 *	any type add() accepts
+	 * \param right_samples	Samples for the right channel; ignored
+	 *	for single-channel
+	 * \param num_samples	Number of samples
+	 * \param num_channels	Number of channels
+	 * \param[out] out	The value of the whole stream
+	 * \param threads	The most threads to use; 0 for one per CPU
+	 * \param mode	The filter arithmetic
+	 * \retval false	Bad number of channels or some exceptional
+	 *	event
+	 * \throw Bad_samplefreq
+	 */
+	template <typename T>
+	static bool analyze_parallel(long freq, const T *left_samples,
+	    const T *right_samples, size_t num_samples, int num_channels,
+	    Sample *out, unsigned threads = 0,
+	    enum replaygain_mode mode = REPLAYGAIN_MODE_DOUBLE) {
+		std::vector<std::unique_ptr<Analyzer> >	analyzers;
+		std::vector<std::thread>		workers;
+		Sample_accum				sum;
+
+		if (!threads)
+			threads = std::max(1u,
+			    std::thread::hardware_concurrency());
+		if (num_channels == 1)
+			right_samples = left_samples;
+
+		analyzers.emplace_back(new Analyzer(freq, mode));
+		size_t window = analyzers[0]->window_size();
+		size_t warmup = freq * REPLAYGAIN_WARMUP_MS / 1000;
+
+		// whole windows, and long enough to repay the warm-up
+		size_t chunk = std::max(num_samples / threads, 4 * warmup);
+		chunk = (chunk + window - 1) / window * window;
+		size_t count = (num_samples + chunk - 1) / chunk;
+		while (analyzers.size() < count)
+			analyzers.emplace_back(new Analyzer(freq, mode));
+
+		// char, since threads write neighbouring elements
+		std::vector<char> ok(count, true);
+		auto run = [&](size_t i) {
+			Analyzer &a = *analyzers[i];
+			size_t start = i * chunk;
+			size_t len = std::min(chunk, num_samples - start);
+			size_t pre = std::min(start, warmup);
+
+			if (pre) {
+				a.add(left_samples + start - pre,
+				    right_samples + start - pre, pre,
+				    num_channels);
+				a.discard();
+			}
+			ok[i] = a.add(left_samples + start,
+			    right_samples + start, len, num_channels);
+		};
+
+		try {
+			for (size_t i = 1; i < count; i++)
+				workers.emplace_back(run, i);
+		} catch (...) {
+			for (auto &w : workers)
+				w.join();
+			throw;
+		}
+		if (count)
+			run(0);
+		for (auto &w : workers)
+			w.join();
+
+		for (size_t i = 0; i < count; i++) {
+			Sample	part;
+
+			analyzers[i]->pop(&part);
+			sum += part;
+		}
+		out->_value.swap(sum._sum);
+		out->_peak = sum._peak;
+		out->_dirty = true;
+		return std::find(ok.begin(), ok.end(), false) == ok.end();
+	}
+
+	/** Accumulate samples of a number of tracks, each into its own
+	 * analyzer, filtering the tracks side by side
+	 *
+	 * \param analyzers	One analyzer per track, all different
+	 * \param samples	Per track, one array per channel, scaled as for
+	 *	add()
+	 * \param num_samples	Per track, the number of samples per channel
+	 * \param num_tracks	Number of tracks
+	 * \param num_channels	Number of channels of every track
+	 * \retval false	Bad number of channels or some exceptional
+	 *	event
+	 * \see replaygain_analyze_batch()
+	 */
+	static bool add_batch(Analyzer *const *analyzers,
+	    const double *const *const *samples, const size_t *num_samples,
+	    size_t num_tracks, int num_channels) {
+		std::vector<struct replaygain_ctx *>	ctxs(num_tracks);
+
+		for (size_t i = 0; i < num_tracks; i++)
+			ctxs[i] = analyzers[i]->_ctx;
+		return replaygain_analyze_batch(ctxs.data(), samples,
+		    num_samples, num_tracks, num_channels) == REPLAYGAIN_OK;
 	}
 
 private:
-	// no copying
-	Analyzer(const Analyzer &) {}
-	void operator=(const Analyzer &) {}
+	explicit Analyzer(struct replaygain_ctx *ctx) : _ctx(ctx) {}
 
 	struct replaygain_ctx	*_ctx;
 };
@@ -0,0 +1,210 @@
+/* Copyright (C) 2010 Markus Peloquin <markus@cs.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+
+/**
+ * Loudness per ITU-R BS.1770 and EBU R128: integrated loudness (LUFS) and
+ * loudness range (LU, EBU Tech 3342).
+ *
+ * The interface follows that of gain_analysis.h, and an analyzer of each
+ * kind can be fed the same buffers:
+ *
+ *	struct r128_ctx		*ctx;
+ *	struct r128_value	track;
+ *	struct r128_value	album;
+ *	const double		*channels[2];
+ *
+ *	ctx = r128_alloc(44100, 2, &status);
+ *	memset(&album, 0, sizeof(album));
+ *	for each track {
+ *		while (more samples)
+ *			r128_analyze(ctx, channels, num_samples);
+ *		r128_pop(ctx, &track);
+ *		r128_accum(&album, &track);
+ *		printf("%.1f LUFS\n", r128_integrated(&track));
+ *	}
+ *	printf("%.1f LUFS, %.1f LU\n", r128_integrated(&album),
+ *	    r128_range(&album));
+ *	r128_free(ctx);
+ */
+
+#ifndef MULTIGAIN_R128_ANALYSIS_H
+#define MULTIGAIN_R128_ANALYSIS_H
+
+#include <multigain/gain_analysis.h>
+
+#ifdef __cplusplus
+	/** Most channels an R128 context analyzes */
+	const unsigned	R128_MAX_CHANNELS = 8;
+
+	/** Not to be used directly. */
+	const unsigned	R128_STEPS_PER_LU = 100;
+	/** Not to be used directly. */
+	const int	R128_MIN_LUFS = -70;
+	/** Not to be used directly. */
+	const int	R128_MAX_LUFS = 10;
+	/** Not to be used directly. */
+	const size_t	R128_SIZE = R128_STEPS_PER_LU *
+			    (R128_MAX_LUFS - R128_MIN_LUFS);
+#else
+#	define		R128_MAX_CHANNELS	8
+#	define		R128_STEPS_PER_LU	100
+#	define		R128_MIN_LUFS		-70
+#	define		R128_MAX_LUFS		10
+#	define		R128_SIZE		(R128_STEPS_PER_LU * \
+			    (R128_MAX_LUFS - R128_MIN_LUFS))
+#endif
+
+struct r128_ctx;
+
+/** The accumulated value of a set of samples
+ *
+ * Histograms of the loudness of the 400 ms gating blocks and of the 3 s
+ * short-term blocks, in 0.01 LU steps from the absolute gate (-70 LUFS)
+ * up.  Quieter blocks are gated out and not counted.
+ */
+struct r128_value {
+	uint32_t block[R128_SIZE];
+	uint32_t short_term[R128_SIZE];
+};
+
+__BEGIN_DECLS
+
+/** Initialize an analyzing context
+ *
+ * The channel weights default to 1.0, except for five channels (L, R, C,
+ * Ls, Rs), whose surround channels weigh 1.41, six (L, R, C, LFE, Ls,
+ * Rs), whose LFE channel is also ignored, and eight (L, R, C, LFE, Lb, Rb,
+ * Ls, Rs), whose side surrounds weigh 1.41 and LFE is ignored.
+ *
+ * \param[in] samplefreq	The sampling frequency, 8 to 384 kHz
+ * \param[in] channels	The number of channels, 1 to
+ *	<code>R128_MAX_CHANNELS</code>
+ * \param[out] out_status	An error/success indicator;
+ *	<code>REPLAYGAIN_ERROR</code> for a bad number of channels
+ * \retval NULL	An error occurred
+ * \return	The context, which must be passed to <code>r128_free()</code>
+ *	when finished
+ */
+struct r128_ctx *
+		r128_alloc(long samplefreq, int channels,
+		    enum replaygain_status *out_status);
+
+void		r128_free(struct r128_ctx *ctx);
+
+/** Change the weight of a channel
+ *
+ * \param ctx	Analyzing context
+ * \param channel	The channel, from zero
+ * \param weight	Its weight; 0.0 leaves it out
+ * \retval REPLAYGAIN_ERROR	No such channel
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		r128_set_weight(struct r128_ctx *ctx, int channel,
+		    double weight);
+
+/** Accumulate samples into a calculation
+ *
+ * The range of the samples is that of <code>replaygain_analyze()</code>,
+ * [-32767.0,32767.0].
+ *
+ * \param ctx	Analyzing context
+ * \param samples	One array of samples for each channel
+ * \param num_samples	Number of samples per channel
+ */
+void		r128_analyze(struct r128_ctx *ctx,
+		    const double *const *samples, size_t num_samples);
+
+/** Accumulate 16-bit samples into a calculation
+ *
+ * \see r128_analyze(), replaygain_analyze_s16()
+ */
+void		r128_analyze_s16(struct r128_ctx *ctx,
+		    const int16_t *const *samples, size_t num_samples);
+
+/** Accumulate 32-bit samples into a calculation
+ *
+ * \see r128_analyze(), replaygain_analyze_s32()
+ */
+void		r128_analyze_s32(struct r128_ctx *ctx,
+		    const int32_t *const *samples, size_t num_samples);
+
+/** Accumulate floating-point samples into a calculation
+ *
+ * \see r128_analyze(), replaygain_analyze_f32()
+ */
+void		r128_analyze_f32(struct r128_ctx *ctx,
+		    const float *const *samples, size_t num_samples);
+
+/** Return current calculation, reset context
+ *
+ * \param ctx	Analyzing context
+ * \param[out] out	The accumulated value
+ */
+void		r128_pop(struct r128_ctx *ctx, struct r128_value *out);
+
+/** Combine result of one sample with another
+ *
+ * Gating applies to the blocks of all the samples together, as R128
+ * requires of an album.
+ *
+ * \param sum	The accumulated value
+ * \param addition	The value to add to <code>sum</code>
+ */
+void		r128_accum(struct r128_value *sum,
+		    const struct r128_value *addition);
+
+/** Integrated loudness
+ *
+ * \param value	A value calculation
+ * \retval GAIN_NOT_ENOUGH_SAMPLES	No block passed the gates
+ * \return	The loudness [LUFS]
+ */
+double		r128_integrated(const struct r128_value *value);
+
+/** Loudness range
+ *
+ * \param value	A value calculation
+ * \retval GAIN_NOT_ENOUGH_SAMPLES	No short-term block passed the gates
+ * \return	The range [LU]
+ */
+double		r128_range(const struct r128_value *value);
+
+/** Encode a value for storage
+ *
+ * Only the counted bins are kept, so a track takes some hundreds of bytes.
+ * The encoding is versioned and the same on every platform.
+ *
+ * \param value	A value calculation
+ * \param[out] out	The encoding, or null to only measure it
+ * \return	The length of the encoding in bytes
+ */
+size_t		r128_serialize(const struct r128_value *value,
+		    uint8_t *out);
+
+/** Decode a value from <code>r128_serialize()</code>
+ *
+ * \param data	The encoding
+ * \param len	Its length in bytes
+ * \param[out] value	The value
+ * \retval REPLAYGAIN_ERROR	Malformed encoding, or of a version not known
+ * \retval REPLAYGAIN_OK
+ */
+enum replaygain_status
+		r128_deserialize(const uint8_t *data, size_t len,
+		    struct r128_value *value);
+
+__END_DECLS
+
+#endif /* MULTIGAIN_R128_ANALYSIS_H */
@@ -0,0 +1,262 @@
+/* Copyright (C) 2010 Markus Peloquin <markus@cs.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+
+/**
+ * The R128 counterparts of Analyzer, Sample and Sample_accum.  To get both
+ * measurements from one decode, hand each buffer to both analyzers:
+ *
+ *	multigain::Analyzer		rg(44100);
+ *	multigain::R128_analyzer	r128(44100, 2);
+ *	multigain::R128_sample		sample;
+ *
+ *	while ((num_samples = decode(samples)) > 0) {
+ *		rg.add(samples[0], samples[1], num_samples, 2);
+ *		r128.add(samples, num_samples);
+ *	}
+ *	r128.pop(&sample);
+ *	std::cout << sample.integrated() << " LUFS\n";
+ */
+
+#ifndef MULTIGAIN_R128_ANALYSIS_HPP
+#define MULTIGAIN_R128_ANALYSIS_HPP
+
+#include <cassert>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <multigain/errors.hpp>
+#include <multigain/r128_analysis.h>
+
+namespace multigain {
+
+/** A sample of an R128 calculation */
+class R128_sample {
+public:
+	/** Real initialization comes from R128_analyzer::pop(). */
+	R128_sample() {}
+
+	/** Integrated loudness [LUFS]
+	 *
+	 * \throw Not_enough_samples	...
+	 */
+	double integrated() const {
+		return check(r128_integrated(&_value));
+	}
+
+	/** Loudness range [LU]
+	 *
+	 * \throw Not_enough_samples	...
+	 */
+	double range() const {
+		return check(r128_range(&_value));
+	}
+
+	/** Encode the value for storage
+	 *
+	 * \see r128_serialize()
+	 */
+	std::vector<uint8_t> save() const {
+		std::vector<uint8_t> out(r128_serialize(&_value, 0));
+
+		r128_serialize(&_value, out.data());
+		return out;
+	}
+
+	/** Decode what save() of an R128_sample or an R128_sample_accum
+	 * encoded
+	 *
+	 * \throw Bad_format	Malformed encoding, or of a version
+	 *	not known
+	 */
+	void load(const uint8_t *data, size_t len) {
+		// 64 KiB, and kept as it was if this throws
+		std::unique_ptr<struct r128_value> value(
+		    new struct r128_value);
+
+		if (r128_deserialize(data, len, value.get()) != REPLAYGAIN_OK)
+			throw Bad_format("bad R128 value");
+		_value = *value;
+	}
+
+private:
+	friend class R128_analyzer;
+	friend class R128_sample_accum;
+
+	static double check(double v) {
+		if (v == GAIN_NOT_ENOUGH_SAMPLES) throw Not_enough_samples();
+		return v;
+	}
+
+	struct r128_value	_value;
+};
+
+/** An accumulation of a number of samples, such as an album */
+class R128_sample_accum {
+public:
+	/** Construct and initialize to zero */
+	R128_sample_accum() {
+		reset();
+	}
+
+	/** Reset the sum to zero */
+	void reset() {
+		_sum = r128_value();
+	}
+
+	/** Combine result of one sample with another
+	 *
+	 * \param value	The value to add
+	 */
+	void add(const R128_sample &value) {
+		*this += value;
+	}
+
+	/** Combine result of one sample with another
+	 *
+	 * \param value	The value to add
+	 */
+	R128_sample_accum &operator+=(const R128_sample &value) {
+		r128_accum(&_sum, &value._value);
+		return *this;
+	}
+
+	/** Integrated loudness [LUFS]
+	 *
+	 * \throw Not_enough_samples	...
+	 */
+	double integrated() const {
+		return R128_sample::check(r128_integrated(&_sum));
+	}
+
+	/** Loudness range [LU]
+	 *
+	 * \throw Not_enough_samples	...
+	 */
+	double range() const {
+		return R128_sample::check(r128_range(&_sum));
+	}
+
+	/** Encode the sum for storage, readable by R128_sample::load() too
+	 *
+	 * \see r128_serialize()
+	 */
+	std::vector<uint8_t> save() const {
+		std::vector<uint8_t> out(r128_serialize(&_sum, 0));
+
+		r128_serialize(&_sum, out.data());
+		return out;
+	}
+
+	/** Replace the sum with what save() of an R128_sample or an
+	 * R128_sample_accum encoded, to go on adding to it
+	 *
+	 * \throw Bad_format	Malformed encoding, or of a version
+	 *	not known
+	 */
+	void load(const uint8_t *data, size_t len) {
+		// 64 KiB, and kept as it was if this throws
+		std::unique_ptr<struct r128_value> value(
+		    new struct r128_value);
+
+		if (r128_deserialize(data, len, value.get()) != REPLAYGAIN_OK)
+			throw Bad_format("bad R128 value");
+		_sum = *value;
+	}
+
+private:
+	struct r128_value	_sum;
+};
+
+/** An R128 analyzing context */
+class R128_analyzer {
+public:
+	/** Construct the analyzer object
+	 *
+	 * \param freq	The input sample frequency
+	 * \param channels	The number of channels
+	 * \throw Bad_samplefreq
+	 * \throw std::invalid_argument	Bad number of channels
+	 */
+	R128_analyzer(long freq, int channels) : _ctx(0) {
+		enum replaygain_status	status;
+		_ctx = r128_alloc(freq, channels, &status);
+		switch (status) {
+		case REPLAYGAIN_ERR_MEM:
+			throw std::bad_alloc();
+		case REPLAYGAIN_ERR_SAMPLEFREQ:
+			throw Bad_samplefreq();
+		case REPLAYGAIN_ERROR:
+			throw std::invalid_argument("bad number of channels");
+		case REPLAYGAIN_OK:
+			break;
+		default:
+			assert(0);
+		}
+	}
+
+	~R128_analyzer() noexcept {
+		r128_free(_ctx);
+	}
+
+	R128_analyzer(const R128_analyzer &) = delete;
+	void operator=(const R128_analyzer &) = delete;
+
+	/** Change the weight of a channel
+	 *
+	 * \retval false	No such channel
+	 */
+	bool weight(int channel, double weight) {
+		return r128_set_weight(_ctx, channel, weight) ==
+		    REPLAYGAIN_OK;
+	}
+
+	/** Accumulate samples into a calculation
+	 *
+	 * \param samples	One array per channel, scaled as for
+	 *	Analyzer::add()
+	 * \param num_samples	Number of samples per channel
+	 */
+	void add(const double *const *samples, size_t num_samples) {
+		r128_analyze(_ctx, samples, num_samples);
+	}
+
+	void add(const int16_t *const *samples, size_t num_samples) {
+		r128_analyze_s16(_ctx, samples, num_samples);
+	}
+
+	void add(const int32_t *const *samples, size_t num_samples) {
+		r128_analyze_s32(_ctx, samples, num_samples);
+	}
+
+	void add(const float *const *samples, size_t num_samples) {
+		r128_analyze_f32(_ctx, samples, num_samples);
+	}
+
+	/** Return current calculation, reset context
+	 *
+	 * \param[out] out	The accumulated value
+	 */
+	void pop(R128_sample *out) {
+		r128_pop(_ctx, &out->_value);
+	}
+
+private:
+	struct r128_ctx	*_ctx;
+};
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+/* Copyright (C) 2010 Markus Peloquin <markus@cs.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+
+#ifndef MULTIGAIN_RESULT_CACHE_HPP
+#define MULTIGAIN_RESULT_CACHE_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <multigain/errors.hpp>
+#include <multigain/gain_analysis.hpp>
+#include <multigain/r128_analysis.hpp>
+
+namespace multigain {
+
+/** What tells a Result_cache a file is the one it analyzed before */
+struct File_identity {
+	uint64_t	device;
+	uint64_t	inode;
+	uint64_t	size;
+	/** Modification time [ns since the epoch] */
+	int64_t		mtime;
+	/** Hash of the audio between the tags; 0 if not known */
+	uint64_t	audio_hash;
+};
+
+/** The identity of a file as stat(2) gives it, without an audio hash
+ *
+ * \throw Disk_error
+ */
+File_identity	identify_file(const std::string &path) noexcept(false);
+
+/** Hash of the MPEG audio of a file, leaving out the tags find_tags()
+ * finds, so that retagging keeps it
+ *
+ * This reads the whole file, though much faster than it decodes.
+ *
+ * \return	The hash; 0 if the file is not MPEG audio
+ * \throw Disk_error
+ */
+uint64_t	audio_hash(std::ifstream &in) noexcept(false);
+
+/** The samples of analyzed files, kept on disk between runs
+ *
+ * The file is a log of records, each the identity of a file and its
+ * Sample::save() and R128_sample::save(), read into memory when the cache
+ * is opened; a record
+ * added is appended at once, so a run cut short loses nothing it stored.
+ * A later record of the same inode replaces an earlier one, and the log
+ * is rewritten without them once they are most of it.  One process at a
+ * time may use a cache file.
+ */
+class Result_cache {
+public:
+	/** Open a cache file, creating it if need be
+	 *
+	 * A torn record at the end, as a crash may leave, is cut off, and a
+	 * cache of an older version is emptied.
+	 *
+	 * \throw Disk_error	Not a cache file, or a read/write error
+	 */
+	explicit Result_cache(const std::string &path);
+	~Result_cache() noexcept;
+
+	Result_cache(const Result_cache &) = delete;
+	void operator=(const Result_cache &) = delete;
+
+	/** Look up the samples of a file
+	 *
+	 * A file is found if its inode was stored with the same size and
+	 * modification time, and the same audio hash if both are known.
+	 * Failing that, a file with a known audio hash is found if another
+	 * was stored with it, as a file copied or retagged would be; the
+	 * sample is then stored again under the new identity.
+	 *
+	 * \param id	The file's identity; an audio hash of 0 only looks up
+	 *	the inode, so the file need not be read to find it unchanged
+	 * \param[out] out	The sample stored
+	 * \param[out] loudness	The R128 sample stored
+	 * \retval false	Not found
+	 * \throw Disk_error
+	 */
+	bool find(const File_identity &id, Sample *out,
+	    R128_sample *loudness);
+
+	/** Store the samples of a file
+	 *
+	 * \throw Disk_error
+	 */
+	void store(const File_identity &id, const Sample &sample,
+	    const R128_sample &loudness);
+
+	/** Number of files stored */
+	size_t size() const {
+		return _by_inode.size();
+	}
+
+private:
+	struct Entry {
+		File_identity		id;
+		std::vector<uint8_t>	sample;
+		std::vector<uint8_t>	loudness;
+	};
+
+	/** Device and inode */
+	using Inode = std::pair<uint64_t, uint64_t>;
+
+	struct Inode_hash {
+		size_t operator()(const Inode &k) const {
+			return std::hash<uint64_t>()(k.first * 31 + k.second);
+		}
+	};
+
+	void	load();
+	void	append(const Entry &);
+	void	insert(Entry &&);
+	void	compact();
+
+	std::string	_path;
+	int		_fd;
+	size_t		_records;
+
+	std::unordered_map<Inode, Entry, Inode_hash>	_by_inode;
+	std::unordered_map<uint64_t, Inode>		_by_audio;
+};
+
+}
+
+#endif
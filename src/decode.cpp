@@ -13,11 +13,14 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
 
 #include <cassert>
+#include <cmath>
 #include <iostream>
 #include <limits>
 #include <memory>
 
+#include <FLAC/stream_decoder.h>
 #include <lame/lame.h>
+#include <mpg123.h>
 
 #include <multigain/decode.hpp>
 #include <multigain/gain_analysis.hpp>
@@ -132,61 +135,119 @@ is_lame(const uint8_t *frame, size_t sz) {
 }
 #endif
 
-} // end anon
-} // end multigain
+/** The delay of the mpglib synthesis, in both LAME and libmpg123 */
+const uint16_t DECODER_DELAY = 528 + 1;
 
-multigain::Mpeg_decoder::Mpeg_decoder(std::ifstream &file) :
-	_file(file),
-	_end(-1),
-	_pos(-1),
-	_capacity(0),
-	_samples(0),
-	_skip_back(0),
-	_skip_front(-1) {
-	lame_global_flags *lame = Lame_lib::init();
+/** The delay of the LAME encoder, for a file without a LAME tag */
+const uint16_t LAME_ENCODER_DELAY = 576;
 
-	if (!(_gfp = hip_decode_init()))
-		throw Lame_error("initializing decoder", LAME_NOMEM);
+/** Bytes given to libmpg123 at a time */
+const size_t MPG123_FEED_LEN = 16384;
+
+/** Find the MPEG audio of a file, and how many samples to skip at either
+ * end of it; the file is left at the start of the audio
+ *
+ * \param delay	The encoder delay to assume without a LAME tag
+ * \throw Bad_format	Not an MPEG audio file
+ * \throw Disk_error
+ */
+void
+locate_mpeg(std::ifstream &file, uint16_t delay, off_t *pos, off_t *end,
+    uint16_t *skip_front, uint16_t *skip_back) {
+	std::list<tag_info>	tags;
+	bool			tagged = false;
 
-	std::list<tag_info> tags;
 	find_tags(file, tags);
 	//dump_tags(tags);
 
+	*pos = *end = -1;
+	*skip_front = *skip_back = 0;
 	for (std::list<tag_info>::const_iterator i = tags.begin();
 	    i != tags.end(); ++i)
 		switch (i->type) {
 		case tag_type::MPEG:
-			_pos = i->start;
-			_end = _pos + i->size;
+			*pos = i->start;
+			*end = *pos + i->size;
 			// also i->extra.count;
 			break;
 		case tag_type::MP3_INFO:
 		case tag_type::MP3_XING:
-			_skip_front = i->extra.info.skip_front;
-			_skip_back = i->extra.info.skip_back;
+			*skip_front = i->extra.info.skip_front;
+			*skip_back = i->extra.info.skip_back;
+			tagged = true;
 			break;
 		default:;
 		}
 
-	if (_pos < 0)
+	if (*pos < 0)
 		throw Bad_format("not an MPEG audio file");
 
-	if (_skip_front == static_cast<uint16_t>(-1))
-		_skip_front = lame_get_encoder_delay(lame) + 528 + 1;
-		// leave _skip_back at 0
+	if (!tagged)
+		*skip_front = delay + DECODER_DELAY;
+		// leave skip_back at 0
 	else {
-		_skip_front += 528 + 1;
-		if (_skip_back < 528 + 1)
-			_skip_back = 0;
+		*skip_front += DECODER_DELAY;
+		if (*skip_back < DECODER_DELAY)
+			*skip_back = 0;
 		else
-			_skip_back -= 528 + 1;
+			*skip_back -= DECODER_DELAY;
 	}
 
+	if (!file.seekg(*pos))
+		throw Disk_error("seek error");
+}
+
+/** Spread interleaved frames over the planes of a buffer */
+void
+deinterleave(const float *in, size_t len, int channels, Audio_buffer *buf,
+    size_t off) {
+	if (buf->format() == Audio_buffer::format_type::F32) {
+		for (int c = 0; c < channels; c++) {
+			float *out = buf->float_samples()[c] + off;
+
+			for (size_t i = 0; i < len; i++)
+				out[i] = in[i * channels + c];
+		}
+		return;
+	}
+
+	for (int c = 0; c < channels; c++) {
+		int16_t *out = buf->samples()[c] + off;
+
+		for (size_t i = 0; i < len; i++) {
+			float v = in[i * channels + c] * 32768.0f;
+
+			if (v >= 32767.0f)
+				out[i] = 32767;
+			else if (v <= -32768.0f)
+				out[i] = -32768;
+			else
+				out[i] = std::lrint(v);
+		}
+	}
+}
+
+} // end anon
+} // end multigain
+
+multigain::Mpeg_decoder::Mpeg_decoder(std::ifstream &file) :
+	_file(file),
+	_end(-1),
+	_pos(-1),
+	_capacity(0),
+	_samples(0),
+	_skip_back(0),
+	_skip_front(0) {
+	lame_global_flags *lame = Lame_lib::init();
+
+	if (!(_gfp = hip_decode_init()))
+		throw Lame_error("initializing decoder", LAME_NOMEM);
+
+	locate_mpeg(file, lame_get_encoder_delay(lame), &_pos, &_end,
+	    &_skip_front, &_skip_back);
+
 	_capacity = MAX_SAMPLES + _skip_back;
 	_sample_buf.reset(new short[_capacity * 2]);
-
-	if (!_file.seekg(_pos))
-		throw Disk_error("seek error");
 }
 
 multigain::Mpeg_decoder::~Mpeg_decoder() noexcept {
@@ -248,6 +309,9 @@ multigain::Mpeg_decoder::decode(Audio_buffer *buf) {
 	size_t		tot_samples = 0;
 	uint8_t		channels = buf->channels();
 
+	if (buf->format() != Audio_buffer::format_type::S16)
+		throw Bad_format("16-bit samples only");
+
 	for (;;) {
 		// decode frame
 		int samples = hip_decode1_headers(_gfp, mp3buf, buf_len,
@@ -329,6 +393,326 @@ multigain::Mpeg_decoder::decode(Audio_buffer *buf) {
 	return {bytes_read, tot_samples};
 }
 
+multigain::Mpg123_decoder::Mpg123_decoder(std::ifstream &file) :
+	_file(file),
+	_mh(0),
+	_sample_buf(),
+	_end(-1),
+	_pos(-1),
+	_samples(0),
+	_freq(0),
+	_chan(0),
+	_skip_back(0),
+	_skip_front(0),
+	_new_format(false)
+{
+	// a no-op since libmpg123 1.27
+	static const int init = mpg123_init();
+	const long	*rates;
+	size_t		num_rates;
+	int		err;
+
+	if (init != MPG123_OK)
+		throw Decode_error(mpg123_plain_strerror(init));
+
+	locate_mpeg(file, LAME_ENCODER_DELAY, &_pos, &_end, &_skip_front,
+	    &_skip_back);
+
+	if (!(_mh = mpg123_new(0, &err)))
+		throw Decode_error(mpg123_plain_strerror(err));
+
+	// skip as Mpeg_decoder does, rather than by libmpg123's reckoning
+	mpg123_param(_mh, MPG123_REMOVE_FLAGS, MPG123_GAPLESS, 0);
+	mpg123_param(_mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+
+	mpg123_format_none(_mh);
+	mpg123_rates(&rates, &num_rates);
+	for (size_t i = 0; i < num_rates; i++)
+		mpg123_format(_mh, rates[i], MPG123_MONO | MPG123_STEREO,
+		    MPG123_ENC_FLOAT_32);
+
+	if (mpg123_open_feed(_mh) != MPG123_OK) {
+		Decode_error e(mpg123_strerror(_mh));
+		mpg123_delete(_mh);
+		throw e;
+	}
+}
+
+multigain::Mpg123_decoder::~Mpg123_decoder() noexcept {
+	mpg123_delete(_mh);
+}
+
+bool
+multigain::Mpg123_decoder::feed() {
+	char	buf[MPG123_FEED_LEN];
+	size_t	len = std::min<off_t>(sizeof(buf), _end - _pos);
+
+	if (!len)
+		return false;
+	if (!_file.read(buf, len))
+		throw Disk_error("read error");
+	_pos += len;
+
+	if (mpg123_feed(_mh, reinterpret_cast<unsigned char *>(buf), len) !=
+	    MPG123_OK)
+		throw Decode_error(mpg123_strerror(_mh));
+	return true;
+}
+
+std::pair<size_t, size_t>
+multigain::Mpg123_decoder::decode(Audio_buffer *buf) {
+	off_t		start = _pos;
+	size_t		tot_samples = 0;
+
+	for (;;) {
+		// what ends the stream is held back; what ends a format is not
+		size_t hold = _new_format ? 0 : _skip_back;
+
+		if (_samples > hold) {
+			// a new format only starts an empty buffer
+			if (_chan != buf->channels() ||
+			    _freq != buf->frequency()) {
+				if (tot_samples)
+					break;
+				buf->init(_chan, _freq);
+			}
+
+			size_t amt = std::min(_samples - hold,
+			    buf->len() - tot_samples);
+			deinterleave(_sample_buf.data(), amt, _chan, buf,
+			    tot_samples);
+			_sample_buf.erase(_sample_buf.begin(),
+			    _sample_buf.begin() + amt * _chan);
+			tot_samples += amt;
+			_samples -= amt;
+
+			if (tot_samples == buf->len())
+				// output buffers full
+				break;
+		}
+
+		if (_new_format) {
+			long	freq;
+			int	chan;
+			int	encoding;
+
+			if (mpg123_getformat(_mh, &freq, &chan, &encoding) !=
+			    MPG123_OK)
+				throw Decode_error(mpg123_strerror(_mh));
+			assert(encoding == MPG123_ENC_FLOAT_32);
+			_freq = freq;
+			_chan = chan;
+			_new_format = false;
+		}
+
+		unsigned char	*audio;
+		size_t		bytes;
+		off_t		num;
+
+		int ret = mpg123_decode_frame(_mh, &num, &audio, &bytes);
+		if (ret == MPG123_NEED_MORE) {
+			if (!feed())
+				// eof
+				break;
+			continue;
+		} else if (ret == MPG123_NEW_FORMAT) {
+			_new_format = true;
+			continue;
+		} else if (ret != MPG123_OK)
+			throw Decode_error(mpg123_strerror(_mh));
+
+		if (!bytes)
+			continue;
+
+		const float *frames = reinterpret_cast<const float *>(audio);
+		size_t len = bytes / (sizeof(float) * _chan);
+
+		// account for delay
+		size_t skip = std::min<size_t>(_skip_front, len);
+		_skip_front -= skip;
+		_sample_buf.insert(_sample_buf.end(), frames + skip * _chan,
+		    frames + len * _chan);
+		_samples += len - skip;
+	}
+
+	return {_pos - start, tot_samples};
+}
+
+/* The libFLAC callbacks, which may not throw through it */
+struct multigain::Flac_decoder::Callbacks {
+	/** Store samples in plane c of a buffer from off: as floats in
+	 * [-1.0,1.0), or to 16 bits, which those wider lose the low bits of */
+	static void store(const FLAC__int32 *in, size_t len, unsigned bits,
+	    Audio_buffer *buf, unsigned c, size_t off) {
+		if (buf->format() == Audio_buffer::format_type::F32) {
+			float	*out = buf->float_samples()[c] + off;
+			double	scale = 1.0 / (UINT32_C(1) << (bits - 1));
+
+			for (size_t i = 0; i < len; i++)
+				out[i] = in[i] * scale;
+			return;
+		}
+
+		int16_t *out = buf->samples()[c] + off;
+		if (bits > 16)
+			for (size_t i = 0; i < len; i++)
+				out[i] = in[i] >> (bits - 16);
+		else
+			for (size_t i = 0; i < len; i++)
+				out[i] = in[i] * (1 << (16 - bits));
+	}
+
+	static FLAC__StreamDecoderWriteStatus write(
+	    const FLAC__StreamDecoder *, const FLAC__Frame *frame,
+	    const FLAC__int32 *const planes[], void *data) {
+		Flac_decoder	*self = static_cast<Flac_decoder *>(data);
+		Audio_buffer	*buf = self->_buf;
+		unsigned	channels = frame->header.channels;
+		unsigned	bits = frame->header.bits_per_sample;
+		uint32_t	freq = frame->header.sample_rate;
+		size_t		len = frame->header.blocksize;
+		size_t		amt = 0;
+
+		// a new layout starts a new buffer
+		if (channels != buf->channels() || freq != buf->frequency()) {
+			if (!self->_filled)
+				buf->init(channels, freq);
+		}
+		if (channels == buf->channels() && freq == buf->frequency()) {
+			amt = std::min(len, buf->len() - self->_filled);
+			for (unsigned c = 0; c < channels; c++)
+				store(planes[c], amt, bits, buf, c,
+				    self->_filled);
+			self->_filled += amt;
+		}
+
+		if (amt < len) {
+			size_t rest = len - amt;
+
+			// kept as decoded, for whichever buffer is next
+			self->_pending.resize(rest * channels);
+			for (unsigned c = 0; c < channels; c++)
+				std::copy(planes[c] + amt, planes[c] + len,
+				    self->_pending.data() + c * rest);
+			self->_pending_len = rest;
+			self->_pending_pos = 0;
+			self->_pending_bits = bits;
+			self->_pending_freq = freq;
+			self->_pending_chan = channels;
+		}
+		return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+	}
+
+	static void error(const FLAC__StreamDecoder *,
+	    FLAC__StreamDecoderErrorStatus status, void *data) {
+		Flac_decoder *self = static_cast<Flac_decoder *>(data);
+
+		if (!self->_error)
+			self->_error =
+			    FLAC__StreamDecoderErrorStatusString[status];
+	}
+};
+
+multigain::Flac_decoder::Flac_decoder(FILE *fp) :
+	_file(fp),
+	_dec(0),
+	_buf(0),
+	_filled(0),
+	_pending(),
+	_pending_len(0),
+	_pending_pos(0),
+	_pending_bits(0),
+	_pending_freq(0),
+	_pending_chan(0),
+	_pos(0),
+	_error(0)
+{
+	FLAC__StreamDecoderInitStatus	status;
+
+	if (!fp)
+		throw Disk_error("no file");
+	if (!(_dec = FLAC__stream_decoder_new())) {
+		std::fclose(fp);
+		throw std::bad_alloc();
+	}
+
+	status = FLAC__stream_decoder_init_FILE(_dec, fp, Callbacks::write,
+	    0, Callbacks::error, this);
+	if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+		// the file is the decoder's only once it is initialized
+		bool taken = FLAC__stream_decoder_get_state(_dec) !=
+		    FLAC__STREAM_DECODER_UNINITIALIZED;
+
+		FLAC__stream_decoder_delete(_dec);
+		if (!taken)
+			std::fclose(fp);
+		throw Decode_error(
+		    FLAC__StreamDecoderInitStatusString[status]);
+	}
+}
+
+multigain::Flac_decoder::~Flac_decoder() noexcept {
+	// closes the file
+	FLAC__stream_decoder_delete(_dec);
+}
+
+void
+multigain::Flac_decoder::drain() {
+	size_t	amt;
+
+	if (_pending_chan != _buf->channels() ||
+	    _pending_freq != _buf->frequency()) {
+		if (_filled)
+			return;
+		_buf->init(_pending_chan, _pending_freq);
+	}
+
+	amt = std::min(_pending_len - _pending_pos, _buf->len() - _filled);
+	for (unsigned c = 0; c < _pending_chan; c++)
+		Callbacks::store(_pending.data() + c * _pending_len +
+		    _pending_pos, amt, _pending_bits, _buf, c, _filled);
+	_filled += amt;
+	if ((_pending_pos += amt) == _pending_len)
+		_pending_len = _pending_pos = 0;
+}
+
+std::pair<size_t, size_t>
+multigain::Flac_decoder::decode(Audio_buffer *buf) {
+	uint64_t	start = _pos;
+
+	_buf = buf;
+	_filled = 0;
+	if (_pending_len)
+		drain();
+
+	while (!_pending_len && _filled < buf->len()) {
+		if (FLAC__stream_decoder_get_state(_dec) ==
+		    FLAC__STREAM_DECODER_END_OF_STREAM)
+			break;
+		if (!FLAC__stream_decoder_process_single(_dec)) {
+			if (std::ferror(_file))
+				throw Disk_error("read error");
+			throw Decode_error(FLAC__StreamDecoderStateString[
+			    FLAC__stream_decoder_get_state(_dec)]);
+		}
+		if (_error)
+			throw Decode_error(_error);
+	}
+
+	FLAC__uint64 pos;
+	if (FLAC__stream_decoder_get_decode_position(_dec, &pos))
+		_pos = pos;
+	else if (FLAC__stream_decoder_get_state(_dec) ==
+	    FLAC__STREAM_DECODER_END_OF_STREAM) {
+		// not known there, but all was read
+		off_t end = ftello(_file);
+		if (end >= 0 && static_cast<uint64_t>(end) > _pos)
+			_pos = end;
+	}
+	_buf = 0;
+	return {_pos - start, _filled};
+}
+
 void
 multigain::Mpeg_frame_header::init(const uint8_t header[4], bool minimal) {
 	// verify frame sync
@@ -54,22 +54,73 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* SIMD kernels are built with per-function target attributes and chosen at
+ * run time, so one binary runs on any x86 */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#	define X86_DISPATCH	1
+#	include <immintrin.h>
+#	define TARGET(isa)	__attribute__((target(isa)))
+#	define ALWAYS_INLINE	__attribute__((always_inline))
+#endif
+
 #include <multigain/gain_analysis.h>
 
+#ifndef M_PI
+#	define M_PI		3.14159265358979323846
+#endif
+#ifndef M_SQRT2
+#	define M_SQRT2		1.41421356237309504880
+#endif
+
 #define YULE_ORDER		10
 #define BUTTER_ORDER		2
 /* percentile which is louder than the proposed level */
 const double RMS_PERCENTILE =	0.95;
-/* maximum allowed sample frequency [Hz] */
-#define MAX_SAMP_FREQ		48000
+/* the decimator halves frequencies down to no lower than this [Hz] */
+#define DECIMATE_MIN_FREQ	44100
+
+/* allowed sample frequencies [Hz] */
+#define MIN_SAMP_FREQ		8000
+#define MAX_SAMP_FREQ		384000
+/* above this, the Yule filter's poles crowd so close to z = 1 that single
+ * precision cannot hold them; REPLAYGAIN_MODE_FLOAT filters in double */
+#define MAX_FLOAT_FREQ		64000
 /* Time slice size [s] */
 #define RMS_WINDOW_TIME_NUM	1
 #define RMS_WINDOW_TIME_DEN	20
 /* Table entries per dB */
 
 #define MAX_ORDER		(BUTTER_ORDER > YULE_ORDER ? BUTTER_ORDER : YULE_ORDER)
-/* max. Samples per Time slice */
-#define MAX_SAMPLES_PER_WINDOW	(size_t)(MAX_SAMP_FREQ * RMS_WINDOW_TIME_NUM / RMS_WINDOW_TIME_DEN + 1) // FIXME should there be a +1 in here?
+
+/* cutoff of the Butterworth high pass [Hz] */
+#define BUTTER_FREQ		150.0
+/* where a Yule filter moved to another frequency matches the original
+ * exactly [Hz]: the bottom of the equal-loudness curve, where the ear is
+ * most sensitive */
+#define YULE_MATCH_FREQ		3700.0
+
+/* the fewest samples worth looking at for digital silence */
+#define SILENT_MIN		64
+
+/* samples per channel converted at a time by the typed entry points */
+#define STAGE_SAMPLES		1024
+
+/* The decimator's half-band filters, by their taps on each side of the
+ * centre that are not zero: the long one for the 2:1 stage down to the
+ * rate analyzed, the short one for any stage before it */
+#define HALFBAND_LONG		8
+#define HALFBAND_SHORT		4
+#define HALFBAND_LEN(half)	(4 * (half) - 1)
+/* the most 2:1 stages, enough for 384 kHz */
+#define MAX_DECIMATE_STAGES	3
+/* stereo pairs each stage holds */
+#define DECIMATE_SAMPLES	(STAGE_SAMPLES + HALFBAND_LEN(HALFBAND_LONG))
+
+/* taps of each phase of the true-peak interpolator */
+#define TRUE_PEAK_TAPS		12
+
+/* smallest magnitude counted as clipped */
+#define FULL_SCALE		32767.0
 
 /* calibration value; ref_pink.wav must get 6.0 dB */
 const double PINK_REF =		64.82; /* 298640883795 */
@@ -77,40 +128,177 @@ const double PINK_REF =		64.82; /* 298640883795 */
 /* Type used for filtering */
 typedef double	Float_t;
 
-struct replaygain_ctx {
+struct replaygain_ctx;
+
+/* the decimator's input, per stage, as interleaved stereo pairs; the first
+ * few are the history the next output needs */
+struct decimator {
+	size_t		avail[MAX_DECIMATE_STAGES];
+	Float_t		buf[MAX_DECIMATE_STAGES][2 * DECIMATE_SAMPLES];
+};
+
+/* channels are filtered two at a time, as a left and a right; an odd last
+ * channel is filtered in both */
+#define MAX_PAIRS		((REPLAYGAIN_MAX_CHANNELS + 1) / 2)
+
+/* The state of the filters for two channels */
+struct channel_pair {
 	Float_t		linprebuf[MAX_ORDER * 2];
 	/* left input samples, with pre-buffer */
 	Float_t		*linpre;
-	Float_t		lstepbuf[MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+	Float_t		*lstepbuf;
 	/* left "first step" (i.e. post first filter) samples */
 	Float_t		*lstep;
-	Float_t		loutbuf[MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+	Float_t		*loutbuf;
 	/* left "out" (i.e. post second filter) samples */
 	Float_t		*lout;
 
 	Float_t		rinprebuf[MAX_ORDER * 2];
 	/* right input samples ... */
 	Float_t		*rinpre;
-	Float_t		rstepbuf[MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+	Float_t		*rstepbuf;
 	Float_t		*rstep;
-	Float_t		routbuf[MAX_SAMPLES_PER_WINDOW + MAX_ORDER];
+	Float_t		*routbuf;
 	Float_t		*rout;
 
+	Float_t		lsum;
+	Float_t		rsum;
+
+	/* since the last pop: largest input magnitude, and the number of
+	 * samples at FULL_SCALE or beyond */
+	Float_t		peak[2];
+	uint64_t	clipped[2];
+
+	/* the true-peak meter's input history (newest first), and the
+	 * largest oversampled magnitude */
+	float		tp_hist[2][TRUE_PEAK_TAPS];
+	Float_t		true_peak[2];
+
+	/* allocated when decimating */
+	struct decimator *decimator;
+
+	/* Every input since the filters were cleared has been the same in
+	 * both channels, so the right's state is a copy of the left's and
+	 * only the left needs filtering.  Mono stays so for good. */
+	bool		dual;
+};
+
+/* One implementation of each of the analysis loops */
+struct kernels {
+	enum replaygain_kernel	id;
+	/* filter the next samples of the RMS window, accumulating the
+	 * squares of the output */
+	void	(*filter)(struct replaygain_ctx *, struct channel_pair *,
+		    const Float_t *, const Float_t *, size_t);
+	/* the same for two pairs at once, or null; the pairs may be of
+	 * different contexts at the same frequency */
+	void	(*filter_quad)(struct replaygain_ctx *const *,
+		    struct channel_pair *const *, const Float_t *const *,
+		    size_t);
+	/* the same for a pair with the same input in both channels, in
+	 * which the right is a copy of the left (channel_pair.dual) */
+	void	(*filter_dual)(struct replaygain_ctx *, struct channel_pair *,
+		    const Float_t *, size_t);
+	/* the same for a pair whose input, and the history of it that the
+	 * filters read, is all zero */
+	void	(*filter_silent)(struct replaygain_ctx *,
+		    struct channel_pair *, size_t);
+	/* the same in single precision (REPLAYGAIN_MODE_FLOAT) */
+	void	(*filter_float)(struct replaygain_ctx *,
+		    struct channel_pair *, const Float_t *, const Float_t *,
+		    size_t);
+	void	(*filter_float_dual)(struct replaygain_ctx *,
+		    struct channel_pair *, const Float_t *, size_t);
+	/* the true-peak meter, when enabled */
+	void	(*true_peak)(struct channel_pair *, const Float_t *,
+		    const Float_t *, size_t);
+	void	(*true_peak_dual)(struct channel_pair *, const Float_t *,
+		    size_t);
+	/* one 2:1 stage of the decimator */
+	size_t	(*halfband)(Float_t *, size_t *, Float_t *, const Float_t *,
+		    int);
+	void	(*accum)(uint32_t *, const uint32_t *);
+};
+
+struct replaygain_ctx {
+	const struct kernels	*kernels;
+	enum replaygain_mode	mode;
+
+	struct channel_pair	pair[MAX_PAIRS];
+	/* the pairs whose filter state is current, and the channels of the
+	 * last analysis */
+	int		active_pairs;
+	int		channels;
+	/* the most channels analyzed since the last pop */
+	int		peak_channels;
+
+	/* per channel, the weight of its mean square, and whether it was
+	 * set rather than left to default_weight() */
+	double		weight[REPLAYGAIN_MAX_CHANNELS];
+	unsigned	weight_set;
+
+	/* the four step and out buffers of each pair, each of
+	 * window_capacity + MAX_ORDER samples, for window_pairs pairs */
+	Float_t		*window_buf;
+	size_t		window_capacity;
+	int		window_pairs;
+
+	/* in memory of the caller's (replaygain_init_in_place()), which has
+	 * all the room the buffers and decimators will get */
+	bool		in_place;
+
 	/* number of samples required to reach number of milliseconds required
 	 * for RMS window */
 	uint16_t	sample_window;
 	uint16_t	totsamp;
-	Float_t		lsum;
-	Float_t		rsum;
-	int		freqindex;
 	int		first;
 
+	/* the sample frequency, and the 2:1 stages of the decimator that
+	 * bring it down to the frequency the filters run at */
+	long		input_freq;
+	int		decimate_on;
+	int		decimate_stages;
+
+	/* the filters for that frequency */
+	long		freq;
+	Float_t		yule[2*YULE_ORDER + 1];
+	Float_t		butter[2*BUTTER_ORDER + 1];
+
+	/* whether the true-peak meter runs */
+	int		true_peak_on;
+
+	/* whether to compare the channels of a pair for a dual-mono input */
+	int		dual_mono_on;
+
 	struct replaygain_value value;
+
+	/* the same histogram as a Fenwick tree, the element for the bins
+	 * (k - (k & -k), k] at tree[k - 1], and the number of windows in it,
+	 * for replaygain_running_adjustment() */
+	uint32_t	tree[ANALYZE_SIZE];
+	uint32_t	windows;
+
+	/* with a horizon (replaygain_set_horizon()), the bins of the last
+	 * horizon windows; the next goes at ring_pos, over the oldest once
+	 * the ring is full */
+	uint16_t	*ring;
+	size_t		horizon;
+	size_t		ring_pos;
 };
 
+/* the largest power of two no greater than ANALYZE_SIZE */
+#define TREE_TOP		8192
+
 /* for each filter:
  * [0] 48 kHz, [1] 44.1 kHz, [2] 32 kHz,      [3] 24 kHz, [4] 22050 Hz,
- * [5] 16 kHz, [6] 12 kHz,   [7] is 11025 Hz, [8] 8 kHz */
+ * [5] 16 kHz, [6] 12 kHz,   [7] is 11025 Hz, [8] 8 kHz
+ *
+ * Other frequencies get filters designed from these; see
+ * design_filters(). */
+#define TABLE_FREQS		9
+static const long TABLE_FREQ[TABLE_FREQS] = {
+	48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000
+};
 
 #ifdef WIN32
 #ifndef __GNUC__
@@ -205,6 +393,44 @@ static const Float_t ABButter[9][2*BUTTER_ORDER + 1] = {
 	0.89487434461664, 0.94597685600279 }
 };
 
+/* ITU-R BS.1770-4, Annex 2: the 48-tap interpolating FIR for 4x
+ * oversampling, one row per output phase */
+static const float TRUE_PEAK_FIR[4][TRUE_PEAK_TAPS] = {
+	{  0.0017089843750f,  0.0109863281250f, -0.0196533203125f,
+	   0.0332031250000f, -0.0594482421875f,  0.1373291015625f,
+	   0.9721679687500f, -0.1022949218750f,  0.0476074218750f,
+	  -0.0266113281250f,  0.0148925781250f, -0.0083007812500f },
+	{ -0.0291748046875f,  0.0292968750000f, -0.0517578125000f,
+	   0.0891113281250f, -0.1665039062500f,  0.4650878906250f,
+	   0.7797851562500f, -0.2003173828125f,  0.1015625000000f,
+	  -0.0582275390625f,  0.0330810546875f, -0.0189208984375f },
+	{ -0.0189208984375f,  0.0330810546875f, -0.0582275390625f,
+	   0.1015625000000f, -0.2003173828125f,  0.7797851562500f,
+	   0.4650878906250f, -0.1665039062500f,  0.0891113281250f,
+	  -0.0517578125000f,  0.0292968750000f, -0.0291748046875f },
+	{ -0.0083007812500f,  0.0148925781250f, -0.0266113281250f,
+	   0.0476074218750f, -0.1022949218750f,  0.9721679687500f,
+	   0.1373291015625f, -0.0594482421875f,  0.0332031250000f,
+	  -0.0196533203125f,  0.0109863281250f,  0.0017089843750f },
+};
+
+/* the half-band filters, from the centre out: the centre tap is 1/2 and
+ * every other tap is zero, so only the odd ones are listed.  Kaiser-windowed
+ * sinc.  The long one passes up to 16 kHz of 44.1 kHz output within 0.01 dB
+ * and stops what would alias there by 62 dB; the short one, ahead of it,
+ * passes 20 kHz within 0.02 dB and stops what the later stages would let
+ * through by 48 dB */
+static const Float_t HALFBAND_LONG_TAPS[HALFBAND_LONG] = {
+	0.31442458733786782, -0.094995013044297416, 0.046589055325324043,
+	-0.024251087067837594, 0.011989061904815137, -0.0052087344444253676,
+	0.0017677191244999931, -0.0003155891359465907
+};
+
+static const Float_t HALFBAND_SHORT_TAPS[HALFBAND_SHORT] = {
+	0.30348599764037315, -0.069019971797302029, 0.017200145774520191,
+	-0.0016661716175912873
+};
+
 #ifdef WIN32
 #ifndef __GNUC__
 #pragma warning(default : 4305)
@@ -251,279 +477,3375 @@ filter_butter(const Float_t *input, Float_t *output, size_t nSamples,
 	}
 }
 
-enum replaygain_status
-replaygain_reset_frequency(struct replaygain_ctx *ctx, long freq) {
-	/* zero out initial values */
-	memset(ctx->linprebuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->rinprebuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->lstepbuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->rstepbuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->loutbuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->routbuf, 0, sizeof(Float_t) * MAX_ORDER);
-
-	switch (freq) {
-	case 48000: ctx->freqindex = 0; break;
-	case 44100: ctx->freqindex = 1; break;
-	case 32000: ctx->freqindex = 2; break;
-	case 24000: ctx->freqindex = 3; break;
-	case 22050: ctx->freqindex = 4; break;
-	case 16000: ctx->freqindex = 5; break;
-	case 12000: ctx->freqindex = 6; break;
-	case 11025: ctx->freqindex = 7; break;
-	case  8000: ctx->freqindex = 8; break;
-	default:
-		return REPLAYGAIN_ERR_SAMPLEFREQ;
+static inline Float_t
+fsqr(const Float_t d) {
+	return d * d;
+}
+
+/* Add the squares of the samples to *sum, in groups of 16 */
+static void
+sum_squares(const Float_t *samples, size_t nSamples, Float_t *sum) {
+	Float_t	acc;
+	size_t	i;
+
+	acc = *sum;
+	i = nSamples % 16;
+	while (i--)
+		acc += fsqr(*samples++);
+	i = nSamples / 16;
+	while (i--) {
+		acc += fsqr(samples[0]) +
+		    fsqr(samples[1]) +
+		    fsqr(samples[2]) +
+		    fsqr(samples[3]) +
+		    fsqr(samples[4]) +
+		    fsqr(samples[5]) +
+		    fsqr(samples[6]) +
+		    fsqr(samples[7]) +
+		    fsqr(samples[8]) +
+		    fsqr(samples[9]) +
+		    fsqr(samples[10]) +
+		    fsqr(samples[11]) +
+		    fsqr(samples[12]) +
+		    fsqr(samples[13]) +
+		    fsqr(samples[14]) +
+		    fsqr(samples[15]);
+		samples += 16;
 	}
+	*sum = acc;
+}
 
-	/* ceil(freq * (float)NUM/DEN) */
-	ctx->sample_window =
-	    (freq * RMS_WINDOW_TIME_NUM + RMS_WINDOW_TIME_DEN-1) /
-	    RMS_WINDOW_TIME_DEN;
+/* Fold the magnitudes of the input into a channel's peak and clip count */
+static void
+track_peak(const Float_t *in, size_t nSamples, Float_t *peak,
+    uint64_t *clipped) {
+	Float_t		mag;
+	Float_t		max = *peak;
+	uint64_t	clips = 0;
+	size_t		i;
 
-	ctx->lsum = 0.0;
-	ctx->rsum = 0.0;
-	ctx->totsamp = 0;
+	for (i = 0; i < nSamples; i++) {
+		mag = fabs(in[i]);
+		if (mag > max)
+			max = mag;
+		clips += mag >= FULL_SCALE;
+	}
+	*peak = max;
+	*clipped += clips;
+}
 
-	memset(&ctx->value, 0, sizeof(ctx->value));
+/* Run both filters over both channels of a pair for the next nSamples of
+ * the current RMS window, accumulating the squared output into lsum and
+ * rsum */
+static void
+filter_stereo(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples) {
+	const Float_t	*yule = ctx->yule;
+	const Float_t	*butter = ctx->butter;
+	Float_t		*lstep = pair->lstep + ctx->totsamp;
+	Float_t		*rstep = pair->rstep + ctx->totsamp;
+	Float_t		*lout = pair->lout + ctx->totsamp;
+	Float_t		*rout = pair->rout + ctx->totsamp;
 
-	return REPLAYGAIN_OK;
+	filter_yule(lin, lstep, nSamples, yule);
+	filter_yule(rin, rstep, nSamples, yule);
+	filter_butter(lstep, lout, nSamples, butter);
+	filter_butter(rstep, rout, nSamples, butter);
+	sum_squares(lout, nSamples, &pair->lsum);
+	sum_squares(rout, nSamples, &pair->rsum);
+	track_peak(lin, nSamples, &pair->peak[0], &pair->clipped[0]);
+	track_peak(rin, nSamples, &pair->peak[1], &pair->clipped[1]);
 }
 
-struct replaygain_ctx *
-replaygain_alloc(long freq, enum replaygain_status *out_status) {
-	struct replaygain_ctx	*ctx;
-	enum replaygain_status	status;
+/* filter_pair() of input that has been zero for at least YULE_ORDER
+ * samples, where each input term of the Yule filter is a zero that leaves
+ * its sum as it was.  The filters never come to rest, as the Yule filter
+ * adds 1e-10 to every sample, but with the input terms gone the chain of
+ * adds of a sample is little more than half as long.  The results are
+ * exactly those of filter_pair(), but for the sign of a sum of zero,
+ * which no later sum or square shows. */
+static void
+filter_pair_silent(Float_t *lstep, Float_t *rstep, Float_t *lout,
+    Float_t *rout, size_t nSamples, const Float_t *yule,
+    const Float_t *butter) {
+	Float_t	k[YULE_ORDER + 1];
+	Float_t	b[2*BUTTER_ORDER + 1];
+	Float_t	y[YULE_ORDER + 1][2];
+	Float_t	z[BUTTER_ORDER + 1][2];
+	size_t	i;
+	int	c;
+	int	j;
 
-	if (!(ctx = malloc(sizeof(struct replaygain_ctx)))) {
-		if (out_status) *out_status = REPLAYGAIN_ERR_MEM;
-		return 0;
+	for (j = 1; j <= YULE_ORDER; j++)
+		k[j] = yule[2*j - 1];
+	for (j = 0; j <= 2*BUTTER_ORDER; j++)
+		b[j] = butter[j];
+	for (j = 1; j <= YULE_ORDER; j++) {
+		y[j][0] = lstep[-j];	y[j][1] = rstep[-j];
+	}
+	for (j = 1; j <= BUTTER_ORDER; j++) {
+		z[j][0] = lout[-j];	z[j][1] = rout[-j];
 	}
+	for (i = 0; i < nSamples; i++) {
+		for (c = 0; c < 2; c++) {
+			Float_t	acc = 1e-10;
 
-	status = replaygain_reset_frequency(ctx, freq);
-	if (status != REPLAYGAIN_OK) {
-		free(ctx);
-		if (out_status) *out_status = status;
-		return 0;
+			for (j = 1; j <= YULE_ORDER; j++)
+				acc = acc - y[j][c] * k[j];
+			y[0][c] = acc;
+			z[0][c] = y[0][c] * b[0] -
+			    z[1][c] * b[1] + y[1][c] * b[2] -
+			    z[2][c] * b[3] + y[2][c] * b[4];
+		}
+		lstep[i] = y[0][0];
+		rstep[i] = y[0][1];
+		lout[i] = z[0][0];
+		rout[i] = z[0][1];
+		for (j = YULE_ORDER; j > 0; j--) {
+			y[j][0] = y[j - 1][0];	y[j][1] = y[j - 1][1];
+		}
+		for (j = BUTTER_ORDER; j > 0; j--) {
+			z[j][0] = z[j - 1][0];	z[j][1] = z[j - 1][1];
+		}
 	}
+}
 
-	ctx->linpre = ctx->linprebuf + MAX_ORDER;
-	ctx->rinpre = ctx->rinprebuf + MAX_ORDER;
-	ctx->lstep  = ctx->lstepbuf  + MAX_ORDER;
-	ctx->rstep  = ctx->rstepbuf  + MAX_ORDER;
-	ctx->lout   = ctx->loutbuf   + MAX_ORDER;
-	ctx->rout   = ctx->routbuf   + MAX_ORDER;
+/* filter_stereo() of the next samples of a pair in digital silence, which
+ * leave the peaks as they were */
+static void
+filter_silent(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    size_t num_samples) {
+	Float_t	*lout = pair->lout + ctx->totsamp;
+	Float_t	*rout = pair->rout + ctx->totsamp;
 
-	memset(ctx->value.value, 0, sizeof(ctx->value.value));
+	filter_pair_silent(pair->lstep + ctx->totsamp,
+	    pair->rstep + ctx->totsamp, lout, rout, num_samples, ctx->yule,
+	    ctx->butter);
+	sum_squares(lout, num_samples, &pair->lsum);
+	sum_squares(rout, num_samples, &pair->rsum);
+}
 
-	if (out_status) *out_status = REPLAYGAIN_OK;
-	return ctx;
+/* Copy to the right channel of a dual pair what filtering the left alone
+ * over the last nSamples changed: the history the next samples read, the
+ * sum and the peaks */
+static void
+mirror_left(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    size_t nSamples) {
+	size_t	n = nSamples < MAX_ORDER ? nSamples : MAX_ORDER;
+	size_t	from = ctx->totsamp + nSamples - n;
+
+	memcpy(pair->rstep + from, pair->lstep + from, n * sizeof(Float_t));
+	memcpy(pair->rout + from, pair->lout + from, n * sizeof(Float_t));
+	pair->rsum = pair->lsum;
+	pair->peak[1] = pair->peak[0];
+	pair->clipped[1] = pair->clipped[0];
 }
 
-static inline Float_t
-fsqr(const Float_t d) {
-	return d * d;
+static void
+filter_dual(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *in, size_t nSamples) {
+	Float_t	*step = pair->lstep + ctx->totsamp;
+	Float_t	*out = pair->lout + ctx->totsamp;
+
+	filter_yule(in, step, nSamples, ctx->yule);
+	filter_butter(step, out, nSamples, ctx->butter);
+	sum_squares(out, nSamples, &pair->lsum);
+	track_peak(in, nSamples, &pair->peak[0], &pair->clipped[0]);
+	mirror_left(ctx, pair, nSamples);
 }
 
-enum replaygain_status
-replaygain_analyze(struct replaygain_ctx *ctx, const Float_t *lsamples,
-    const Float_t *rsamples, size_t num_samples, int channels) {
-	size_t	batchsamples;
-	size_t	copy_samples;
-	long	cursamplepos;
+/* Single precision.  Besides the narrower type, the sums are regrouped so
+ * that only the newest output feeds back through the long chain of adds:
+ * the older outputs and all the inputs are summed pairwise beforehand, and
+ * the newest output costs one multiply and one subtract.  Partial square
+ * sums are kept in groups of 16 and added into the double-precision window
+ * sum.
+ *
+ * Only the last MAX_ORDER outputs are stored back in the context; that is
+ * all the history either precision reads.  The SIMD versions perform the
+ * same operations in each lane, so every kernel gives the same result in
+ * this mode. */
 
-	if (!num_samples)
-		return REPLAYGAIN_OK;
+/* x[0..10] inputs, y[1..10] outputs, k the Yule coefficients */
+static inline float
+yule_float(const float *x, const float *y, const float *k) {
+	float	fir;
+	float	rest;
 
-	cursamplepos = 0;
-	batchsamples = num_samples;
+	fir = (((k[ 0]*x[0] + k[ 2]*x[1]) + (k[ 4]*x[2] + k[ 6]*x[3])) +
+	    ((k[ 8]*x[4] + k[10]*x[5]) + (k[12]*x[6] + k[14]*x[7]))) +
+	    ((k[16]*x[8] + k[18]*x[9]) + k[20]*x[10]);
+	rest = (((k[ 3]*y[2] + k[ 5]*y[3]) + (k[ 7]*y[4] + k[ 9]*y[5])) +
+	    ((k[11]*y[6] + k[13]*y[7]) + (k[15]*y[8] + k[17]*y[9]))) +
+	    k[19]*y[10];
+	return ((1e-10f + fir) - rest) - k[1]*y[1];
+}
 
-	switch (channels) {
-	case  1: rsamples = lsamples;
-	case  2: break;
-	default: return REPLAYGAIN_ERROR;
-	}
-
-	copy_samples = num_samples;
-	if (MAX_ORDER < copy_samples) copy_samples = MAX_ORDER;
-	memcpy(ctx->linprebuf + MAX_ORDER, lsamples,
-	    copy_samples * sizeof(Float_t));
-	memcpy(ctx->rinprebuf + MAX_ORDER, rsamples,
-	    copy_samples * sizeof(Float_t));
-
-	while (batchsamples != 0) {
-		const Float_t	*curleft;
-		const Float_t	*curright;
-		int		i;
-		uint16_t	remaining;
-		uint16_t	cursamples;
-
-		// cursamples = min(batchsamples, sample_window - totsamp);
-		remaining = ctx->sample_window - ctx->totsamp;
-		cursamples = remaining < batchsamples ? remaining :
-		    batchsamples;
-		if (cursamplepos < MAX_ORDER) {
-			curleft  = ctx->linpre + cursamplepos;
-			curright = ctx->rinpre + cursamplepos;
-			if (cursamples > MAX_ORDER - cursamplepos)
-				cursamples = MAX_ORDER - cursamplepos;
-		} else {
-			curleft  = lsamples + cursamplepos;
-			curright = rsamples + cursamplepos;
-		}
-
-		filter_yule(curleft,  ctx->lstep + ctx->totsamp, cursamples,
-		    ABYule[ctx->freqindex]);
-		filter_yule(curright, ctx->rstep + ctx->totsamp, cursamples,
-		    ABYule[ctx->freqindex]);
-
-		filter_butter(ctx->lstep + ctx->totsamp,
-		    ctx->lout + ctx->totsamp, cursamples,
-		    ABButter[ctx->freqindex]);
-		filter_butter(ctx->rstep + ctx->totsamp,
-		    ctx->rout + ctx->totsamp, cursamples,
-		    ABButter[ctx->freqindex]);
-
-		/* get the squared values */
-		curleft  = ctx->lout + ctx->totsamp;
-		curright = ctx->rout + ctx->totsamp;
-
-		i = cursamples % 16;
-		while (i--) {
-			ctx->lsum += fsqr(*curleft++);
-			ctx->rsum += fsqr(*curright++);
-		}
-		i = cursamples / 16;
-		while (i--) {
-			ctx->lsum += fsqr(curleft[0]) +
-			    fsqr(curleft[1]) +
-			    fsqr(curleft[2]) +
-			    fsqr(curleft[3]) +
-			    fsqr(curleft[4]) +
-			    fsqr(curleft[5]) +
-			    fsqr(curleft[6]) +
-			    fsqr(curleft[7]) +
-			    fsqr(curleft[8]) +
-			    fsqr(curleft[9]) +
-			    fsqr(curleft[10]) +
-			    fsqr(curleft[11]) +
-			    fsqr(curleft[12]) +
-			    fsqr(curleft[13]) +
-			    fsqr(curleft[14]) +
-			    fsqr(curleft[15]);
-			curleft += 16;
-			ctx->rsum += fsqr(curright[0]) +
-			    fsqr(curright[1]) +
-			    fsqr(curright[2]) +
-			    fsqr(curright[3]) +
-			    fsqr(curright[4]) +
-			    fsqr(curright[5]) +
-			    fsqr(curright[6]) +
-			    fsqr(curright[7]) +
-			    fsqr(curright[8]) +
-			    fsqr(curright[9]) +
-			    fsqr(curright[10]) +
-			    fsqr(curright[11]) +
-			    fsqr(curright[12]) +
-			    fsqr(curright[13]) +
-			    fsqr(curright[14]) +
-			    fsqr(curright[15]);
-			curright += 16;
-		}
-
-		if (batchsamples < cursamples)
-			batchsamples = 0;
-		else
-			batchsamples -= cursamples;
-		cursamplepos += cursamples;
-		ctx->totsamp += cursamples;
+/* y[0..2] inputs, z[1..2] outputs, k the Butterworth coefficients */
+static inline float
+butter_float(const float *y, const float *z, const float *k) {
+	return ((k[0]*y[0] + k[2]*y[1]) + (k[4]*y[2] - k[3]*z[2])) -
+	    k[1]*z[1];
+}
 
-		/* get the RMS for this set of samples */
-		if (ctx->totsamp == ctx->sample_window) {
-			double	val;
-			size_t	ival;
+static void
+filter_mono_float(const Float_t *in, Float_t *step, Float_t *out,
+    size_t nSamples, const float *yule, const float *butter, Float_t *sum) {
+	float	x[YULE_ORDER + 1];
+	float	y[YULE_ORDER + 1];
+	float	z[BUTTER_ORDER + 1];
+	float	group = 0;
+	size_t	i;
+	int	j;
 
-			val = STEPS_PER_DB * 10 * log10(
-			    (ctx->lsum + ctx->rsum) / (ctx->totsamp * 2) +
-			    1.0e-37);
+	for (j = 1; j <= YULE_ORDER; j++) {
+		x[j] = in[-j];
+		y[j] = step[-j];
+	}
+	for (j = 1; j <= BUTTER_ORDER; j++)
+		z[j] = out[-j];
 
-			ival = val < 0.0 ? 0 : val;
-			if (ival >= ANALYZE_SIZE)
-				ival = ANALYZE_SIZE - 1;
+	for (i = 0; i < nSamples; i++) {
+		x[0] = in[i];
+		y[0] = yule_float(x, y, yule);
+		z[0] = butter_float(y, z, butter);
+		if (i + MAX_ORDER >= nSamples) {
+			step[i] = y[0];
+			out[i] = z[0];
+		}
 
-			ctx->value.value[ival]++;
-			ctx->lsum = ctx->rsum = 0.0;
-			memmove(ctx->loutbuf, ctx->loutbuf + ctx->totsamp,
-			    MAX_ORDER * sizeof(Float_t));
-			memmove(ctx->routbuf, ctx->routbuf + ctx->totsamp,
-			    MAX_ORDER * sizeof(Float_t));
-			memmove(ctx->lstepbuf, ctx->lstepbuf + ctx->totsamp,
-			    MAX_ORDER * sizeof(Float_t));
-			memmove(ctx->rstepbuf, ctx->rstepbuf + ctx->totsamp,
-			    MAX_ORDER * sizeof(Float_t));
-			ctx->totsamp = 0;
-		}
-		/* XXX somehow I really screwed up: Error in programming!
-		 * Contact author about totsamp > sample_window
-		 *
-		 * Markus: I'm not sure who wrote above note or what it
-		 * means; maybe it's an assertion */
-		if (ctx->totsamp > ctx->sample_window)
-			return REPLAYGAIN_ERROR;
+		group = i % 16 ? group + z[0]*z[0] : z[0]*z[0];
+		if (i % 16 == 15 || i + 1 == nSamples)
+			*sum += group;
+
+		for (j = YULE_ORDER; j > 0; j--) {
+			x[j] = x[j - 1];
+			y[j] = y[j - 1];
+		}
+		z[2] = z[1];
+		z[1] = z[0];
 	}
-	if (num_samples < MAX_ORDER) {
-		memmove(ctx->linprebuf, ctx->linprebuf + num_samples,
-		    (MAX_ORDER - num_samples) * sizeof(Float_t));
-		memmove(ctx->rinprebuf, ctx->rinprebuf + num_samples,
-		    (MAX_ORDER - num_samples) * sizeof(Float_t));
-		memcpy(ctx->linprebuf + MAX_ORDER - num_samples,
-		    lsamples, num_samples * sizeof(Float_t));
-		memcpy(ctx->rinprebuf + MAX_ORDER - num_samples,
-		    rsamples, num_samples * sizeof(Float_t));
-	} else {
-		memcpy(ctx->linprebuf,
-		    lsamples + num_samples - MAX_ORDER,
-		    MAX_ORDER * sizeof(Float_t));
-		memcpy(ctx->rinprebuf,
-		    rsamples + num_samples - MAX_ORDER,
-		    MAX_ORDER * sizeof(Float_t));
+}
+
+/* coefficients converted to single precision */
+static void
+coefficients_float(const struct replaygain_ctx *ctx, float *yule,
+    float *butter) {
+	int	i;
+
+	for (i = 0; i <= 2*YULE_ORDER; i++)
+		yule[i] = ctx->yule[i];
+	for (i = 0; i <= 2*BUTTER_ORDER; i++)
+		butter[i] = ctx->butter[i];
+}
+
+static void
+filter_stereo_float(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples) {
+	float	yule[2*YULE_ORDER + 1];
+	float	butter[2*BUTTER_ORDER + 1];
+
+	coefficients_float(ctx, yule, butter);
+	filter_mono_float(lin, pair->lstep + ctx->totsamp,
+	    pair->lout + ctx->totsamp, nSamples, yule, butter, &pair->lsum);
+	filter_mono_float(rin, pair->rstep + ctx->totsamp,
+	    pair->rout + ctx->totsamp, nSamples, yule, butter, &pair->rsum);
+	track_peak(lin, nSamples, &pair->peak[0], &pair->clipped[0]);
+	track_peak(rin, nSamples, &pair->peak[1], &pair->clipped[1]);
+}
+
+static void
+filter_float_dual(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *in, size_t nSamples) {
+	float	yule[2*YULE_ORDER + 1];
+	float	butter[2*BUTTER_ORDER + 1];
+
+	coefficients_float(ctx, yule, butter);
+	filter_mono_float(in, pair->lstep + ctx->totsamp,
+	    pair->lout + ctx->totsamp, nSamples, yule, butter, &pair->lsum);
+	track_peak(in, nSamples, &pair->peak[0], &pair->clipped[0]);
+	mirror_left(ctx, pair, nSamples);
+}
+
+/* Interpolate one channel 4x and track the largest magnitude.  Single
+ * precision is plenty for a meter.  Each output sums its taps in order,
+ * which the SIMD versions repeat exactly, one phase per lane. */
+static void
+true_peak_mono(float *hist, const Float_t *in, size_t nSamples,
+    Float_t *peak) {
+	float	max = *peak;
+	float	acc;
+	size_t	i;
+	int	p;
+	int	t;
+
+	for (i = 0; i < nSamples; i++) {
+		for (t = TRUE_PEAK_TAPS - 1; t > 0; t--)
+			hist[t] = hist[t - 1];
+		hist[0] = in[i];
+
+		for (p = 0; p < 4; p++) {
+			acc = TRUE_PEAK_FIR[p][0] * hist[0];
+			for (t = 1; t < TRUE_PEAK_TAPS; t++)
+				acc += TRUE_PEAK_FIR[p][t] * hist[t];
+			if (fabsf(acc) > max)
+				max = fabsf(acc);
+		}
 	}
+	*peak = max;
+}
 
-	return REPLAYGAIN_OK;
+static void
+true_peak_stereo(struct channel_pair *pair, const Float_t *lin,
+    const Float_t *rin, size_t nSamples) {
+	true_peak_mono(pair->tp_hist[0], lin, nSamples, &pair->true_peak[0]);
+	true_peak_mono(pair->tp_hist[1], rin, nSamples, &pair->true_peak[1]);
 }
 
-Float_t
-replaygain_adjustment(const struct replaygain_value *out) {
-	uint32_t	elems;
-	int32_t		upper;
+static void
+true_peak_dual(struct channel_pair *pair, const Float_t *in,
+    size_t nSamples) {
+	true_peak_mono(pair->tp_hist[0], in, nSamples, &pair->true_peak[0]);
+	memcpy(pair->tp_hist[1], pair->tp_hist[0], sizeof(pair->tp_hist[1]));
+	pair->true_peak[1] = pair->true_peak[0];
+}
+
+/* Decimate 2:1 the *avail stereo pairs of buf with a half-band filter of
+ * 'half' taps a side, writing the pairs to out.  The input no output needs
+ * any more is dropped from the front of buf; returns the outputs. */
+static size_t
+halfband_stereo(Float_t *buf, size_t *avail, Float_t *out,
+    const Float_t *taps, int half) {
+	size_t	len = HALFBAND_LEN(half);
+	size_t	have = *avail;
+	size_t	pos;
+	size_t	m = 0;
+	int	i;
+	int	c;
+
+	for (pos = 0; pos + len <= have; pos += 2, m++) {
+		const Float_t	*x = buf + 2 * (pos + 2*half - 1);
+
+		for (c = 0; c < 2; c++) {
+			Float_t	y0 = 0.5 * x[c];
+			Float_t	y1 = 0;
+
+			/* alternate taps into two sums, as the SIMD kernel
+			 * does, for the same rounding */
+			for (i = 0; i < half; i += 2) {
+				y0 += taps[i] *
+				    (x[c - 2*(2*i + 1)] + x[c + 2*(2*i + 1)]);
+				y1 += taps[i+1] *
+				    (x[c - 2*(2*i + 3)] + x[c + 2*(2*i + 3)]);
+			}
+			out[2*m + c] = y0 + y1;
+		}
+	}
+	*avail = have - pos;
+	memmove(buf, buf + 2 * pos, 2 * *avail * sizeof(Float_t));
+	return m;
+}
+
+#ifdef X86_DISPATCH
+/* The stereo filters again, but with the left channel in the low lane of an
+ * SSE2 register and the right channel in the high lane.  The two filters
+ * are recursive, so the time goes to the latency of the long chain of adds
+ * in filter_yule(); running both channels down one chain halves it.  The
+ * square sums are fused into the same loop.
+ *
+ * Every lane performs exactly the operations of filter_yule(),
+ * filter_butter() and sum_squares(), in the same order, so the results are
+ * bit-identical to filter_stereo().  (No FMA: a fused multiply-add rounds
+ * differently.) */
+
+static inline TARGET("sse2") __m128d
+stereo_load(const Float_t *l, const Float_t *r) {
+	return _mm_loadh_pd(_mm_load_sd(l), r);
+}
+
+static inline TARGET("sse2") void
+stereo_store(Float_t *l, Float_t *r, __m128d v) {
+	_mm_storel_pd(l, v);
+	_mm_storeh_pd(r, v);
+}
+
+/* acc + a * b */
+static inline TARGET("sse2") __m128d
+madd(__m128d acc, __m128d a, __m128d b) {
+	return _mm_add_pd(acc, _mm_mul_pd(a, b));
+}
+
+/* acc - a * b */
+static inline TARGET("sse2") __m128d
+msub(__m128d acc, __m128d a, __m128d b) {
+	return _mm_sub_pd(acc, _mm_mul_pd(a, b));
+}
+
+/* halfband_stereo(), a pair per register; inlined for each filter, so the
+ * taps loop unrolls, and with two sums to shorten the chain of adds */
+static inline TARGET("sse2") ALWAYS_INLINE size_t
+halfband_simd(Float_t *buf, size_t *avail, Float_t *out,
+    const Float_t *taps, const int half) {
+	__m128d	k[HALFBAND_LONG];
+	__m128d	y0;
+	__m128d	y1;
+	size_t	len = HALFBAND_LEN(half);
+	size_t	have = *avail;
+	size_t	pos;
+	size_t	m = 0;
+	int	i;
+
+	for (i = 0; i < half; i++)
+		k[i] = _mm_set1_pd(taps[i]);
+	for (pos = 0; pos + len <= have; pos += 2, m++) {
+		const Float_t	*x = buf + 2 * (pos + 2*half - 1);
+
+		y0 = _mm_mul_pd(_mm_set1_pd(0.5), _mm_loadu_pd(x));
+		y1 = _mm_setzero_pd();
+		for (i = 0; i < half; i += 2) {
+			y0 = madd(y0, k[i], _mm_add_pd(
+			    _mm_loadu_pd(x - 2*(2*i + 1)),
+			    _mm_loadu_pd(x + 2*(2*i + 1))));
+			y1 = madd(y1, k[i+1], _mm_add_pd(
+			    _mm_loadu_pd(x - 2*(2*i + 3)),
+			    _mm_loadu_pd(x + 2*(2*i + 3))));
+		}
+		_mm_storeu_pd(out + 2*m, _mm_add_pd(y0, y1));
+	}
+	*avail = have - pos;
+	memmove(buf, buf + 2 * pos, 2 * *avail * sizeof(Float_t));
+	return m;
+}
+
+static TARGET("sse2") size_t
+halfband_sse2(Float_t *buf, size_t *avail, Float_t *out,
+    const Float_t *taps, int half) {
+	if (half == HALFBAND_LONG)
+		return halfband_simd(buf, avail, out, taps, HALFBAND_LONG);
+	return halfband_simd(buf, avail, out, taps, HALFBAND_SHORT);
+}
+
+/* track_peak() for one sample of each channel; each lane of clipped counts
+ * down */
+static inline TARGET("sse2") void
+stereo_peak(__m128d x, __m128d *peak, __m128i *clipped) {
+	__m128d	mag;
+
+	mag = _mm_andnot_pd(_mm_set1_pd(-0.0), x);
+	*peak = _mm_max_pd(*peak, mag);
+	*clipped = _mm_add_epi64(*clipped, _mm_castpd_si128(
+	    _mm_cmpge_pd(mag, _mm_set1_pd(FULL_SCALE))));
+}
+
+static inline TARGET("sse2") void
+stereo_peak_store(struct channel_pair *pair, __m128d peak,
+    __m128i clipped) {
+	uint64_t	count[2];
+
+	_mm_storeu_pd(pair->peak, peak);
+	_mm_storeu_si128((__m128i *)count, clipped);
+	pair->clipped[0] -= count[0];
+	pair->clipped[1] -= count[1];
+}
+
+/* With silent, the input is all zero, as is the history of it: the input
+ * terms and the peaks are left out, as filter_pair_silent() does */
+static inline TARGET("sse2") ALWAYS_INLINE void
+filter_stereo_simd(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples, bool silent) {
+	const Float_t	*yule = ctx->yule;
+	const Float_t	*butter = ctx->butter;
+	Float_t		*lstep = pair->lstep + ctx->totsamp;
+	Float_t		*rstep = pair->rstep + ctx->totsamp;
+	Float_t		*lout = pair->lout + ctx->totsamp;
+	Float_t		*rout = pair->rout + ctx->totsamp;
+	__m128d		k[2*YULE_ORDER + 1];
+	__m128d		b[2*BUTTER_ORDER + 1];
+	/* input, Yule output (Butterworth input), Butterworth output; the
+	 * histories are kept in registers rather than reloaded */
+	__m128d		x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10;
+	__m128d		y0, y1, y2, y3, y4, y5, y6, y7, y8, y9, y10;
+	__m128d		z0, z1, z2;
+	__m128d		sum;
+	__m128d		group;
+	__m128d		peak;
+	__m128i		clipped;
+	size_t		head;
 	size_t		i;
+	int		j;
 
-	elems = 0;
-	for (i = 0; i < ANALYZE_SIZE; i++)
-		elems += out->value[i];
-	if (!elems)
-		return GAIN_NOT_ENOUGH_SAMPLES;
+	for (j = 0; j <= 2*YULE_ORDER; j++)
+		k[j] = _mm_set1_pd(yule[j]);
+	for (j = 0; j <= 2*BUTTER_ORDER; j++)
+		b[j] = _mm_set1_pd(butter[j]);
 
-	upper = ceil(elems * (1 - RMS_PERCENTILE));
-	for (i = ANALYZE_SIZE; i-- > 0;) {
-		if ((upper -= out->value[i]) <= 0)
-			break;
+	if (silent)
+		x1 = x2 = x3 = x4 = x5 = x6 = x7 = x8 = x9 = x10 =
+		    _mm_setzero_pd();
+	else {
+		x1  = stereo_load(lin  -  1, rin  -  1);
+		x2  = stereo_load(lin  -  2, rin  -  2);
+		x3  = stereo_load(lin  -  3, rin  -  3);
+		x4  = stereo_load(lin  -  4, rin  -  4);
+		x5  = stereo_load(lin  -  5, rin  -  5);
+		x6  = stereo_load(lin  -  6, rin  -  6);
+		x7  = stereo_load(lin  -  7, rin  -  7);
+		x8  = stereo_load(lin  -  8, rin  -  8);
+		x9  = stereo_load(lin  -  9, rin  -  9);
+		x10 = stereo_load(lin  - 10, rin  - 10);
 	}
-	assert(i < ANALYZE_SIZE);
+	y1  = stereo_load(lstep -  1, rstep -  1);
+	y2  = stereo_load(lstep -  2, rstep -  2);
+	y3  = stereo_load(lstep -  3, rstep -  3);
+	y4  = stereo_load(lstep -  4, rstep -  4);
+	y5  = stereo_load(lstep -  5, rstep -  5);
+	y6  = stereo_load(lstep -  6, rstep -  6);
+	y7  = stereo_load(lstep -  7, rstep -  7);
+	y8  = stereo_load(lstep -  8, rstep -  8);
+	y9  = stereo_load(lstep -  9, rstep -  9);
+	y10 = stereo_load(lstep - 10, rstep - 10);
+	z1  = stereo_load(lout -  1, rout -  1);
+	z2  = stereo_load(lout -  2, rout -  2);
 
-	return PINK_REF - (Float_t)i / STEPS_PER_DB;
+	sum = _mm_set_pd(pair->rsum, pair->lsum);
+	group = _mm_setzero_pd();
+	peak = _mm_loadu_pd(pair->peak);
+	clipped = _mm_setzero_si128();
+
+	/* square sums are grouped the same as sum_squares() */
+	head = nSamples % 16;
+	for (i = 0; i < nSamples; i++) {
+		if (silent) {
+			y0 = msub(_mm_set1_pd(1e-10), y1, k[1]);
+			y0 = msub(y0, y2,  k[ 3]);
+			y0 = msub(y0, y3,  k[ 5]);
+			y0 = msub(y0, y4,  k[ 7]);
+			y0 = msub(y0, y5,  k[ 9]);
+			y0 = msub(y0, y6,  k[11]);
+			y0 = msub(y0, y7,  k[13]);
+			y0 = msub(y0, y8,  k[15]);
+			y0 = msub(y0, y9,  k[17]);
+			y0 = msub(y0, y10, k[19]);
+			x0 = x1;
+		} else {
+			x0 = stereo_load(lin + i, rin + i);
+			stereo_peak(x0, &peak, &clipped);
+
+			y0 = madd(_mm_set1_pd(1e-10), x0, k[0]);
+			y0 = msub(y0, y1,  k[ 1]);	y0 = madd(y0, x1,  k[ 2]);
+			y0 = msub(y0, y2,  k[ 3]);	y0 = madd(y0, x2,  k[ 4]);
+			y0 = msub(y0, y3,  k[ 5]);	y0 = madd(y0, x3,  k[ 6]);
+			y0 = msub(y0, y4,  k[ 7]);	y0 = madd(y0, x4,  k[ 8]);
+			y0 = msub(y0, y5,  k[ 9]);	y0 = madd(y0, x5,  k[10]);
+			y0 = msub(y0, y6,  k[11]);	y0 = madd(y0, x6,  k[12]);
+			y0 = msub(y0, y7,  k[13]);	y0 = madd(y0, x7,  k[14]);
+			y0 = msub(y0, y8,  k[15]);	y0 = madd(y0, x8,  k[16]);
+			y0 = msub(y0, y9,  k[17]);	y0 = madd(y0, x9,  k[18]);
+			y0 = msub(y0, y10, k[19]);	y0 = madd(y0, x10, k[20]);
+		}
+
+		z0 = _mm_mul_pd(y0, b[0]);
+		z0 = msub(z0, z1, b[1]);	z0 = madd(z0, y1, b[2]);
+		z0 = msub(z0, z2, b[3]);	z0 = madd(z0, y2, b[4]);
+
+		stereo_store(lstep + i, rstep + i, y0);
+		stereo_store(lout + i, rout + i, z0);
+
+		x10 = x9; x9 = x8; x8 = x7; x7 = x6; x6 = x5;
+		x5 = x4; x4 = x3; x3 = x2; x2 = x1; x1 = x0;
+		y10 = y9; y9 = y8; y8 = y7; y7 = y6; y6 = y5;
+		y5 = y4; y4 = y3; y3 = y2; y2 = y1; y1 = y0;
+		z2 = z1; z1 = z0;
+
+		z0 = _mm_mul_pd(z0, z0);
+		if (i < head)
+			sum = _mm_add_pd(sum, z0);
+		else if ((i - head) % 16 == 0)
+			group = z0;
+		else if ((i - head) % 16 != 15)
+			group = _mm_add_pd(group, z0);
+		else
+			sum = _mm_add_pd(sum, _mm_add_pd(group, z0));
+	}
+
+	_mm_storel_pd(&pair->lsum, sum);
+	_mm_storeh_pd(&pair->rsum, sum);
+	if (!silent)
+		stereo_peak_store(pair, peak, clipped);
 }
 
-void
-replaygain_pop(struct replaygain_ctx *ctx, struct replaygain_value *out) {
-	memcpy(out, &ctx->value, sizeof(ctx->value));
+static TARGET("sse2") void
+filter_stereo_sse2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples) {
+	filter_stereo_simd(ctx, pair, lin, rin, nSamples, false);
+}
 
-	memset(&ctx->value, 0, sizeof(ctx->value));
-	memset(ctx->linprebuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->rinprebuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->lstepbuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->rstepbuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->loutbuf, 0, sizeof(Float_t) * MAX_ORDER);
-	memset(ctx->routbuf, 0, sizeof(Float_t) * MAX_ORDER);
-	ctx->totsamp = 0;
-	ctx->lsum = ctx->rsum = 0.0;
+/* Same instructions, VEX-encoded.  Nothing to gain from wider registers with
+ * only two channels. */
+static TARGET("avx2") void
+filter_stereo_avx2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples) {
+	filter_stereo_simd(ctx, pair, lin, rin, nSamples, false);
+}
+
+/* The chain of adds, not the arithmetic, sets the pace, and the right lane
+ * comes free with the left: a dual pair is filtered as any other. */
+static TARGET("sse2") void
+filter_dual_sse2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *in, size_t nSamples) {
+	filter_stereo_simd(ctx, pair, in, in, nSamples, false);
+}
+
+static TARGET("avx2") void
+filter_dual_avx2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *in, size_t nSamples) {
+	filter_stereo_simd(ctx, pair, in, in, nSamples, false);
+}
+
+/* Half the adds on the chain, so silence goes about twice as fast */
+static TARGET("sse2") void
+filter_silent_sse2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    size_t nSamples) {
+	filter_stereo_simd(ctx, pair, 0, 0, nSamples, true);
+}
+
+static TARGET("avx2") void
+filter_silent_avx2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    size_t nSamples) {
+	filter_stereo_simd(ctx, pair, 0, 0, nSamples, true);
+}
+
+/* Two pairs, four channels, in the lanes of an AVX register: surround
+ * sound costs about what stereo does per pair, the chain of adds being
+ * just as long.  Again no FMA, and the same operations as filter_stereo()
+ * in every lane.  The two pairs may be of different tracks at the same
+ * frequency, analyzed together by replaygain_analyze_batch(). */
+
+static inline TARGET("avx2") __m256d
+quad_load(const Float_t *const *in, ptrdiff_t i) {
+	return _mm256_setr_pd(in[0][i], in[1][i], in[2][i], in[3][i]);
+}
+
+static inline TARGET("avx2") __m256d
+quad_reload(Float_t *const *out, ptrdiff_t i) {
+	return quad_load((const Float_t *const *)out, i);
+}
+
+static inline TARGET("avx2") void
+quad_store(Float_t *const *out, size_t i, __m256d v) {
+	__m128d	lo = _mm256_castpd256_pd128(v);
+	__m128d	hi = _mm256_extractf128_pd(v, 1);
+
+	_mm_storel_pd(out[0] + i, lo);
+	_mm_storeh_pd(out[1] + i, lo);
+	_mm_storel_pd(out[2] + i, hi);
+	_mm_storeh_pd(out[3] + i, hi);
+}
+
+/* acc + a * b, acc - a * b */
+static inline TARGET("avx2") __m256d
+madd4(__m256d acc, __m256d a, __m256d b) {
+	return _mm256_add_pd(acc, _mm256_mul_pd(a, b));
+}
+
+static inline TARGET("avx2") __m256d
+msub4(__m256d acc, __m256d a, __m256d b) {
+	return _mm256_sub_pd(acc, _mm256_mul_pd(a, b));
+}
+
+static TARGET("avx2") void
+filter_quad_avx2(struct replaygain_ctx *const *ctx,
+    struct channel_pair *const *pair, const Float_t *const *in,
+    size_t nSamples) {
+	const Float_t	*yule = ctx[0]->yule;
+	const Float_t	*butter = ctx[0]->butter;
+	Float_t		*step[4];
+	Float_t		*out[4];
+	__m256d		k[2*YULE_ORDER + 1];
+	__m256d		b[2*BUTTER_ORDER + 1];
+	__m256d		x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10;
+	__m256d		y0, y1, y2, y3, y4, y5, y6, y7, y8, y9, y10;
+	__m256d		z0, z1, z2;
+	__m256d		sum;
+	__m256d		group;
+	__m256d		peak;
+	__m256d		mag;
+	__m256i		clipped;
+	double		lanes[4];
+	uint64_t	count[4];
+	size_t		head;
+	size_t		i;
+	int		j;
+
+	for (j = 0; j < 2; j++) {
+		step[2*j] = pair[j]->lstep + ctx[j]->totsamp;
+		step[2*j + 1] = pair[j]->rstep + ctx[j]->totsamp;
+		out[2*j] = pair[j]->lout + ctx[j]->totsamp;
+		out[2*j + 1] = pair[j]->rout + ctx[j]->totsamp;
+	}
+	for (j = 0; j <= 2*YULE_ORDER; j++)
+		k[j] = _mm256_set1_pd(yule[j]);
+	for (j = 0; j <= 2*BUTTER_ORDER; j++)
+		b[j] = _mm256_set1_pd(butter[j]);
+
+	x1  = quad_load(in,  -1);	y1  = quad_reload(step,  -1);
+	x2  = quad_load(in,  -2);	y2  = quad_reload(step,  -2);
+	x3  = quad_load(in,  -3);	y3  = quad_reload(step,  -3);
+	x4  = quad_load(in,  -4);	y4  = quad_reload(step,  -4);
+	x5  = quad_load(in,  -5);	y5  = quad_reload(step,  -5);
+	x6  = quad_load(in,  -6);	y6  = quad_reload(step,  -6);
+	x7  = quad_load(in,  -7);	y7  = quad_reload(step,  -7);
+	x8  = quad_load(in,  -8);	y8  = quad_reload(step,  -8);
+	x9  = quad_load(in,  -9);	y9  = quad_reload(step,  -9);
+	x10 = quad_load(in, -10);	y10 = quad_reload(step, -10);
+	z1  = quad_reload(out, -1);
+	z2  = quad_reload(out, -2);
+
+	sum = _mm256_setr_pd(pair[0]->lsum, pair[0]->rsum, pair[1]->lsum,
+	    pair[1]->rsum);
+	group = _mm256_setzero_pd();
+	peak = _mm256_setr_pd(pair[0]->peak[0], pair[0]->peak[1],
+	    pair[1]->peak[0], pair[1]->peak[1]);
+	clipped = _mm256_setzero_si256();
+
+	head = nSamples % 16;
+	for (i = 0; i < nSamples; i++) {
+		x0 = quad_load(in, i);
+		mag = _mm256_andnot_pd(_mm256_set1_pd(-0.0), x0);
+		peak = _mm256_max_pd(peak, mag);
+		clipped = _mm256_add_epi64(clipped, _mm256_castpd_si256(
+		    _mm256_cmp_pd(mag, _mm256_set1_pd(FULL_SCALE),
+		    _CMP_GE_OQ)));
+
+		y0 = madd4(_mm256_set1_pd(1e-10), x0, k[0]);
+		y0 = msub4(y0, y1,  k[ 1]);	y0 = madd4(y0, x1,  k[ 2]);
+		y0 = msub4(y0, y2,  k[ 3]);	y0 = madd4(y0, x2,  k[ 4]);
+		y0 = msub4(y0, y3,  k[ 5]);	y0 = madd4(y0, x3,  k[ 6]);
+		y0 = msub4(y0, y4,  k[ 7]);	y0 = madd4(y0, x4,  k[ 8]);
+		y0 = msub4(y0, y5,  k[ 9]);	y0 = madd4(y0, x5,  k[10]);
+		y0 = msub4(y0, y6,  k[11]);	y0 = madd4(y0, x6,  k[12]);
+		y0 = msub4(y0, y7,  k[13]);	y0 = madd4(y0, x7,  k[14]);
+		y0 = msub4(y0, y8,  k[15]);	y0 = madd4(y0, x8,  k[16]);
+		y0 = msub4(y0, y9,  k[17]);	y0 = madd4(y0, x9,  k[18]);
+		y0 = msub4(y0, y10, k[19]);	y0 = madd4(y0, x10, k[20]);
+
+		z0 = _mm256_mul_pd(y0, b[0]);
+		z0 = msub4(z0, z1, b[1]);	z0 = madd4(z0, y1, b[2]);
+		z0 = msub4(z0, z2, b[3]);	z0 = madd4(z0, y2, b[4]);
+
+		quad_store(step, i, y0);
+		quad_store(out, i, z0);
+
+		x10 = x9; x9 = x8; x8 = x7; x7 = x6; x6 = x5;
+		x5 = x4; x4 = x3; x3 = x2; x2 = x1; x1 = x0;
+		y10 = y9; y9 = y8; y8 = y7; y7 = y6; y6 = y5;
+		y5 = y4; y4 = y3; y3 = y2; y2 = y1; y1 = y0;
+		z2 = z1; z1 = z0;
+
+		z0 = _mm256_mul_pd(z0, z0);
+		if (i < head)
+			sum = _mm256_add_pd(sum, z0);
+		else if ((i - head) % 16 == 0)
+			group = z0;
+		else if ((i - head) % 16 != 15)
+			group = _mm256_add_pd(group, z0);
+		else
+			sum = _mm256_add_pd(sum, _mm256_add_pd(group, z0));
+	}
+
+	_mm256_storeu_pd(lanes, sum);
+	pair[0]->lsum = lanes[0];	pair[0]->rsum = lanes[1];
+	pair[1]->lsum = lanes[2];	pair[1]->rsum = lanes[3];
+	_mm256_storeu_pd(lanes, peak);
+	_mm256_storeu_si256((__m256i *)count, clipped);
+	for (j = 0; j < 4; j++) {
+		pair[j / 2]->peak[j % 2] = lanes[j];
+		pair[j / 2]->clipped[j % 2] -= count[j];
+	}
+}
+
+/* filter_mono_float() for both channels.  The part of the Yule filter that
+ * depends only on the input is computed first for a block, four samples of
+ * a channel per register; the recursive remainder then runs with left and
+ * right in the two low lanes, the history in registers. */
+
+#define FLOAT_BLOCK	256
+
+/* a * b + c * d */
+static inline TARGET("sse2") __m128
+mpair(__m128 a, __m128 b, __m128 c, __m128 d) {
+	return _mm_add_ps(_mm_mul_ps(a, b), _mm_mul_ps(c, d));
+}
+
+/* 1e-10 plus the input terms of yule_float() for x[0..3] */
+static inline TARGET("sse2") __m128
+yule_fir4(const float *x, const __m128 *k) {
+	return _mm_add_ps(_mm_set1_ps(1e-10f), _mm_add_ps(_mm_add_ps(
+	    _mm_add_ps(mpair(k[ 0], _mm_loadu_ps(x    ),
+	    k[ 2], _mm_loadu_ps(x - 1)),
+	    mpair(k[ 4], _mm_loadu_ps(x - 2), k[ 6], _mm_loadu_ps(x - 3))),
+	    _mm_add_ps(mpair(k[ 8], _mm_loadu_ps(x - 4),
+	    k[10], _mm_loadu_ps(x - 5)),
+	    mpair(k[12], _mm_loadu_ps(x - 6), k[14], _mm_loadu_ps(x - 7)))),
+	    _mm_add_ps(mpair(k[16], _mm_loadu_ps(x - 8),
+	    k[18], _mm_loadu_ps(x - 9)),
+	    _mm_mul_ps(k[20], _mm_loadu_ps(x - 10)))));
+}
+
+static inline TARGET("sse2") __m128
+stereo_load_float(const Float_t *l, const Float_t *r) {
+	return _mm_cvtpd_ps(stereo_load(l, r));
+}
+
+static inline TARGET("sse2") void
+stereo_store_float(Float_t *l, Float_t *r, __m128 v) {
+	stereo_store(l, r, _mm_cvtps_pd(v));
+}
+
+/* With dual, the right channel's input terms are the left's. */
+static inline TARGET("sse2") ALWAYS_INLINE void
+filter_stereo_float_simd(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples, bool dual) {
+	Float_t	*lstep = pair->lstep + ctx->totsamp;
+	Float_t	*rstep = pair->rstep + ctx->totsamp;
+	Float_t	*lout = pair->lout + ctx->totsamp;
+	Float_t	*rout = pair->rout + ctx->totsamp;
+	float	yule[2*YULE_ORDER + 1];
+	float	butter[2*BUTTER_ORDER + 1];
+	/* input with history, padded to a multiple of 4 */
+	float	lx[MAX_ORDER + FLOAT_BLOCK];
+	float	rx[MAX_ORDER + FLOAT_BLOCK];
+	/* input terms, left and right interleaved */
+	float	fir[2 * FLOAT_BLOCK];
+	__m128	k[2*YULE_ORDER + 1];
+	__m128	b[2*BUTTER_ORDER + 1];
+	__m128	y0, y1, y2, y3, y4, y5, y6, y7, y8, y9, y10;
+	__m128	z0, z1, z2;
+	__m128	fl;
+	__m128	fr;
+	__m128	rest;
+	__m128	group;
+	__m128d	sum;
+	__m128d	peak;
+	__m128i	clipped;
+	size_t	block;
+	size_t	done;
+	size_t	i;
+	int	j;
+
+	coefficients_float(ctx, yule, butter);
+	for (j = 0; j <= 2*YULE_ORDER; j++)
+		k[j] = _mm_set1_ps(yule[j]);
+	for (j = 0; j <= 2*BUTTER_ORDER; j++)
+		b[j] = _mm_set1_ps(butter[j]);
+
+	y1  = stereo_load_float(lstep -  1, rstep -  1);
+	y2  = stereo_load_float(lstep -  2, rstep -  2);
+	y3  = stereo_load_float(lstep -  3, rstep -  3);
+	y4  = stereo_load_float(lstep -  4, rstep -  4);
+	y5  = stereo_load_float(lstep -  5, rstep -  5);
+	y6  = stereo_load_float(lstep -  6, rstep -  6);
+	y7  = stereo_load_float(lstep -  7, rstep -  7);
+	y8  = stereo_load_float(lstep -  8, rstep -  8);
+	y9  = stereo_load_float(lstep -  9, rstep -  9);
+	y10 = stereo_load_float(lstep - 10, rstep - 10);
+	z1  = stereo_load_float(lout -  1, rout -  1);
+	z2  = stereo_load_float(lout -  2, rout -  2);
+
+	sum = _mm_set_pd(pair->rsum, pair->lsum);
+	group = _mm_setzero_ps();
+	peak = _mm_loadu_pd(pair->peak);
+	clipped = _mm_setzero_si128();
+
+	for (done = 0; done < nSamples; done += block) {
+		block = nSamples - done;
+		if (block > FLOAT_BLOCK - MAX_ORDER)
+			block = FLOAT_BLOCK - MAX_ORDER;
+
+		for (i = 0; i < MAX_ORDER + block; i++) {
+			lx[i] = lin[done + i - MAX_ORDER];
+			if (!dual)
+				rx[i] = rin[done + i - MAX_ORDER];
+		}
+		for (; i % 4 != MAX_ORDER % 4; i++)
+			lx[i] = rx[i] = 0;
+		for (i = 0; i < block; i += 4) {
+			fl = yule_fir4(lx + MAX_ORDER + i, k);
+			fr = dual ? fl : yule_fir4(rx + MAX_ORDER + i, k);
+			_mm_storeu_ps(fir + 2*i, _mm_unpacklo_ps(fl, fr));
+			_mm_storeu_ps(fir + 2*i + 4, _mm_unpackhi_ps(fl, fr));
+		}
+
+		for (i = 0; i < block; i++) {
+			stereo_peak(stereo_load(lin + done + i, rin + done + i),
+			    &peak, &clipped);
+
+			/* same grouping as yule_float() */
+			rest = _mm_add_ps(_mm_add_ps(
+			    _mm_add_ps(mpair(k[ 3], y2, k[ 5], y3),
+			    mpair(k[ 7], y4, k[ 9], y5)),
+			    _mm_add_ps(mpair(k[11], y6, k[13], y7),
+			    mpair(k[15], y8, k[17], y9))),
+			    _mm_mul_ps(k[19], y10));
+			y0 = _mm_sub_ps(_mm_sub_ps(_mm_castpd_ps(_mm_load_sd(
+			    (const double *)(fir + 2*i))), rest),
+			    _mm_mul_ps(k[1], y1));
+
+			/* butter_float() */
+			z0 = _mm_sub_ps(_mm_add_ps(mpair(b[0], y0, b[2], y1),
+			    _mm_sub_ps(_mm_mul_ps(b[4], y2),
+			    _mm_mul_ps(b[3], z2))),
+			    _mm_mul_ps(b[1], z1));
+
+			if (done + i + MAX_ORDER >= nSamples) {
+				stereo_store_float(lstep + done + i,
+				    rstep + done + i, y0);
+				stereo_store_float(lout + done + i,
+				    rout + done + i, z0);
+			}
+
+			group = (done + i) % 16 ?
+			    _mm_add_ps(group, _mm_mul_ps(z0, z0)) :
+			    _mm_mul_ps(z0, z0);
+			if ((done + i) % 16 == 15 || done + i + 1 == nSamples)
+				sum = _mm_add_pd(sum, _mm_cvtps_pd(group));
+
+			y10 = y9; y9 = y8; y8 = y7; y7 = y6; y6 = y5;
+			y5 = y4; y4 = y3; y3 = y2; y2 = y1; y1 = y0;
+			z2 = z1; z1 = z0;
+		}
+	}
+
+	_mm_storel_pd(&pair->lsum, sum);
+	_mm_storeh_pd(&pair->rsum, sum);
+	stereo_peak_store(pair, peak, clipped);
+}
+
+static TARGET("sse2") void
+filter_stereo_float_sse2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples) {
+	filter_stereo_float_simd(ctx, pair, lin, rin, nSamples, false);
+}
+
+static TARGET("avx2") void
+filter_stereo_float_avx2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *lin, const Float_t *rin, size_t nSamples) {
+	filter_stereo_float_simd(ctx, pair, lin, rin, nSamples, false);
+}
+
+static TARGET("sse2") void
+filter_float_dual_sse2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *in, size_t nSamples) {
+	filter_stereo_float_simd(ctx, pair, in, in, nSamples, true);
+}
+
+static TARGET("avx2") void
+filter_float_dual_avx2(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const Float_t *in, size_t nSamples) {
+	filter_stereo_float_simd(ctx, pair, in, in, nSamples, true);
+}
+
+/* true_peak_mono() with the four phases in the lanes of a register; the
+ * history stays in registers */
+static TARGET("sse2") void
+true_peak_mono_sse2(float *hist, const Float_t *in, size_t nSamples,
+    Float_t *peak) {
+	__m128	h[TRUE_PEAK_TAPS];
+	__m128	x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11;
+	__m128	acc;
+	__m128	max;
+	float	lanes[4];
+	size_t	i;
+	int	t;
+
+	for (t = 0; t < TRUE_PEAK_TAPS; t++)
+		h[t] = _mm_setr_ps(TRUE_PEAK_FIR[0][t], TRUE_PEAK_FIR[1][t],
+		    TRUE_PEAK_FIR[2][t], TRUE_PEAK_FIR[3][t]);
+	x1  = _mm_set1_ps(hist[0]);	x2  = _mm_set1_ps(hist[1]);
+	x3  = _mm_set1_ps(hist[2]);	x4  = _mm_set1_ps(hist[3]);
+	x5  = _mm_set1_ps(hist[4]);	x6  = _mm_set1_ps(hist[5]);
+	x7  = _mm_set1_ps(hist[6]);	x8  = _mm_set1_ps(hist[7]);
+	x9  = _mm_set1_ps(hist[8]);	x10 = _mm_set1_ps(hist[9]);
+	x11 = _mm_set1_ps(hist[10]);
+	max = _mm_set1_ps(*peak);
+
+	for (i = 0; i < nSamples; i++) {
+		x0 = _mm_set1_ps(in[i]);
+
+		acc = _mm_mul_ps(h[0], x0);
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 1], x1));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 2], x2));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 3], x3));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 4], x4));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 5], x5));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 6], x6));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 7], x7));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 8], x8));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[ 9], x9));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[10], x10));
+		acc = _mm_add_ps(acc, _mm_mul_ps(h[11], x11));
+		max = _mm_max_ps(max, _mm_andnot_ps(_mm_set1_ps(-0.0f), acc));
+
+		x11 = x10; x10 = x9; x9 = x8; x8 = x7; x7 = x6; x6 = x5;
+		x5 = x4; x4 = x3; x3 = x2; x2 = x1; x1 = x0;
+	}
+
+	hist[0]  = _mm_cvtss_f32(x1);	hist[1]  = _mm_cvtss_f32(x2);
+	hist[2]  = _mm_cvtss_f32(x3);	hist[3]  = _mm_cvtss_f32(x4);
+	hist[4]  = _mm_cvtss_f32(x5);	hist[5]  = _mm_cvtss_f32(x6);
+	hist[6]  = _mm_cvtss_f32(x7);	hist[7]  = _mm_cvtss_f32(x8);
+	hist[8]  = _mm_cvtss_f32(x9);	hist[9]  = _mm_cvtss_f32(x10);
+	hist[10] = _mm_cvtss_f32(x11);
+	_mm_storeu_ps(lanes, max);
+	for (t = 0; t < 4; t++)
+		if (lanes[t] > *peak)
+			*peak = lanes[t];
+}
+
+static TARGET("sse2") void
+true_peak_sse2(struct channel_pair *pair, const Float_t *lin,
+    const Float_t *rin, size_t nSamples) {
+	true_peak_mono_sse2(pair->tp_hist[0], lin, nSamples,
+	    &pair->true_peak[0]);
+	true_peak_mono_sse2(pair->tp_hist[1], rin, nSamples,
+	    &pair->true_peak[1]);
+}
+
+static TARGET("sse2") void
+true_peak_dual_sse2(struct channel_pair *pair, const Float_t *in,
+    size_t nSamples) {
+	true_peak_mono_sse2(pair->tp_hist[0], in, nSamples,
+	    &pair->true_peak[0]);
+	memcpy(pair->tp_hist[1], pair->tp_hist[0], sizeof(pair->tp_hist[1]));
+	pair->true_peak[1] = pair->true_peak[0];
+}
+
+/* Both channels at once: left phases in the low half, right in the high.
+ * Fused multiply-adds halve the work; the result may differ from the other
+ * versions in the last bits. */
+static TARGET("avx2,fma") void
+true_peak_avx2(struct channel_pair *pair, const Float_t *lin,
+    const Float_t *rin, size_t nSamples) {
+	const __m256i	spread = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+	__m256		h[TRUE_PEAK_TAPS];
+	__m256		x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11;
+	__m256		acc;
+	__m256		max;
+	float		lanes[8];
+	size_t		i;
+	int		t;
+
+#define HIST(t)	_mm256_setr_ps(pair->tp_hist[0][t], pair->tp_hist[1][t], \
+	    0, 0, 0, 0, 0, 0)
+	for (t = 0; t < TRUE_PEAK_TAPS; t++)
+		h[t] = _mm256_setr_ps(TRUE_PEAK_FIR[0][t],
+		    TRUE_PEAK_FIR[1][t], TRUE_PEAK_FIR[2][t],
+		    TRUE_PEAK_FIR[3][t], TRUE_PEAK_FIR[0][t],
+		    TRUE_PEAK_FIR[1][t], TRUE_PEAK_FIR[2][t],
+		    TRUE_PEAK_FIR[3][t]);
+	x1  = _mm256_permutevar8x32_ps(HIST(0), spread);
+	x2  = _mm256_permutevar8x32_ps(HIST(1), spread);
+	x3  = _mm256_permutevar8x32_ps(HIST(2), spread);
+	x4  = _mm256_permutevar8x32_ps(HIST(3), spread);
+	x5  = _mm256_permutevar8x32_ps(HIST(4), spread);
+	x6  = _mm256_permutevar8x32_ps(HIST(5), spread);
+	x7  = _mm256_permutevar8x32_ps(HIST(6), spread);
+	x8  = _mm256_permutevar8x32_ps(HIST(7), spread);
+	x9  = _mm256_permutevar8x32_ps(HIST(8), spread);
+	x10 = _mm256_permutevar8x32_ps(HIST(9), spread);
+	x11 = _mm256_permutevar8x32_ps(HIST(10), spread);
+#undef HIST
+	max = _mm256_setr_ps(pair->true_peak[0], pair->true_peak[0],
+	    pair->true_peak[0], pair->true_peak[0], pair->true_peak[1],
+	    pair->true_peak[1], pair->true_peak[1], pair->true_peak[1]);
+
+	for (i = 0; i < nSamples; i++) {
+		x0 = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(
+		    _mm_cvtpd_ps(stereo_load(lin + i, rin + i))), spread);
+
+		acc = _mm256_mul_ps(h[0], x0);
+		acc = _mm256_fmadd_ps(h[ 1], x1, acc);
+		acc = _mm256_fmadd_ps(h[ 2], x2, acc);
+		acc = _mm256_fmadd_ps(h[ 3], x3, acc);
+		acc = _mm256_fmadd_ps(h[ 4], x4, acc);
+		acc = _mm256_fmadd_ps(h[ 5], x5, acc);
+		acc = _mm256_fmadd_ps(h[ 6], x6, acc);
+		acc = _mm256_fmadd_ps(h[ 7], x7, acc);
+		acc = _mm256_fmadd_ps(h[ 8], x8, acc);
+		acc = _mm256_fmadd_ps(h[ 9], x9, acc);
+		acc = _mm256_fmadd_ps(h[10], x10, acc);
+		acc = _mm256_fmadd_ps(h[11], x11, acc);
+		max = _mm256_max_ps(max,
+		    _mm256_andnot_ps(_mm256_set1_ps(-0.0f), acc));
+
+		x11 = x10; x10 = x9; x9 = x8; x8 = x7; x7 = x6; x6 = x5;
+		x5 = x4; x4 = x3; x3 = x2; x2 = x1; x1 = x0;
+	}
+
+#define UNHIST(t, x) do { \
+		_mm256_storeu_ps(lanes, (x)); \
+		pair->tp_hist[0][t] = lanes[0]; \
+		pair->tp_hist[1][t] = lanes[4]; \
+	} while (0)
+	UNHIST(0, x1);	UNHIST(1, x2);	UNHIST(2, x3);	UNHIST(3, x4);
+	UNHIST(4, x5);	UNHIST(5, x6);	UNHIST(6, x7);	UNHIST(7, x8);
+	UNHIST(8, x9);	UNHIST(9, x10);	UNHIST(10, x11);
+#undef UNHIST
+	_mm256_storeu_ps(lanes, max);
+	for (t = 0; t < 8; t++)
+		if (lanes[t] > pair->true_peak[t / 4])
+			pair->true_peak[t / 4] = lanes[t];
+}
+
+/* both channels of a register at once anyway */
+static TARGET("avx2,fma") void
+true_peak_dual_avx2(struct channel_pair *pair, const Float_t *in,
+    size_t nSamples) {
+	true_peak_avx2(pair, in, in, nSamples);
+}
+#endif
+
+static void
+accum_scalar(uint32_t *sum, const uint32_t *addition) {
+	size_t	i;
+
+	for (i = 0; i < ANALYZE_SIZE; i++)
+		sum[i] += addition[i];
+}
+
+#ifdef X86_DISPATCH
+static TARGET("sse2") void
+accum_sse2(uint32_t *sum, const uint32_t *addition) {
+	size_t	i;
+
+	for (i = 0; i < ANALYZE_SIZE; i += 4)
+		_mm_storeu_si128((__m128i *)(sum + i), _mm_add_epi32(
+		    _mm_loadu_si128((const __m128i *)(sum + i)),
+		    _mm_loadu_si128((const __m128i *)(addition + i))));
+}
+
+static TARGET("avx2") void
+accum_avx2(uint32_t *sum, const uint32_t *addition) {
+	size_t	i;
+
+	for (i = 0; i < ANALYZE_SIZE; i += 8)
+		_mm256_storeu_si256((__m256i *)(sum + i), _mm256_add_epi32(
+		    _mm256_loadu_si256((const __m256i *)(sum + i)),
+		    _mm256_loadu_si256((const __m256i *)(addition + i))));
+}
+
+static TARGET("avx512f") void
+accum_avx512(uint32_t *sum, const uint32_t *addition) {
+	size_t	i;
+
+	for (i = 0; i < ANALYZE_SIZE; i += 16)
+		_mm512_storeu_si512(sum + i, _mm512_add_epi32(
+		    _mm512_loadu_si512(addition + i),
+		    _mm512_loadu_si512(sum + i)));
+}
+#endif
+
+/* from least to most preferred */
+static const struct kernels KERNELS[] = {
+	{ REPLAYGAIN_KERNEL_SCALAR, filter_stereo, 0, filter_dual,
+	    filter_silent, filter_stereo_float, filter_float_dual,
+	    true_peak_stereo, true_peak_dual, halfband_stereo, accum_scalar },
+#ifdef X86_DISPATCH
+	{ REPLAYGAIN_KERNEL_SSE2, filter_stereo_sse2, 0, filter_dual_sse2,
+	    filter_silent_sse2, filter_stereo_float_sse2,
+	    filter_float_dual_sse2, true_peak_sse2, true_peak_dual_sse2,
+	    halfband_sse2, accum_sse2 },
+	{ REPLAYGAIN_KERNEL_AVX2, filter_stereo_avx2, filter_quad_avx2,
+	    filter_dual_avx2, filter_silent_avx2, filter_stereo_float_avx2,
+	    filter_float_dual_avx2, true_peak_avx2, true_peak_dual_avx2,
+	    halfband_sse2, accum_avx2 },
+	{ REPLAYGAIN_KERNEL_AVX512, filter_stereo_avx2, filter_quad_avx2,
+	    filter_dual_avx2, filter_silent_avx2, filter_stereo_float_avx2,
+	    filter_float_dual_avx2, true_peak_avx2, true_peak_dual_avx2,
+	    halfband_sse2, accum_avx512 },
+#endif
+};
+#define NUM_KERNELS	(sizeof(KERNELS) / sizeof(*KERNELS))
+
+/* what new contexts and replaygain_accum() use */
+static const struct kernels *default_kernels = KERNELS;
+
+static bool
+kernel_supported(enum replaygain_kernel id) {
+	switch (id) {
+	case REPLAYGAIN_KERNEL_SCALAR:
+		return true;
+#ifdef X86_DISPATCH
+	case REPLAYGAIN_KERNEL_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case REPLAYGAIN_KERNEL_AVX2:
+		return __builtin_cpu_supports("avx2") &&
+		    __builtin_cpu_supports("fma");
+	case REPLAYGAIN_KERNEL_AVX512:
+		return __builtin_cpu_supports("avx2") &&
+		    __builtin_cpu_supports("fma") &&
+		    __builtin_cpu_supports("avx512f");
+#endif
+	default:
+		return false;
+	}
+}
+
+static const struct kernels *
+find_kernels(enum replaygain_kernel id) {
+	size_t	i;
+
+	if (id == REPLAYGAIN_KERNEL_AUTO)
+		return default_kernels;
+	if (!kernel_supported(id))
+		return 0;
+	for (i = 0; i < NUM_KERNELS; i++)
+		if (KERNELS[i].id == id)
+			return KERNELS + i;
+	return 0;
+}
+
+#ifdef X86_DISPATCH
+/* Pick the default kernels once, before anything can use them: the best the
+ * CPU supports, unless MULTIGAIN_KERNEL names another */
+__attribute__((constructor)) static void
+init_default_kernels(void) {
+	static const char *const NAMES[] = {
+		"auto", "scalar", "sse2", "avx2", "avx512"
+	};
+	const struct kernels	*k;
+	const char		*env;
+	size_t			i;
+
+	__builtin_cpu_init();
+
+	for (i = NUM_KERNELS; i-- > 0;)
+		if (kernel_supported(KERNELS[i].id)) {
+			default_kernels = KERNELS + i;
+			break;
+		}
+
+	if (!(env = getenv("MULTIGAIN_KERNEL")))
+		return;
+	for (i = 0; i < sizeof(NAMES) / sizeof(*NAMES); i++)
+		if (!strcmp(env, NAMES[i])) {
+			if ((k = find_kernels((enum replaygain_kernel)i)))
+				default_kernels = k;
+			break;
+		}
+}
+#endif
+
+static void
+clear_peak(struct replaygain_ctx *ctx) {
+	int	p;
+
+	for (p = 0; p < MAX_PAIRS; p++) {
+		struct channel_pair	*pair = ctx->pair + p;
+
+		pair->peak[0] = pair->peak[1] = 0.0;
+		pair->clipped[0] = pair->clipped[1] = 0;
+		pair->true_peak[0] = pair->true_peak[1] = 0.0;
+	}
+	ctx->peak_channels = 0;
+}
+
+/* Substitute (z^-1 - alpha) / (1 - alpha z^-1) for z^-1 in a polynomial of
+ * z^-1 of order YULE_ORDER, multiplying through by the denominators.  The
+ * substitution is a first-order allpass, so it moves frequencies about
+ * without touching the magnitudes, and a stable filter stays stable. */
+static void
+warp_poly(const double *in, double *out, double alpha) {
+	double	term[YULE_ORDER + 1];
+	int	i;
+	int	j;
+	int	k;
+
+	for (j = 0; j <= YULE_ORDER; j++)
+		out[j] = 0.0;
+	for (k = 0; k <= YULE_ORDER; k++) {
+		/* (z^-1 - alpha)^k (1 - alpha z^-1)^(YULE_ORDER-k) */
+		term[0] = 1.0;
+		for (i = 0; i < YULE_ORDER; i++) {
+			double	c = i < k ? -alpha : 1.0;
+			double	d = i < k ? 1.0 : -alpha;
+
+			term[i + 1] = d * term[i];
+			for (j = i; j > 0; j--)
+				term[j] = c * term[j] + d * term[j - 1];
+			term[0] *= c;
+		}
+		for (j = 0; j <= YULE_ORDER; j++)
+			out[j] += in[k] * term[j];
+	}
+}
+
+/* whether all the roots of a polynomial of z^-1 lie inside the unit circle:
+ * the step-down recursion's reflection coefficients must all be below 1 */
+static bool
+poly_stable(const double *poly) {
+	double	c[YULE_ORDER + 1];
+	double	k;
+	int	i;
+	int	m;
+
+	for (i = 0; i <= YULE_ORDER; i++)
+		c[i] = poly[i];
+	for (m = YULE_ORDER; m > 0; m--) {
+		double	prev[YULE_ORDER + 1];
+
+		k = c[m] / c[0];
+		if (!(fabs(k) < 1.0))
+			return false;
+		for (i = 0; i <= m; i++)
+			prev[i] = c[i];
+		for (i = 0; i < m; i++)
+			c[i] = prev[i] - k * prev[m - i];
+	}
+	return true;
+}
+
+/* The filters for a frequency without a table entry.  The Butterworth high
+ * pass is designed directly.  The Yule filter is a fit to an
+ * equal-loudness curve; rather than fitting it again, the filter of the
+ * nearest tabled frequency above (48 kHz for anything higher) is moved to
+ * the new frequency with an allpass substitution, matching it exactly at
+ * YULE_MATCH_FREQ.  The rest of the response shifts a little: within 1 dB
+ * up to 10 kHz, more above, and the weighted power of pink noise changes by
+ * under 0.1 dB at every frequency up to MAX_SAMP_FREQ. */
+static bool
+design_filters(long freq, Float_t *yule, Float_t *butter) {
+	double	num[YULE_ORDER + 1];
+	double	den[YULE_ORDER + 1];
+	double	wnum[YULE_ORDER + 1];
+	double	wden[YULE_ORDER + 1];
+	double	theta;
+	double	omega;
+	double	alpha;
+	double	k;
+	double	a0;
+	int	ref;
+	int	i;
+
+	k = tan(M_PI * BUTTER_FREQ / freq);
+	a0 = 1.0 + M_SQRT2 * k + k * k;
+	butter[0] = 1.0 / a0;
+	butter[1] = 2.0 * (k * k - 1.0) / a0;
+	butter[2] = -2.0 / a0;
+	butter[3] = (1.0 - M_SQRT2 * k + k * k) / a0;
+	butter[4] = 1.0 / a0;
+
+	for (ref = TABLE_FREQS - 1; ref > 0; ref--)
+		if (TABLE_FREQ[ref] > freq)
+			break;
+
+	theta = 2.0 * M_PI * YULE_MATCH_FREQ / TABLE_FREQ[ref];
+	omega = 2.0 * M_PI * YULE_MATCH_FREQ / freq;
+	alpha = sin((theta - omega) / 2.0) / sin((theta + omega) / 2.0);
+
+	/* the tables interleave b[0], a[1], b[1], ...; a[0] is 1 */
+	for (i = 0; i <= YULE_ORDER; i++) {
+		num[i] = ABYule[ref][2*i];
+		den[i] = i ? ABYule[ref][2*i - 1] : 1.0;
+	}
+	warp_poly(num, wnum, alpha);
+	warp_poly(den, wden, alpha);
+	for (i = YULE_ORDER; i >= 0; i--) {
+		wnum[i] /= wden[0];
+		wden[i] /= wden[0];
+	}
+	for (i = 0; i <= YULE_ORDER; i++) {
+		yule[2*i] = wnum[i];
+		if (i)
+			yule[2*i - 1] = wden[i];
+	}
+	return poly_stable(wden);
+}
+
+/* set the decimator, the filters and the window buffers up for a sample
+ * frequency */
+/* aim each pair at its part of window_buf */
+static void
+point_window_bufs(struct replaygain_ctx *ctx) {
+	size_t	len = ctx->window_capacity + MAX_ORDER;
+	int	p;
+
+	for (p = 0; p < ctx->window_pairs; p++) {
+		struct channel_pair	*pair = ctx->pair + p;
+		Float_t			*buf = ctx->window_buf + 4 * len * p;
+
+		pair->lstepbuf = buf;
+		pair->loutbuf = buf + len;
+		pair->rstepbuf = buf + 2 * len;
+		pair->routbuf = buf + 3 * len;
+		pair->lstep = pair->lstepbuf + MAX_ORDER;
+		pair->rstep = pair->rstepbuf + MAX_ORDER;
+		pair->lout = pair->loutbuf + MAX_ORDER;
+		pair->rout = pair->routbuf + MAX_ORDER;
+	}
+}
+
+/* the samples in an RMS window at a frequency: ceil(freq * NUM/DEN) */
+static size_t
+window_samples(long freq) {
+	return (freq * RMS_WINDOW_TIME_NUM + RMS_WINDOW_TIME_DEN-1) /
+	    RMS_WINDOW_TIME_DEN;
+}
+
+/* Make room in the window buffers for windows of the given samples, for
+ * the given pairs.  The history of the pairs stays put if the windows do
+ * not grow.  A context in place has all the room it will get. */
+static enum replaygain_status
+reserve_windows(struct replaygain_ctx *ctx, size_t window, int pairs) {
+	Float_t	*buf;
+
+	if (window <= ctx->window_capacity && pairs <= ctx->window_pairs)
+		return REPLAYGAIN_OK;
+	if (ctx->in_place)
+		return REPLAYGAIN_ERR_MEM;
+	if (window < ctx->window_capacity)
+		window = ctx->window_capacity;
+	if (pairs < ctx->window_pairs)
+		pairs = ctx->window_pairs;
+	if (!(buf = realloc(ctx->window_buf,
+	    4 * (window + MAX_ORDER) * pairs * sizeof(Float_t))))
+		return REPLAYGAIN_ERR_MEM;
+	ctx->window_buf = buf;
+	ctx->window_capacity = window;
+	ctx->window_pairs = pairs;
+	point_window_bufs(ctx);
+	return REPLAYGAIN_OK;
+}
+
+/* a decimator for each of the first pairs */
+static enum replaygain_status
+reserve_decimators(struct replaygain_ctx *ctx, int pairs) {
+	int	p;
+
+	for (p = 0; p < pairs; p++)
+		if (!ctx->pair[p].decimator && (ctx->in_place ||
+		    !(ctx->pair[p].decimator =
+		    malloc(sizeof(struct decimator)))))
+			return REPLAYGAIN_ERR_MEM;
+	return REPLAYGAIN_OK;
+}
+
+/* the 2:1 stages the decimator, if on, takes a frequency down by */
+static int
+decimate_stages(long freq, int decimate_on) {
+	int	stages = 0;
+
+	if (decimate_on)
+		while (freq % 2 == 0 && freq / 2 >= DECIMATE_MIN_FREQ) {
+			freq /= 2;
+			stages++;
+		}
+	return stages;
+}
+
+static enum replaygain_status
+set_frequency(struct replaygain_ctx *ctx, long freq) {
+	Float_t	yule[2*YULE_ORDER + 1];
+	Float_t	butter[2*BUTTER_ORDER + 1];
+	size_t	window;
+	long	input_freq = freq;
+	int	stages;
+	int	i;
+
+	if (freq < MIN_SAMP_FREQ || freq > MAX_SAMP_FREQ)
+		return REPLAYGAIN_ERR_SAMPLEFREQ;
+
+	stages = decimate_stages(freq, ctx->decimate_on);
+	freq >>= stages;
+	if (stages && reserve_decimators(ctx, ctx->window_pairs) !=
+	    REPLAYGAIN_OK)
+		return REPLAYGAIN_ERR_MEM;
+
+	/* the filters are kept while the frequency stays the same */
+	if (freq != ctx->freq) {
+		for (i = 0; i < TABLE_FREQS; i++)
+			if (TABLE_FREQ[i] == freq)
+				break;
+		if (i < TABLE_FREQS) {
+			memcpy(yule, ABYule[i], sizeof(yule));
+			memcpy(butter, ABButter[i], sizeof(butter));
+		} else if (!design_filters(freq, yule, butter))
+			return REPLAYGAIN_ERR_SAMPLEFREQ;
+	}
+
+	window = window_samples(freq);
+	if (reserve_windows(ctx, window, ctx->window_pairs) != REPLAYGAIN_OK)
+		return REPLAYGAIN_ERR_MEM;
+
+	if (freq != ctx->freq) {
+		memcpy(ctx->yule, yule, sizeof(yule));
+		memcpy(ctx->butter, butter, sizeof(butter));
+		ctx->freq = freq;
+	}
+
+	ctx->input_freq = input_freq;
+	ctx->decimate_stages = stages;
+	ctx->sample_window = window;
+	point_window_bufs(ctx);
+	return REPLAYGAIN_OK;
+}
+
+/* start the decimator's stages on zeros, as the filters' histories start */
+static void
+clear_decimator(struct replaygain_ctx *ctx, struct decimator *dec,
+    const struct decimator *like) {
+	int	s;
+
+	for (s = 0; s < ctx->decimate_stages; s++) {
+		size_t	half = s + 1 == ctx->decimate_stages ? HALFBAND_LONG :
+			    HALFBAND_SHORT;
+
+		dec->avail[s] = like ? like->avail[s] : 2*half - 1;
+		memset(dec->buf[s], 0, 2 * dec->avail[s] * sizeof(Float_t));
+	}
+}
+
+/* Start a pair's filters on zeros.  The history of the step and out
+ * buffers is that just before the current position in the window, as a
+ * pair may join in partway through; its decimator, if any, is then as full
+ * as that of a running pair, like, so that both put out the same count. */
+static void
+clear_pair(struct replaygain_ctx *ctx, struct channel_pair *pair,
+    const struct decimator *like) {
+	memset(pair->linprebuf, 0, sizeof(Float_t) * MAX_ORDER);
+	memset(pair->rinprebuf, 0, sizeof(Float_t) * MAX_ORDER);
+	memset(pair->lstep + ctx->totsamp - MAX_ORDER, 0,
+	    sizeof(Float_t) * MAX_ORDER);
+	memset(pair->rstep + ctx->totsamp - MAX_ORDER, 0,
+	    sizeof(Float_t) * MAX_ORDER);
+	memset(pair->lout + ctx->totsamp - MAX_ORDER, 0,
+	    sizeof(Float_t) * MAX_ORDER);
+	memset(pair->rout + ctx->totsamp - MAX_ORDER, 0,
+	    sizeof(Float_t) * MAX_ORDER);
+	pair->lsum = pair->rsum = 0.0;
+	memset(pair->tp_hist, 0, sizeof(pair->tp_hist));
+	if (ctx->decimate_stages)
+		clear_decimator(ctx, pair->decimator, like);
+	pair->dual = true;
+}
+
+/* Make room for the filters of the given number of pairs, bringing the new
+ * ones in on zeros */
+static enum replaygain_status
+use_pairs(struct replaygain_ctx *ctx, int pairs) {
+	const struct decimator	*like;
+	int			p;
+
+	if (reserve_windows(ctx, ctx->window_capacity, pairs) !=
+	    REPLAYGAIN_OK)
+		return REPLAYGAIN_ERR_MEM;
+	if (ctx->decimate_stages && reserve_decimators(ctx, pairs) !=
+	    REPLAYGAIN_OK)
+		return REPLAYGAIN_ERR_MEM;
+	like = ctx->decimate_stages && ctx->active_pairs ?
+	    ctx->pair[0].decimator : NULL;
+	for (p = ctx->active_pairs; p < pairs; p++)
+		clear_pair(ctx, ctx->pair + p, like);
+	ctx->active_pairs = pairs;
+	return REPLAYGAIN_OK;
+}
+
+/* forget the windows analyzed so far */
+static void
+clear_value(struct replaygain_ctx *ctx) {
+	memset(&ctx->value, 0, sizeof(ctx->value));
+	memset(ctx->tree, 0, sizeof(ctx->tree));
+	ctx->windows = 0;
+	ctx->ring_pos = 0;
+}
+
+/* the tree and the count of windows for the histogram, in linear time */
+static void
+build_tree(struct replaygain_ctx *ctx) {
+	size_t	i;
+	size_t	up;
+
+	memset(ctx->tree, 0, sizeof(ctx->tree));
+	ctx->windows = 0;
+	for (i = 0; i < ANALYZE_SIZE; i++) {
+		ctx->tree[i] += ctx->value.value[i];
+		ctx->windows += ctx->value.value[i];
+		up = (i + 1) + ((i + 1) & -(i + 1));
+		if (up <= ANALYZE_SIZE)
+			ctx->tree[up - 1] += ctx->tree[i];
+	}
+}
+
+/* forget the samples analyzed so far */
+static void
+clear_state(struct replaygain_ctx *ctx) {
+	clear_value(ctx);
+	ctx->totsamp = 0;
+	ctx->active_pairs = 0;
+	use_pairs(ctx, 1);
+	clear_peak(ctx);
+}
+
+enum replaygain_status
+replaygain_reset_frequency(struct replaygain_ctx *ctx, long freq) {
+	enum replaygain_status	status;
+
+	if ((status = set_frequency(ctx, freq)) != REPLAYGAIN_OK)
+		return status;
+	clear_state(ctx);
+	return REPLAYGAIN_OK;
+}
+
+/* everything but the buffers, before the first reset */
+static void
+init_ctx(struct replaygain_ctx *ctx) {
+	int	i;
+
+	ctx->kernels = default_kernels;
+	ctx->mode = REPLAYGAIN_MODE_DOUBLE;
+	ctx->true_peak_on = 0;
+	ctx->dual_mono_on = 0;
+	ctx->window_buf = 0;
+	ctx->window_capacity = 0;
+	ctx->window_pairs = 1;
+	ctx->in_place = false;
+	ctx->ring = 0;
+	ctx->horizon = 0;
+	ctx->decimate_on = 0;
+	ctx->freq = 0;
+	ctx->channels = 2;
+	ctx->weight_set = 0;
+	/* written out whole by replaygain_checkpoint() */
+	memset(ctx->weight, 0, sizeof(ctx->weight));
+	for (i = 0; i < MAX_PAIRS; i++) {
+		ctx->pair[i].linpre = ctx->pair[i].linprebuf + MAX_ORDER;
+		ctx->pair[i].rinpre = ctx->pair[i].rinprebuf + MAX_ORDER;
+		ctx->pair[i].decimator = 0;
+	}
+}
+
+struct replaygain_ctx *
+replaygain_alloc(long freq, enum replaygain_status *out_status) {
+	struct replaygain_ctx	*ctx;
+	enum replaygain_status	status;
+
+	if (!(ctx = malloc(sizeof(struct replaygain_ctx)))) {
+		if (out_status) *out_status = REPLAYGAIN_ERR_MEM;
+		return 0;
+	}
+	init_ctx(ctx);
+
+	status = replaygain_reset_frequency(ctx, freq);
+	if (status != REPLAYGAIN_OK) {
+		replaygain_free(ctx);
+		if (out_status) *out_status = status;
+		return 0;
+	}
+
+	if (out_status) *out_status = REPLAYGAIN_OK;
+	return ctx;
+}
+
+/* whether a context for frequencies up to freq might decimate */
+static bool
+may_decimate(long freq) {
+	return freq / 2 >= DECIMATE_MIN_FREQ;
+}
+
+size_t
+replaygain_ctx_size(long freq, int channels) {
+	size_t	pairs = (channels + 1) / 2;
+	size_t	size;
+
+	if (freq < MIN_SAMP_FREQ || freq > MAX_SAMP_FREQ ||
+	    channels < 1 || channels > (int)REPLAYGAIN_MAX_CHANNELS)
+		return 0;
+	/* the structures are all of doubles and pointers, so each of the
+	 * parts lines up after the one before */
+	size = sizeof(struct replaygain_ctx) +
+	    4 * (window_samples(freq) + MAX_ORDER) * pairs * sizeof(Float_t);
+	if (may_decimate(freq))
+		size += pairs * sizeof(struct decimator);
+	return size;
+}
+
+struct replaygain_ctx *
+replaygain_init_in_place(void *mem, long freq, int channels,
+    enum replaygain_status *out_status) {
+	struct replaygain_ctx	*ctx = mem;
+	char			*next = (char *)(ctx + 1);
+	enum replaygain_status	status;
+	int			pairs = (channels + 1) / 2;
+	int			p;
+
+	if (!replaygain_ctx_size(freq, channels)) {
+		if (out_status) *out_status = freq < MIN_SAMP_FREQ ||
+		    freq > MAX_SAMP_FREQ ? REPLAYGAIN_ERR_SAMPLEFREQ :
+		    REPLAYGAIN_ERROR;
+		return 0;
+	}
+	init_ctx(ctx);
+	ctx->in_place = true;
+	if (may_decimate(freq))
+		for (p = 0; p < pairs; p++) {
+			ctx->pair[p].decimator = (struct decimator *)next;
+			next += sizeof(struct decimator);
+		}
+	ctx->window_buf = (Float_t *)next;
+	ctx->window_capacity = window_samples(freq);
+	ctx->window_pairs = pairs;
+
+	status = replaygain_reset_frequency(ctx, freq);
+	if (out_status) *out_status = status;
+	return status == REPLAYGAIN_OK ? ctx : 0;
+}
+
+void
+replaygain_free(struct replaygain_ctx *ctx) {
+	int	i;
+
+	if (ctx && !ctx->in_place) {
+		free(ctx->window_buf);
+		free(ctx->ring);
+		for (i = 0; i < MAX_PAIRS; i++)
+			free(ctx->pair[i].decimator);
+		free(ctx);
+	}
+}
+
+struct replaygain_ctx *
+replaygain_clone(const struct replaygain_ctx *ctx,
+    enum replaygain_status *out_status) {
+	struct replaygain_ctx	*copy;
+	size_t			len;
+	int			i;
+
+	if (!(copy = malloc(sizeof(struct replaygain_ctx)))) {
+		if (out_status) *out_status = REPLAYGAIN_ERR_MEM;
+		return 0;
+	}
+	memcpy(copy, ctx, sizeof(*copy));
+	copy->in_place = false;
+	copy->window_buf = 0;
+	copy->ring = 0;
+	for (i = 0; i < MAX_PAIRS; i++) {
+		copy->pair[i].linpre = copy->pair[i].linprebuf + MAX_ORDER;
+		copy->pair[i].rinpre = copy->pair[i].rinprebuf + MAX_ORDER;
+		copy->pair[i].decimator = 0;
+	}
+
+	len = 4 * (ctx->window_capacity + MAX_ORDER) * ctx->window_pairs *
+	    sizeof(Float_t);
+	if (!(copy->window_buf = malloc(len)))
+		goto nomem;
+	memcpy(copy->window_buf, ctx->window_buf, len);
+	point_window_bufs(copy);
+	for (i = 0; i < MAX_PAIRS; i++)
+		if (ctx->pair[i].decimator) {
+			if (!(copy->pair[i].decimator =
+			    malloc(sizeof(struct decimator))))
+				goto nomem;
+			memcpy(copy->pair[i].decimator, ctx->pair[i].decimator,
+			    sizeof(struct decimator));
+		}
+	if (ctx->horizon) {
+		if (!(copy->ring = malloc(ctx->horizon * sizeof(*ctx->ring))))
+			goto nomem;
+		memcpy(copy->ring, ctx->ring,
+		    ctx->horizon * sizeof(*ctx->ring));
+	}
+
+	if (out_status) *out_status = REPLAYGAIN_OK;
+	return copy;
+
+nomem:
+	replaygain_free(copy);
+	if (out_status) *out_status = REPLAYGAIN_ERR_MEM;
+	return 0;
+}
+
+void
+replaygain_reset(struct replaygain_ctx *ctx) {
+	clear_state(ctx);
+}
+
+/* begin a new RMS window, keeping the filter history */
+static void
+start_window(struct replaygain_ctx *ctx) {
+	int	p;
+
+	for (p = 0; p < ctx->active_pairs; p++) {
+		struct channel_pair	*pair = ctx->pair + p;
+
+		pair->lsum = pair->rsum = 0.0;
+		memmove(pair->loutbuf, pair->loutbuf + ctx->totsamp,
+		    MAX_ORDER * sizeof(Float_t));
+		memmove(pair->routbuf, pair->routbuf + ctx->totsamp,
+		    MAX_ORDER * sizeof(Float_t));
+		memmove(pair->lstepbuf, pair->lstepbuf + ctx->totsamp,
+		    MAX_ORDER * sizeof(Float_t));
+		memmove(pair->rstepbuf, pair->rstepbuf + ctx->totsamp,
+		    MAX_ORDER * sizeof(Float_t));
+	}
+	ctx->totsamp = 0;
+}
+
+/* The weight of a channel's mean square unless set otherwise: as for
+ * r128_alloc(), the LFE channel of 5.1 and 7.1 is left out, and surround
+ * channels to the side count for more */
+static double
+default_weight(int channels, int channel) {
+	switch (channels) {
+	case 5:
+		/* L R C Ls Rs */
+		return channel >= 3 ? 1.41 : 1.0;
+	case 6:
+		/* L R C LFE Ls Rs */
+		return channel == 3 ? 0.0 : channel >= 4 ? 1.41 : 1.0;
+	case 8:
+		/* L R C LFE Lb Rb Ls Rs */
+		return channel == 3 ? 0.0 : channel >= 6 ? 1.41 : 1.0;
+	default:
+		return 1.0;
+	}
+}
+
+static double
+channel_weight(const struct replaygain_ctx *ctx, int channel) {
+	if (ctx->weight_set & 1u << channel)
+		return ctx->weight[channel];
+	return default_weight(ctx->channels, channel);
+}
+
+/* Add a window to a bin of the histogram, or with a delta of -1 take one
+ * away */
+static void
+count_window(struct replaygain_ctx *ctx, size_t bin, int delta) {
+	ctx->value.value[bin] += delta;
+	for (bin++; bin <= ANALYZE_SIZE; bin += bin & -bin)
+		ctx->tree[bin - 1] += delta;
+	ctx->windows += delta;
+}
+
+/* The level of the window just filled.  The channels' mean squares are
+ * weighted and summed, and halved, so that a stereo pair measures as it
+ * always has; a mono channel counts twice, as if on both speakers. */
+static void
+end_window(struct replaygain_ctx *ctx) {
+	double	sum;
+	double	val;
+	size_t	ival;
+	int	c;
+
+	if (ctx->channels == 1)
+		sum = channel_weight(ctx, 0) *
+		    (ctx->pair[0].lsum + ctx->pair[0].rsum);
+	else {
+		sum = 0.0;
+		for (c = 0; c < ctx->channels; c++)
+			sum += channel_weight(ctx, c) * (c % 2 ?
+			    ctx->pair[c / 2].rsum : ctx->pair[c / 2].lsum);
+	}
+	val = STEPS_PER_DB * 10 * log10(sum / (ctx->totsamp * 2) + 1.0e-37);
+
+	ival = val < 0.0 ? 0 : val;
+	if (ival >= ANALYZE_SIZE)
+		ival = ANALYZE_SIZE - 1;
+
+	if (ctx->horizon) {
+		if (ctx->windows == ctx->horizon)
+			count_window(ctx, ctx->ring[ctx->ring_pos], -1);
+		ctx->ring[ctx->ring_pos] = ival;
+		if (++ctx->ring_pos == ctx->horizon)
+			ctx->ring_pos = 0;
+	}
+	count_window(ctx, ival, 1);
+	start_window(ctx);
+}
+
+/* Each pair's left and right input; the last channel of an odd number is
+ * also the right of the last pair.  Returns the number of pairs. */
+static int
+pair_inputs(const Float_t *const *samples, int channels,
+    const Float_t **in) {
+	int	c;
+
+	for (c = 0; c < channels; c++)
+		in[c] = samples[c];
+	if (channels % 2)
+		in[channels] = samples[channels - 1];
+	return (channels + 1) / 2;
+}
+
+/* Whether the two channels of a pair have the same input: the same
+ * array, or, if asked to look, the same samples */
+static bool
+same_input(const struct replaygain_ctx *ctx, const Float_t *l,
+    const Float_t *r, size_t num_samples) {
+	return l == r || (ctx->dual_mono_on &&
+	    !memcmp(l, r, num_samples * sizeof(Float_t)));
+}
+
+/* One track of a batch analyzed together: its context and each pair's
+ * left and right input */
+struct track {
+	struct replaygain_ctx	*ctx;
+	const Float_t		*in[2 * MAX_PAIRS];
+	size_t			num_samples;
+	int			pairs;
+};
+
+/* the most tracks analyze_tracks() takes at once */
+#define BATCH_TRACKS		16
+
+/* A pair of a track, with its input for the next samples */
+struct lane {
+	struct replaygain_ctx	*ctx;
+	struct channel_pair	*pair;
+	const Float_t		*in[2];
+};
+
+/* Set up a track of planar samples of a context */
+static enum replaygain_status
+init_track(struct track *t, struct replaygain_ctx *ctx,
+    const Float_t *const *samples, size_t num_samples, int channels) {
+	enum replaygain_status	status;
+
+	t->ctx = ctx;
+	t->num_samples = num_samples;
+	t->pairs = pair_inputs(samples, channels, t->in);
+	if ((status = use_pairs(ctx, t->pairs)) != REPLAYGAIN_OK)
+		return status;
+	ctx->channels = channels;
+	return REPLAYGAIN_OK;
+}
+
+/* Whether samples are all zero (or minus zero), compared in blocks that
+ * the compiler makes SIMD */
+static bool
+all_zero(const Float_t *in, size_t num_samples) {
+	size_t	i = 0;
+	size_t	j;
+	int	nonzero;
+
+	for (; i + 16 <= num_samples; i += 16) {
+		nonzero = 0;
+		for (j = 0; j < 16; j++)
+			nonzero |= in[i + j] != 0.0;
+		if (nonzero)
+			return false;
+	}
+	for (; i < num_samples; i++)
+		if (in[i] != 0.0)
+			return false;
+	return true;
+}
+
+/* Whether a lane's next samples, and the YULE_ORDER before them, are all
+ * zero.  Silence is worth a look only in a long enough run. */
+static bool
+silent(const struct lane *lane, size_t num_samples) {
+	return num_samples >= SILENT_MIN &&
+	    all_zero(lane->in[0] - YULE_ORDER, num_samples + YULE_ORDER) &&
+	    (lane->in[1] == lane->in[0] ||
+	    all_zero(lane->in[1] - YULE_ORDER, num_samples + YULE_ORDER));
+}
+
+/* Filter the pairs of the next samples of the tracks, the same number for
+ * each, two pairs to a quad where the kernels have one.  In double
+ * precision, a pair whose input, with the history the filters read, is
+ * digital silence takes the shorter chain of filter_silent(). */
+static void
+filter_lanes(const struct kernels *k, struct lane *lane, int lanes,
+    size_t cursamples) {
+	struct replaygain_ctx	*ctx = lane[0].ctx;
+	int			busy = 0;
+	int			i;
+
+	for (i = 0; i < lanes; i++)
+		if (!lane[i].ctx->true_peak_on)
+			continue;
+		else if (lane[i].pair->dual)
+			k->true_peak_dual(lane[i].pair, lane[i].in[0],
+			    cursamples);
+		else
+			k->true_peak(lane[i].pair, lane[i].in[0],
+			    lane[i].in[1], cursamples);
+
+	if (ctx->mode == REPLAYGAIN_MODE_FLOAT &&
+	    ctx->freq <= MAX_FLOAT_FREQ) {
+		for (i = 0; i < lanes; i++)
+			if (lane[i].pair->dual)
+				k->filter_float_dual(lane[i].ctx,
+				    lane[i].pair, lane[i].in[0], cursamples);
+			else
+				k->filter_float(lane[i].ctx, lane[i].pair,
+				    lane[i].in[0], lane[i].in[1], cursamples);
+	} else {
+		/* the lanes not silent go to the front */
+		for (i = 0; i < lanes; i++)
+			if (silent(lane + i, cursamples))
+				k->filter_silent(lane[i].ctx, lane[i].pair,
+				    cursamples);
+			else
+				lane[busy++] = lane[i];
+		lanes = busy;
+		i = 0;
+
+		if (k->filter_quad)
+			for (; i + 1 < lanes; i += 2) {
+				struct replaygain_ctx	*ctxs[2] = {
+					lane[i].ctx, lane[i + 1].ctx
+				};
+				struct channel_pair	*pairs[2] = {
+					lane[i].pair, lane[i + 1].pair
+				};
+				const Float_t		*in[4] = {
+					lane[i].in[0], lane[i].in[1],
+					lane[i + 1].in[0], lane[i + 1].in[1]
+				};
+
+				k->filter_quad(ctxs, pairs, in, cursamples);
+			}
+		for (; i < lanes; i++)
+			if (lane[i].pair->dual)
+				k->filter_dual(lane[i].ctx, lane[i].pair,
+				    lane[i].in[0], cursamples);
+			else
+				k->filter(lane[i].ctx, lane[i].pair,
+				    lane[i].in[0], lane[i].in[1], cursamples);
+	}
+}
+
+/* Keep the last MAX_ORDER samples of a track's input, which the first of
+ * the next read */
+static void
+keep_history(struct track *t) {
+	size_t	n = t->num_samples;
+	int	p;
+
+	for (p = 0; p < t->pairs; p++) {
+		struct channel_pair	*pair = t->ctx->pair + p;
+
+		if (n < MAX_ORDER) {
+			memmove(pair->linprebuf, pair->linprebuf + n,
+			    (MAX_ORDER - n) * sizeof(Float_t));
+			memmove(pair->rinprebuf, pair->rinprebuf + n,
+			    (MAX_ORDER - n) * sizeof(Float_t));
+			memcpy(pair->linprebuf + MAX_ORDER - n, t->in[2*p],
+			    n * sizeof(Float_t));
+			memcpy(pair->rinprebuf + MAX_ORDER - n,
+			    t->in[2*p + 1], n * sizeof(Float_t));
+		} else {
+			memcpy(pair->linprebuf, t->in[2*p] + n - MAX_ORDER,
+			    MAX_ORDER * sizeof(Float_t));
+			memcpy(pair->rinprebuf,
+			    t->in[2*p + 1] + n - MAX_ORDER,
+			    MAX_ORDER * sizeof(Float_t));
+		}
+	}
+}
+
+/* The analysis of samples at the frequency of the filters, for up to
+ * BATCH_TRACKS tracks in step: the tracks' contexts share a frequency, a
+ * mode and kernels (see batch_with()).  Each step is as long
+ * as the shortest of what is left of a track's samples and of its window,
+ * so tracks that began together stay in step to the end of the shortest. */
+static enum replaygain_status
+analyze_tracks(struct track *track, int count) {
+	const struct kernels	*k = track[0].ctx->kernels;
+	struct lane		lane[BATCH_TRACKS * MAX_PAIRS];
+	size_t			cursamplepos = 0;
+	size_t			cursamples;
+	size_t			copy_samples;
+	int			lanes;
+	int			p;
+	int			t;
+
+	for (t = 0; t < count; t++) {
+		struct track	*tr = track + t;
+
+		copy_samples = tr->num_samples;
+		if (MAX_ORDER < copy_samples) copy_samples = MAX_ORDER;
+		for (p = 0; p < tr->pairs; p++) {
+			struct channel_pair	*pair = tr->ctx->pair + p;
+
+			pair->dual = pair->dual && same_input(tr->ctx,
+			    tr->in[2*p], tr->in[2*p + 1], tr->num_samples);
+			memcpy(pair->linprebuf + MAX_ORDER, tr->in[2*p],
+			    copy_samples * sizeof(Float_t));
+			memcpy(pair->rinprebuf + MAX_ORDER, tr->in[2*p + 1],
+			    copy_samples * sizeof(Float_t));
+		}
+	}
+
+	for (;;) {
+		cursamples = 0;
+		lanes = 0;
+		for (t = 0; t < count; t++) {
+			struct replaygain_ctx	*ctx = track[t].ctx;
+			size_t			n;
+
+			if (cursamplepos >= track[t].num_samples)
+				continue;
+			n = track[t].num_samples - cursamplepos;
+			if (n > (size_t)(ctx->sample_window - ctx->totsamp))
+				n = ctx->sample_window - ctx->totsamp;
+			if (!cursamples || n < cursamples)
+				cursamples = n;
+
+			for (p = 0; p < track[t].pairs; p++) {
+				struct channel_pair	*pair = ctx->pair + p;
+
+				lane[lanes].ctx = ctx;
+				lane[lanes].pair = pair;
+				if (cursamplepos < MAX_ORDER) {
+					lane[lanes].in[0] = pair->linpre +
+					    cursamplepos;
+					lane[lanes].in[1] = pair->rinpre +
+					    cursamplepos;
+				} else {
+					lane[lanes].in[0] = track[t].in[2*p] +
+					    cursamplepos;
+					lane[lanes].in[1] =
+					    track[t].in[2*p + 1] +
+					    cursamplepos;
+				}
+				lanes++;
+			}
+		}
+		if (!lanes)
+			break;
+		if (cursamplepos < MAX_ORDER &&
+		    cursamples > MAX_ORDER - cursamplepos)
+			cursamples = MAX_ORDER - cursamplepos;
+
+		filter_lanes(k, lane, lanes, cursamples);
+
+		for (t = 0; t < count; t++) {
+			struct replaygain_ctx	*ctx = track[t].ctx;
+
+			if (cursamplepos >= track[t].num_samples)
+				continue;
+			ctx->totsamp += cursamples;
+
+			/* get the RMS for this set of samples */
+			if (ctx->totsamp == ctx->sample_window)
+				end_window(ctx);
+			/* XXX somehow I really screwed up: Error in
+			 * programming!  Contact author about totsamp >
+			 * sample_window
+			 *
+			 * Markus: I'm not sure who wrote above note or what
+			 * it means; maybe it's an assertion */
+			if (ctx->totsamp > ctx->sample_window)
+				return REPLAYGAIN_ERROR;
+		}
+		cursamplepos += cursamples;
+	}
+
+	for (t = 0; t < count; t++)
+		if (track[t].num_samples)
+			keep_history(track + t);
+	return REPLAYGAIN_OK;
+}
+
+/* the analysis of samples at the frequency of the filters */
+static enum replaygain_status
+analyze_direct(struct replaygain_ctx *ctx, const Float_t *const *samples,
+    size_t num_samples, int channels) {
+	struct track		track;
+	enum replaygain_status	status;
+
+	if (!num_samples)
+		return REPLAYGAIN_OK;
+	status = init_track(&track, ctx, samples, num_samples, channels);
+	if (status != REPLAYGAIN_OK)
+		return status;
+	return analyze_tracks(&track, 1);
+}
+
+/* Run the samples through the decimator and analyze what comes out.  The
+ * filters' peak tracking sees only the decimated signal, so the peaks are
+ * taken from the input here instead. */
+static enum replaygain_status
+analyze_decimated(struct replaygain_ctx *ctx, const Float_t *const *samples,
+    size_t num_samples, int channels) {
+	const Float_t		*in[2 * MAX_PAIRS];
+	const Float_t		*outs[2 * MAX_PAIRS];
+	Float_t			out[DECIMATE_SAMPLES];
+	Float_t			dec_out[2 * MAX_PAIRS][DECIMATE_SAMPLES / 2];
+	Float_t			peak[MAX_PAIRS][2];
+	uint64_t		clipped[MAX_PAIRS][2];
+	enum replaygain_status	status;
+	size_t			n;
+	size_t			m = 0;
+	size_t			i;
+	int			last = ctx->decimate_stages - 1;
+	int			pairs;
+	int			p;
+	int			s;
+
+	pairs = pair_inputs(samples, channels, in);
+	if ((status = use_pairs(ctx, pairs)) != REPLAYGAIN_OK)
+		return status;
+	/* the decimator of a dual pair puts out the same in both channels,
+	 * which analyze_direct() then sees as one array */
+	for (p = 0; p < 2 * pairs; p++)
+		outs[p] = p % 2 && ctx->pair[p / 2].dual && in[p] == in[p - 1] ?
+		    dec_out[p - 1] : dec_out[p];
+
+	while (num_samples) {
+		n = num_samples < STAGE_SAMPLES ? num_samples : STAGE_SAMPLES;
+		for (p = 0; p < pairs; p++) {
+			struct decimator	*dec = ctx->pair[p].decimator;
+			Float_t			*buf;
+
+			buf = dec->buf[0] + 2 * dec->avail[0];
+			for (i = 0; i < n; i++) {
+				buf[2*i] = in[2*p][i];
+				buf[2*i + 1] = in[2*p + 1][i];
+			}
+			dec->avail[0] += n;
+
+			for (s = 0; s < last; s++)
+				dec->avail[s + 1] += ctx->kernels->halfband(
+				    dec->buf[s], &dec->avail[s],
+				    dec->buf[s + 1] + 2 * dec->avail[s + 1],
+				    HALFBAND_SHORT_TAPS, HALFBAND_SHORT);
+			i = ctx->kernels->halfband(dec->buf[last],
+			    &dec->avail[last], out, HALFBAND_LONG_TAPS,
+			    HALFBAND_LONG);
+			/* the pairs' decimators are kept in step */
+			assert(!p || i == m);
+			m = i;
+			for (i = 0; i < m; i++) {
+				dec_out[2*p][i] = out[2*i];
+				dec_out[2*p + 1][i] = out[2*i + 1];
+			}
+
+			memcpy(peak[p], ctx->pair[p].peak, sizeof(peak[p]));
+			memcpy(clipped[p], ctx->pair[p].clipped,
+			    sizeof(clipped[p]));
+		}
+
+		status = analyze_direct(ctx, outs, m, channels);
+		for (p = 0; p < pairs; p++) {
+			struct channel_pair	*pair = ctx->pair + p;
+
+			memcpy(pair->peak, peak[p], sizeof(peak[p]));
+			memcpy(pair->clipped, clipped[p], sizeof(clipped[p]));
+			track_peak(in[2*p], n, &pair->peak[0],
+			    &pair->clipped[0]);
+			track_peak(in[2*p + 1], n, &pair->peak[1],
+			    &pair->clipped[1]);
+		}
+		if (status != REPLAYGAIN_OK)
+			return status;
+
+		for (p = 0; p < 2 * pairs; p++)
+			in[p] += n;
+		num_samples -= n;
+	}
+	return REPLAYGAIN_OK;
+}
+
+/* the analysis of planar samples of any number of channels */
+static enum replaygain_status
+analyze(struct replaygain_ctx *ctx, const Float_t *const *samples,
+    size_t num_samples, int channels) {
+	enum replaygain_status	status;
+
+	if (channels < 1 || channels > (int)REPLAYGAIN_MAX_CHANNELS)
+		return REPLAYGAIN_ERROR;
+	if (ctx->decimate_stages)
+		status = analyze_decimated(ctx, samples, num_samples,
+		    channels);
+	else
+		status = analyze_direct(ctx, samples, num_samples, channels);
+	if (channels > ctx->peak_channels)
+		ctx->peak_channels = channels;
+	return status;
+}
+
+enum replaygain_status
+replaygain_analyze(struct replaygain_ctx *ctx, const Float_t *lsamples,
+    const Float_t *rsamples, size_t num_samples, int channels) {
+	const Float_t	*samples[2] = { lsamples, rsamples };
+
+	if (channels > 2)
+		return REPLAYGAIN_ERROR;
+	return analyze(ctx, samples, num_samples, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_planar(struct replaygain_ctx *ctx,
+    const double *const *samples, size_t num_samples, int channels) {
+	return analyze(ctx, samples, num_samples, channels);
+}
+
+/* Whether a context can be filtered in step with another: the same filters,
+ * the same kernels, and no decimator in front */
+static bool
+batch_with(const struct replaygain_ctx *ctx,
+    const struct replaygain_ctx *other) {
+	return !ctx->decimate_stages && !other->decimate_stages &&
+	    ctx->freq == other->freq && ctx->mode == other->mode &&
+	    ctx->kernels == other->kernels;
+}
+
+enum replaygain_status
+replaygain_analyze_batch(struct replaygain_ctx *const *ctxs,
+    const double *const *const *samples, const size_t *num_samples,
+    size_t num_tracks, int channels) {
+	struct track		track[BATCH_TRACKS];
+	struct replaygain_ctx	*first;
+	enum replaygain_status	status;
+	size_t			i = 0;
+	int			count;
+
+	if (channels < 1 || channels > (int)REPLAYGAIN_MAX_CHANNELS)
+		return REPLAYGAIN_ERROR;
+	while (i < num_tracks) {
+		if (!num_samples[i] || ctxs[i]->decimate_stages) {
+			status = analyze(ctxs[i], samples[i], num_samples[i],
+			    channels);
+			if (status != REPLAYGAIN_OK)
+				return status;
+			i++;
+			continue;
+		}
+
+		/* this track, and those that follow and go along with it */
+		first = ctxs[i];
+		count = 0;
+		for (; i < num_tracks && count < BATCH_TRACKS; i++) {
+			if (!num_samples[i] || !batch_with(first, ctxs[i]))
+				break;
+			status = init_track(track + count, ctxs[i],
+			    samples[i], num_samples[i], channels);
+			if (status != REPLAYGAIN_OK)
+				return status;
+			if (channels > ctxs[i]->peak_channels)
+				ctxs[i]->peak_channels = channels;
+			count++;
+		}
+		if ((status = analyze_tracks(track, count)) != REPLAYGAIN_OK)
+			return status;
+	}
+	return REPLAYGAIN_OK;
+}
+
+/* Conversion of one sample type to Float_t */
+struct converter {
+	size_t	size;
+	/* one channel, or each channel of interleaved frames; step is the
+	 * distance between samples of the channel */
+	void	(*convert)(Float_t *, const void *, size_t, int);
+};
+
+static void
+convert_s16(Float_t *out, const void *in, size_t n, int step) {
+	const int16_t	*samples = in;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		out[i] = samples[i * step];
+}
+
+static void
+convert_s32(Float_t *out, const void *in, size_t n, int step) {
+	const int32_t	*samples = in;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		out[i] = samples[i * step] * (1.0 / 65536);
+}
+
+static void
+convert_f32(Float_t *out, const void *in, size_t n, int step) {
+	const float	*samples = in;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		out[i] = samples[i * step] * 32768.0;
+}
+
+static void
+convert_f64(Float_t *out, const void *in, size_t n, int step) {
+	const double	*samples = in;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		out[i] = samples[i * step];
+}
+
+static const struct converter CONVERT_S16 = {
+	sizeof(int16_t), convert_s16
+};
+static const struct converter CONVERT_S32 = {
+	sizeof(int32_t), convert_s32
+};
+static const struct converter CONVERT_F32 = {
+	sizeof(float), convert_f32
+};
+static const struct converter CONVERT_F64 = {
+	sizeof(double), convert_f64
+};
+
+/* The analysis of samples of another type, converted a cache-sized block
+ * at a time.  With interleaved, samples[0] is the frames; otherwise it
+ * holds a pointer per channel. */
+static enum replaygain_status
+analyze_converted(struct replaygain_ctx *ctx, const struct converter *conv,
+    const void *const *samples, bool interleaved, size_t num_samples,
+    int channels) {
+	Float_t			stage[2 * STAGE_SAMPLES];
+	const Float_t		*planes[REPLAYGAIN_MAX_CHANNELS];
+	const char		*pos[REPLAYGAIN_MAX_CHANNELS];
+	enum replaygain_status	status;
+	size_t			block;
+	size_t			n;
+	int			c;
+
+	if (channels < 1 || channels > (int)REPLAYGAIN_MAX_CHANNELS)
+		return REPLAYGAIN_ERROR;
+
+	/* the same room however many channels; a channel that repeats the
+	 * one before it, as a mono right does, is converted once */
+	block = channels > 2 ? 2 * STAGE_SAMPLES / channels : STAGE_SAMPLES;
+	for (c = 0; c < channels; c++) {
+		pos[c] = interleaved ? (const char *)samples[0] +
+		    c * conv->size : samples[c];
+		planes[c] = c && pos[c] == pos[c - 1] ? planes[c - 1] :
+		    stage + c * block;
+	}
+
+	while (num_samples) {
+		n = num_samples < block ? num_samples : block;
+		for (c = 0; c < channels; c++) {
+			if (planes[c] == stage + c * block)
+				conv->convert(stage + c * block, pos[c], n,
+				    interleaved ? channels : 1);
+			pos[c] += n * conv->size * (interleaved ? channels : 1);
+		}
+		status = analyze(ctx, planes, n, channels);
+		if (status != REPLAYGAIN_OK)
+			return status;
+		num_samples -= n;
+	}
+	return REPLAYGAIN_OK;
+}
+
+/* the stereo entry points, as planar */
+static enum replaygain_status
+analyze_converted_lr(struct replaygain_ctx *ctx,
+    const struct converter *conv, const void *lsamples, const void *rsamples,
+    size_t num_samples, int channels) {
+	const void	*samples[2] = { lsamples, rsamples ? rsamples : lsamples };
+
+	if (channels > 2)
+		return REPLAYGAIN_ERROR;
+	return analyze_converted(ctx, conv, samples, false, num_samples,
+	    channels);
+}
+
+enum replaygain_status
+replaygain_analyze_s16(struct replaygain_ctx *ctx, const int16_t *lsamples,
+    const int16_t *rsamples, size_t num_samples, int channels) {
+	return analyze_converted_lr(ctx, &CONVERT_S16, lsamples, rsamples,
+	    num_samples, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_s32(struct replaygain_ctx *ctx, const int32_t *lsamples,
+    const int32_t *rsamples, size_t num_samples, int channels) {
+	return analyze_converted_lr(ctx, &CONVERT_S32, lsamples, rsamples,
+	    num_samples, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_f32(struct replaygain_ctx *ctx, const float *lsamples,
+    const float *rsamples, size_t num_samples, int channels) {
+	return analyze_converted_lr(ctx, &CONVERT_F32, lsamples, rsamples,
+	    num_samples, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_planar_s16(struct replaygain_ctx *ctx,
+    const int16_t *const *samples, size_t num_samples, int channels) {
+	return analyze_converted(ctx, &CONVERT_S16,
+	    (const void *const *)samples, false, num_samples, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_planar_s32(struct replaygain_ctx *ctx,
+    const int32_t *const *samples, size_t num_samples, int channels) {
+	return analyze_converted(ctx, &CONVERT_S32,
+	    (const void *const *)samples, false, num_samples, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_planar_f32(struct replaygain_ctx *ctx,
+    const float *const *samples, size_t num_samples, int channels) {
+	return analyze_converted(ctx, &CONVERT_F32,
+	    (const void *const *)samples, false, num_samples, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_interleaved(struct replaygain_ctx *ctx,
+    const double *frames, size_t num_frames, int channels) {
+	const void	*samples = frames;
+
+	/* a mono frame is already a sample */
+	if (channels == 1)
+		return analyze(ctx, &frames, num_frames, channels);
+	return analyze_converted(ctx, &CONVERT_F64, &samples, true,
+	    num_frames, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_interleaved_s16(struct replaygain_ctx *ctx,
+    const int16_t *frames, size_t num_frames, int channels) {
+	const void	*samples = frames;
+
+	return analyze_converted(ctx, &CONVERT_S16, &samples, true,
+	    num_frames, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_interleaved_s32(struct replaygain_ctx *ctx,
+    const int32_t *frames, size_t num_frames, int channels) {
+	const void	*samples = frames;
+
+	return analyze_converted(ctx, &CONVERT_S32, &samples, true,
+	    num_frames, channels);
+}
+
+enum replaygain_status
+replaygain_analyze_interleaved_f32(struct replaygain_ctx *ctx,
+    const float *frames, size_t num_frames, int channels) {
+	const void	*samples = frames;
+
+	return analyze_converted(ctx, &CONVERT_F32, &samples, true,
+	    num_frames, channels);
+}
+
+enum replaygain_status
+replaygain_set_weight(struct replaygain_ctx *ctx, int channel,
+    double weight) {
+	if (channel < 0 || channel >= (int)REPLAYGAIN_MAX_CHANNELS)
+		return REPLAYGAIN_ERROR;
+	ctx->weight[channel] = weight;
+	ctx->weight_set |= 1u << channel;
+	return REPLAYGAIN_OK;
+}
+
+enum replaygain_status
+replaygain_set_kernel(struct replaygain_ctx *ctx, enum replaygain_kernel id) {
+	const struct kernels	*k;
+
+	if (!(k = find_kernels(id)))
+		return REPLAYGAIN_ERROR;
+	ctx->kernels = k;
+	return REPLAYGAIN_OK;
+}
+
+enum replaygain_kernel
+replaygain_get_kernel(const struct replaygain_ctx *ctx) {
+	return ctx->kernels->id;
+}
+
+enum replaygain_status
+replaygain_set_mode(struct replaygain_ctx *ctx, enum replaygain_mode mode) {
+	switch (mode) {
+	case REPLAYGAIN_MODE_DOUBLE:
+	case REPLAYGAIN_MODE_FLOAT:
+		ctx->mode = mode;
+		return REPLAYGAIN_OK;
+	default:
+		return REPLAYGAIN_ERROR;
+	}
+}
+
+enum replaygain_mode
+replaygain_get_mode(const struct replaygain_ctx *ctx) {
+	return ctx->mode;
+}
+
+void
+replaygain_accum(struct replaygain_value *sum,
+    const struct replaygain_value *addition) {
+	default_kernels->accum(sum->value, addition->value);
+}
+
+Float_t
+replaygain_adjustment(const struct replaygain_value *out) {
+	uint32_t	elems;
+	int32_t		upper;
+	size_t		i;
+
+	elems = 0;
+	for (i = 0; i < ANALYZE_SIZE; i++)
+		elems += out->value[i];
+	if (!elems)
+		return GAIN_NOT_ENOUGH_SAMPLES;
+
+	upper = ceil(elems * (1 - RMS_PERCENTILE));
+	for (i = ANALYZE_SIZE; i-- > 0;) {
+		if ((upper -= out->value[i]) <= 0)
+			break;
+	}
+	assert(i < ANALYZE_SIZE);
+
+	return PINK_REF - (Float_t)i / STEPS_PER_DB;
+}
+
+/* The same as replaygain_adjustment() of the context's value: the bin i
+ * found from the top is the first that brings the windows at and above it
+ * to upper, so the windows below it are the most that stay within
+ * windows - upper.  Descending the tree finds that many bins. */
+double
+replaygain_running_adjustment(const struct replaygain_ctx *ctx) {
+	uint32_t	below;
+	size_t		pos = 0;
+	size_t		step;
+
+	if (!ctx->windows)
+		return GAIN_NOT_ENOUGH_SAMPLES;
+
+	below = ctx->windows -
+	    (uint32_t)ceil(ctx->windows * (1 - RMS_PERCENTILE));
+	for (step = TREE_TOP; step; step >>= 1)
+		if (pos + step <= ANALYZE_SIZE &&
+		    ctx->tree[pos + step - 1] <= below) {
+			pos += step;
+			below -= ctx->tree[pos - 1];
+		}
+
+	return PINK_REF - (Float_t)pos / STEPS_PER_DB;
+}
+
+void
+replaygain_discard(struct replaygain_ctx *ctx) {
+	clear_value(ctx);
+	clear_peak(ctx);
+	start_window(ctx);
+}
+
+void
+replaygain_get_peak(const struct replaygain_ctx *ctx,
+    struct replaygain_peak *out) {
+	/* the right of an odd last pair repeats its left, except in mono */
+	int	channels = ctx->peak_channels > 2 ? ctx->peak_channels : 2;
+	int	c;
+
+	memset(out, 0, sizeof(*out));
+	for (c = 0; c < channels; c++) {
+		const struct channel_pair	*pair = ctx->pair + c / 2;
+
+		out->peak[c] = pair->peak[c % 2];
+		out->clipped[c] = pair->clipped[c % 2];
+		out->true_peak[c] = pair->true_peak[c % 2];
+	}
+}
+
+void
+replaygain_set_true_peak(struct replaygain_ctx *ctx, int enable) {
+	ctx->true_peak_on = enable;
+}
+
+void
+replaygain_set_dual_mono(struct replaygain_ctx *ctx, int enable) {
+	ctx->dual_mono_on = enable;
+}
+
+/* a horizon of so many windows, forgetting the windows so far */
+static enum replaygain_status
+set_horizon(struct replaygain_ctx *ctx, size_t horizon) {
+	uint16_t	*ring = 0;
+
+	if (horizon) {
+		if (ctx->in_place)
+			return REPLAYGAIN_ERR_MEM;
+		if (!(ring = malloc(horizon * sizeof(*ring))))
+			return REPLAYGAIN_ERR_MEM;
+	}
+	free(ctx->ring);
+	ctx->ring = ring;
+	ctx->horizon = horizon;
+	clear_value(ctx);
+	return REPLAYGAIN_OK;
+}
+
+enum replaygain_status
+replaygain_set_horizon(struct replaygain_ctx *ctx, unsigned long ms) {
+	/* in windows, rounded up */
+	return set_horizon(ctx, (ms * RMS_WINDOW_TIME_DEN +
+	    1000 * RMS_WINDOW_TIME_NUM - 1) / (1000 * RMS_WINDOW_TIME_NUM));
+}
+
+enum replaygain_status
+replaygain_set_decimate(struct replaygain_ctx *ctx, int enable) {
+	enum replaygain_status	status;
+	int			was = ctx->decimate_on;
+
+	ctx->decimate_on = enable;
+	status = replaygain_reset_frequency(ctx, ctx->input_freq);
+	if (status != REPLAYGAIN_OK)
+		ctx->decimate_on = was;
+	return status;
+}
+
+void
+replaygain_peak_accum(struct replaygain_peak *sum,
+    const struct replaygain_peak *addition) {
+	int	i;
+
+	for (i = 0; i < (int)REPLAYGAIN_MAX_CHANNELS; i++) {
+		if (addition->peak[i] > sum->peak[i])
+			sum->peak[i] = addition->peak[i];
+		sum->clipped[i] += addition->clipped[i];
+		if (addition->true_peak[i] > sum->true_peak[i])
+			sum->true_peak[i] = addition->true_peak[i];
+	}
+}
+
+size_t
+replaygain_window_size(const struct replaygain_ctx *ctx) {
+	return (size_t)ctx->sample_window << ctx->decimate_stages;
+}
+
+void
+replaygain_pop(struct replaygain_ctx *ctx, struct replaygain_value *out) {
+	memcpy(out, &ctx->value, sizeof(ctx->value));
+	clear_state(ctx);
+}
+
+/* The compact form is the occupied bins in ascending order, each as two
+ * LEB128 numbers: the count of empty bins skipped since the previous one,
+ * then the number of windows in the bin. */
+
+struct bin_reader {
+	const uint8_t	*pos;
+	const uint8_t	*end;
+	uint32_t	index;
+	uint32_t	count;
+	bool		malformed;
+};
+
+struct bin_writer {
+	uint8_t		*pos;	/* null to only measure */
+	size_t		len;
+	uint32_t	index;
+};
+
+static bool
+get_varint64(struct bin_reader *r, uint64_t *out) {
+	uint64_t	v = 0;
+	int		shift;
+
+	for (shift = 0; shift < 70 && r->pos != r->end; shift += 7) {
+		uint8_t	byte = *r->pos++;
+
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*out = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool
+get_varint(struct bin_reader *r, uint32_t *out) {
+	uint64_t	v;
+
+	if (!get_varint64(r, &v) || v > UINT32_MAX)
+		return false;
+	*out = v;
+	return true;
+}
+
+static void
+put_varint(struct bin_writer *w, uint64_t v) {
+	do {
+		uint8_t	byte = v & 0x7f;
+
+		if (v >>= 7)
+			byte |= 0x80;
+		if (w->pos)
+			*w->pos++ = byte;
+		w->len++;
+	} while (v);
+}
+
+static void
+reader_init(struct bin_reader *r, const uint8_t *bins, size_t len) {
+	r->pos = bins;
+	r->end = bins + len;
+	r->index = (uint32_t)-1;
+	r->malformed = false;
+}
+
+/* the next occupied bin; false at the end or on malformed input */
+static bool
+next_bin(struct bin_reader *r) {
+	uint32_t	skip;
+
+	if (r->pos == r->end)
+		return false;
+	if (!get_varint(r, &skip) || !get_varint(r, &r->count) ||
+	    skip >= ANALYZE_SIZE || (r->index += skip + 1) >= ANALYZE_SIZE ||
+	    !r->count) {
+		r->malformed = true;
+		return false;
+	}
+	return true;
+}
+
+static void
+writer_init(struct bin_writer *w, uint8_t *out) {
+	w->pos = out;
+	w->len = 0;
+	w->index = (uint32_t)-1;
+}
+
+static void
+put_bin(struct bin_writer *w, uint32_t index, uint32_t count) {
+	put_varint(w, index - w->index - 1);
+	put_varint(w, count);
+	w->index = index;
+}
+
+size_t
+replaygain_compact(const struct replaygain_value *value, uint8_t *out) {
+	struct bin_writer	w;
+	size_t			i;
+
+	writer_init(&w, out);
+	for (i = 0; i < ANALYZE_SIZE; i++)
+		if (value->value[i])
+			put_bin(&w, i, value->value[i]);
+	return w.len;
+}
+
+enum replaygain_status
+replaygain_expand(const uint8_t *bins, size_t len,
+    struct replaygain_value *out) {
+	struct bin_reader	r;
+
+	memset(out, 0, sizeof(*out));
+	reader_init(&r, bins, len);
+	while (next_bin(&r))
+		out->value[r.index] = r.count;
+	return r.malformed ? REPLAYGAIN_ERROR : REPLAYGAIN_OK;
+}
+
+size_t
+replaygain_pop_compact(struct replaygain_ctx *ctx, uint8_t *out,
+    size_t capacity) {
+	size_t	len;
+
+	len = replaygain_compact(&ctx->value, 0);
+	if (len > capacity)
+		return len;
+	replaygain_compact(&ctx->value, out);
+	clear_state(ctx);
+	return len;
+}
+
+size_t
+replaygain_compact_merge(const uint8_t *a, size_t alen, const uint8_t *b,
+    size_t blen, uint8_t *out) {
+	struct bin_reader	ra;
+	struct bin_reader	rb;
+	struct bin_writer	w;
+	bool			more_a;
+	bool			more_b;
+
+	reader_init(&ra, a, alen);
+	reader_init(&rb, b, blen);
+	writer_init(&w, out);
+	more_a = next_bin(&ra);
+	more_b = next_bin(&rb);
+	while (more_a || more_b) {
+		if (more_a && (!more_b || ra.index < rb.index)) {
+			put_bin(&w, ra.index, ra.count);
+			more_a = next_bin(&ra);
+		} else if (more_b && (!more_a || rb.index < ra.index)) {
+			put_bin(&w, rb.index, rb.count);
+			more_b = next_bin(&rb);
+		} else {
+			put_bin(&w, ra.index, ra.count + rb.count);
+			more_a = next_bin(&ra);
+			more_b = next_bin(&rb);
+		}
+	}
+	return w.len;
+}
+
+Float_t
+replaygain_compact_adjustment(const uint8_t *bins, size_t len) {
+	struct bin_reader	r;
+	uint32_t		elems;
+	uint32_t		below;
+	uint32_t		upper;
+	uint32_t		index;
+
+	elems = 0;
+	reader_init(&r, bins, len);
+	while (next_bin(&r))
+		elems += r.count;
+	if (!elems)
+		return GAIN_NOT_ENOUGH_SAMPLES;
+
+	/* the highest bin with at least 'upper' windows at or above it, as
+	 * in replaygain_adjustment() */
+	upper = ceil(elems * (1 - RMS_PERCENTILE));
+	below = 0;
+	index = 0;
+	reader_init(&r, bins, len);
+	while (next_bin(&r) && elems - below >= upper) {
+		index = r.index;
+		below += r.count;
+	}
+
+	return PINK_REF - (Float_t)index / STEPS_PER_DB;
+}
+
+/* The serialized form, all integers LEB128:
+ *
+ *	"MGRG"			magic
+ *	version			SERIAL_VERSION
+ *	channels		those up to the last with a peak
+ *	per channel:
+ *		peak		IEEE 754 double, little-endian
+ *		true_peak	the same
+ *		clipped
+ *	length			of the bins
+ *	bins			the compact form
+ *
+ * A reader refuses any version but its own, so a later one is free to
+ * change the rest. */
+
+#define SERIAL_VERSION	1
+
+static const uint8_t SERIAL_MAGIC[4] = { 'M', 'G', 'R', 'G' };
+
+static void
+put_bytes(struct bin_writer *w, const uint8_t *bytes, size_t len) {
+	if (w->pos && len) {
+		memcpy(w->pos, bytes, len);
+		w->pos += len;
+	}
+	w->len += len;
+}
+
+static void
+put_double(struct bin_writer *w, double v) {
+	uint64_t	bits;
+	uint8_t		bytes[8];
+	int		i;
+
+	memcpy(&bits, &v, sizeof(bits));
+	for (i = 0; i < 8; i++)
+		bytes[i] = bits >> 8*i;
+	put_bytes(w, bytes, sizeof(bytes));
+}
+
+static bool
+get_double(struct bin_reader *r, double *out) {
+	uint64_t	bits = 0;
+	int		i;
+
+	if (r->end - r->pos < 8)
+		return false;
+	for (i = 0; i < 8; i++)
+		bits |= (uint64_t)*r->pos++ << 8*i;
+	memcpy(out, &bits, sizeof(*out));
+	return true;
+}
+
+size_t
+replaygain_serialize(const uint8_t *bins, size_t len,
+    const struct replaygain_peak *peak, uint8_t *out) {
+	struct bin_writer	w;
+	int			channels;
+	int			i;
+
+	channels = REPLAYGAIN_MAX_CHANNELS;
+	while (channels && !peak->peak[channels - 1] &&
+	    !peak->true_peak[channels - 1] && !peak->clipped[channels - 1])
+		channels--;
+
+	writer_init(&w, out);
+	put_bytes(&w, SERIAL_MAGIC, sizeof(SERIAL_MAGIC));
+	put_varint(&w, SERIAL_VERSION);
+	put_varint(&w, channels);
+	for (i = 0; i < channels; i++) {
+		put_double(&w, peak->peak[i]);
+		put_double(&w, peak->true_peak[i]);
+		put_varint(&w, peak->clipped[i]);
+	}
+	put_varint(&w, len);
+	put_bytes(&w, bins, len);
+	return w.len;
+}
+
+enum replaygain_status
+replaygain_deserialize(const uint8_t *data, size_t len,
+    const uint8_t **bins, size_t *bins_len, struct replaygain_peak *peak) {
+	struct bin_reader	r;
+	struct bin_reader	check;
+	uint64_t		version;
+	uint64_t		channels;
+	uint64_t		size;
+	uint64_t		i;
+
+	memset(peak, 0, sizeof(*peak));
+	reader_init(&r, data, len);
+	if (len < sizeof(SERIAL_MAGIC) ||
+	    memcmp(data, SERIAL_MAGIC, sizeof(SERIAL_MAGIC)))
+		return REPLAYGAIN_ERROR;
+	r.pos += sizeof(SERIAL_MAGIC);
+	if (!get_varint64(&r, &version) || version != SERIAL_VERSION ||
+	    !get_varint64(&r, &channels) ||
+	    channels > REPLAYGAIN_MAX_CHANNELS)
+		return REPLAYGAIN_ERROR;
+	for (i = 0; i < channels; i++)
+		if (!get_double(&r, &peak->peak[i]) ||
+		    !get_double(&r, &peak->true_peak[i]) ||
+		    !get_varint64(&r, &peak->clipped[i]))
+			return REPLAYGAIN_ERROR;
+	if (!get_varint64(&r, &size) || size != (size_t)(r.end - r.pos))
+		return REPLAYGAIN_ERROR;
+
+	reader_init(&check, r.pos, size);
+	while (next_bin(&check))
+		;
+	if (check.malformed)
+		return REPLAYGAIN_ERROR;
+	*bins = r.pos;
+	*bins_len = size;
+	return REPLAYGAIN_OK;
+}
+
+/* A checkpoint is a magic number and a version, then everything below in
+ * order, integers LEB128 and the rest doubles as replaygain_serialize()
+ * writes them:
+ *
+ *	the settings: input_freq, mode, decimate_on, true_peak_on,
+ *	    dual_mono_on, weight_set, weight[], horizon (in windows)
+ *	the position: channels, active_pairs, peak_channels, totsamp
+ *	per pair, the peaks: peak[], true_peak[], clipped[]
+ *	per active pair, the filters: dual, lsum, rsum, the input history
+ *	    in linprebuf and rinprebuf, the MAX_ORDER steps and outs before
+ *	    totsamp, tp_hist, and per decimator stage avail and its pairs
+ *	the histogram: its length, then its compact form
+ *	with a horizon, the windows in the ring, oldest first
+ *
+ * Kernels are the restoring context's own; all those of double precision
+ * give the same results.  Like replaygain_serialize(), a reader refuses
+ * any version but its own. */
+
+#define CHECKPOINT_VERSION	1
+
+static const uint8_t CHECKPOINT_MAGIC[4] = { 'M', 'G', 'C', 'K' };
+
+/* what a checkpoint sets up before the state is read into it */
+struct checkpoint_head {
+	uint64_t	input_freq;
+	uint64_t	mode;
+	uint64_t	decimate_on;
+	uint64_t	true_peak_on;
+	uint64_t	dual_mono_on;
+	uint64_t	weight_set;
+	double		weight[REPLAYGAIN_MAX_CHANNELS];
+	uint64_t	horizon;
+	uint64_t	channels;
+	uint64_t	active_pairs;
+	uint64_t	peak_channels;
+	uint64_t	totsamp;
+};
+
+static void
+put_doubles(struct bin_writer *w, const Float_t *v, size_t n) {
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		put_double(w, v[i]);
+}
+
+/* read n doubles to v, or with apply false only check they are there */
+static bool
+get_doubles(struct bin_reader *r, Float_t *v, size_t n, bool apply) {
+	double	d;
+	size_t	i;
+
+	for (i = 0; i < n; i++) {
+		if (!get_double(r, &d))
+			return false;
+		if (apply)
+			v[i] = d;
+	}
+	return true;
+}
+
+size_t
+replaygain_checkpoint(const struct replaygain_ctx *ctx, uint8_t *out) {
+	struct bin_writer	w;
+	size_t			i;
+	size_t			bins;
+	int			p;
+	int			s;
+	int			c;
+
+	writer_init(&w, out);
+	put_bytes(&w, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	put_varint(&w, CHECKPOINT_VERSION);
+
+	put_varint(&w, ctx->input_freq);
+	put_varint(&w, ctx->mode);
+	put_varint(&w, ctx->decimate_on != 0);
+	put_varint(&w, ctx->true_peak_on != 0);
+	put_varint(&w, ctx->dual_mono_on != 0);
+	put_varint(&w, ctx->weight_set);
+	put_doubles(&w, ctx->weight, REPLAYGAIN_MAX_CHANNELS);
+	put_varint(&w, ctx->horizon);
+	put_varint(&w, ctx->channels);
+	put_varint(&w, ctx->active_pairs);
+	put_varint(&w, ctx->peak_channels);
+	put_varint(&w, ctx->totsamp);
+
+	for (p = 0; p < MAX_PAIRS; p++) {
+		const struct channel_pair	*pair = ctx->pair + p;
+
+		put_doubles(&w, pair->peak, 2);
+		put_doubles(&w, pair->true_peak, 2);
+		put_varint(&w, pair->clipped[0]);
+		put_varint(&w, pair->clipped[1]);
+	}
+	for (p = 0; p < ctx->active_pairs; p++) {
+		const struct channel_pair	*pair = ctx->pair + p;
+		/* the history before the window, as clear_pair() has it */
+		int				at = ctx->totsamp - MAX_ORDER;
+
+		put_varint(&w, pair->dual);
+		put_double(&w, pair->lsum);
+		put_double(&w, pair->rsum);
+		put_doubles(&w, pair->linprebuf, MAX_ORDER);
+		put_doubles(&w, pair->rinprebuf, MAX_ORDER);
+		put_doubles(&w, pair->lstep + at, MAX_ORDER);
+		put_doubles(&w, pair->rstep + at, MAX_ORDER);
+		put_doubles(&w, pair->lout + at, MAX_ORDER);
+		put_doubles(&w, pair->rout + at, MAX_ORDER);
+		for (c = 0; c < 2; c++)
+			for (i = 0; i < TRUE_PEAK_TAPS; i++)
+				put_double(&w, pair->tp_hist[c][i]);
+		for (s = 0; s < ctx->decimate_stages; s++) {
+			put_varint(&w, pair->decimator->avail[s]);
+			put_doubles(&w, pair->decimator->buf[s],
+			    2 * pair->decimator->avail[s]);
+		}
+	}
+
+	bins = replaygain_compact(&ctx->value, 0);
+	put_varint(&w, bins);
+	if (w.pos) {
+		replaygain_compact(&ctx->value, w.pos);
+		w.pos += bins;
+	}
+	w.len += bins;
+
+	if (ctx->horizon) {
+		size_t	oldest = ctx->windows < ctx->horizon ? 0 :
+		    ctx->ring_pos;
+
+		for (i = 0; i < ctx->windows; i++)
+			put_varint(&w, ctx->ring[(oldest + i) % ctx->horizon]);
+	}
+	return w.len;
+}
+
+static bool
+get_head(struct bin_reader *r, struct checkpoint_head *h) {
+	uint64_t	version;
+	size_t		i;
+
+	if ((size_t)(r->end - r->pos) < sizeof(CHECKPOINT_MAGIC) ||
+	    memcmp(r->pos, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)))
+		return false;
+	r->pos += sizeof(CHECKPOINT_MAGIC);
+	if (!get_varint64(r, &version) || version != CHECKPOINT_VERSION ||
+	    !get_varint64(r, &h->input_freq) || !get_varint64(r, &h->mode) ||
+	    !get_varint64(r, &h->decimate_on) ||
+	    !get_varint64(r, &h->true_peak_on) ||
+	    !get_varint64(r, &h->dual_mono_on) ||
+	    !get_varint64(r, &h->weight_set))
+		return false;
+	for (i = 0; i < REPLAYGAIN_MAX_CHANNELS; i++)
+		if (!get_double(r, &h->weight[i]))
+			return false;
+	return get_varint64(r, &h->horizon) &&
+	    get_varint64(r, &h->channels) &&
+	    get_varint64(r, &h->active_pairs) &&
+	    get_varint64(r, &h->peak_channels) &&
+	    get_varint64(r, &h->totsamp) &&
+	    h->input_freq >= MIN_SAMP_FREQ && h->input_freq <= MAX_SAMP_FREQ &&
+	    (h->mode == REPLAYGAIN_MODE_DOUBLE ||
+	    h->mode == REPLAYGAIN_MODE_FLOAT) &&
+	    h->decimate_on <= 1 && h->true_peak_on <= 1 &&
+	    h->dual_mono_on <= 1 &&
+	    h->weight_set < 1u << REPLAYGAIN_MAX_CHANNELS &&
+	    h->horizon <= SIZE_MAX / sizeof(uint16_t) &&
+	    h->channels >= 1 && h->channels <= REPLAYGAIN_MAX_CHANNELS &&
+	    h->active_pairs >= 1 && h->active_pairs <= MAX_PAIRS &&
+	    h->peak_channels <= REPLAYGAIN_MAX_CHANNELS &&
+	    h->totsamp < window_samples(h->input_freq >>
+	    decimate_stages(h->input_freq, h->decimate_on));
+}
+
+/* Read the state after the head into a context set up for it, or with
+ * apply false only check it is all there and sound */
+static bool
+get_state(struct bin_reader *r, const struct checkpoint_head *h,
+    struct replaygain_ctx *ctx, bool apply) {
+	struct bin_reader	bins;
+	uint64_t		v;
+	uint64_t		len;
+	uint64_t		i;
+	int			stages;
+	int			p;
+	int			s;
+	int			c;
+
+	stages = decimate_stages(h->input_freq, h->decimate_on);
+	for (p = 0; p < MAX_PAIRS; p++) {
+		struct channel_pair	*pair = ctx->pair + p;
+
+		if (!get_doubles(r, pair->peak, 2, apply) ||
+		    !get_doubles(r, pair->true_peak, 2, apply))
+			return false;
+		for (c = 0; c < 2; c++) {
+			if (!get_varint64(r, &v))
+				return false;
+			if (apply)
+				pair->clipped[c] = v;
+		}
+	}
+	for (p = 0; p < (int)h->active_pairs; p++) {
+		struct channel_pair	*pair = ctx->pair + p;
+		/* less than a window, which fits an int */
+		int			at = (int)h->totsamp - MAX_ORDER;
+
+		if (!get_varint64(r, &v) || v > 1)
+			return false;
+		if (apply)
+			pair->dual = v;
+		if (!get_doubles(r, &pair->lsum, 1, apply) ||
+		    !get_doubles(r, &pair->rsum, 1, apply) ||
+		    !get_doubles(r, pair->linprebuf, MAX_ORDER, apply) ||
+		    !get_doubles(r, pair->rinprebuf, MAX_ORDER, apply) ||
+		    !get_doubles(r, apply ? pair->lstep + at : 0, MAX_ORDER,
+		    apply) ||
+		    !get_doubles(r, apply ? pair->rstep + at : 0, MAX_ORDER,
+		    apply) ||
+		    !get_doubles(r, apply ? pair->lout + at : 0, MAX_ORDER,
+		    apply) ||
+		    !get_doubles(r, apply ? pair->rout + at : 0, MAX_ORDER,
+		    apply))
+			return false;
+		for (c = 0; c < 2; c++)
+			for (i = 0; i < TRUE_PEAK_TAPS; i++) {
+				double	d;
+
+				if (!get_double(r, &d))
+					return false;
+				if (apply)
+					pair->tp_hist[c][i] = d;
+			}
+		for (s = 0; s < stages; s++) {
+			if (!get_varint64(r, &v) ||
+			    v > HALFBAND_LEN(HALFBAND_LONG))
+				return false;
+			if (apply)
+				pair->decimator->avail[s] = v;
+			if (!get_doubles(r, apply ? pair->decimator->buf[s] : 0,
+			    2 * v, apply))
+				return false;
+		}
+	}
+
+	if (!get_varint64(r, &len) || len > (size_t)(r->end - r->pos))
+		return false;
+	reader_init(&bins, r->pos, len);
+	while (next_bin(&bins))
+		;
+	if (bins.malformed)
+		return false;
+	if (apply) {
+		replaygain_expand(r->pos, len, &ctx->value);
+		build_tree(ctx);
+	}
+	r->pos += len;
+
+	if (h->horizon) {
+		/* the ring holds just the windows of the histogram */
+		uint64_t	windows = 0;
+
+		reader_init(&bins, r->pos - len, len);
+		while (next_bin(&bins))
+			windows += bins.count;
+		if (windows > h->horizon)
+			return false;
+		for (i = 0; i < windows; i++) {
+			if (!get_varint64(r, &v) || v >= ANALYZE_SIZE)
+				return false;
+			if (apply)
+				ctx->ring[i] = v;
+		}
+		if (apply)
+			ctx->ring_pos = windows % h->horizon;
+	}
+	return r->pos == r->end;
+}
+
+enum replaygain_status
+replaygain_restore(struct replaygain_ctx *ctx, const uint8_t *data,
+    size_t len) {
+	struct checkpoint_head	h;
+	struct bin_reader	r;
+	struct bin_reader	state;
+	enum replaygain_status	status;
+	int			was = ctx->decimate_on;
+
+	reader_init(&r, data, len);
+	if (!get_head(&r, &h))
+		return REPLAYGAIN_ERROR;
+	state = r;
+	if (!get_state(&r, &h, ctx, false))
+		return REPLAYGAIN_ERROR;
+
+	/* the settings, as their setters make them, then the state */
+	ctx->decimate_on = h.decimate_on;
+	if ((status = replaygain_reset_frequency(ctx, h.input_freq)) !=
+	    REPLAYGAIN_OK) {
+		ctx->decimate_on = was;
+		return status;
+	}
+	if ((status = set_horizon(ctx, h.horizon)) != REPLAYGAIN_OK)
+		return status;
+	ctx->totsamp = h.totsamp;
+	if ((status = use_pairs(ctx, h.active_pairs)) != REPLAYGAIN_OK)
+		return status;
+	ctx->mode = h.mode;
+	ctx->true_peak_on = h.true_peak_on;
+	ctx->dual_mono_on = h.dual_mono_on;
+	ctx->weight_set = h.weight_set;
+	memcpy(ctx->weight, h.weight, sizeof(ctx->weight));
+	ctx->channels = h.channels;
+	ctx->peak_channels = h.peak_channels;
+	get_state(&state, &h, ctx, true);
+	return REPLAYGAIN_OK;
 }
@@ -12,89 +12,183 @@
  * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <vector>
+
+#include <unistd.h>
 
 #include <lame/lame.h>
 
 #include <multigain/decode.hpp>
 #include <multigain/gain_analysis.hpp>
+#include <multigain/r128_analysis.hpp>
+#include <multigain/result_cache.hpp>
 #include "lame.hpp"
 
 namespace {
 
-inline double
-sample_i2d(int16_t sample) {
-	/*
-	if (sample < 0)
-		return sample * 32767.0 / 32768;
-	*/
-	return sample;
-}
+using namespace multigain;
 
-} // end anon
+const size_t SAMPLES = 4096;
 
-int
-main(int argc, char **argv) {
-	using namespace multigain;
+/** Whether a file is FLAC, maybe after an ID3v2 tag; the file is left at
+ * its start
+ *
+ * \param[out] bits	Bits per sample, from the STREAMINFO block */
+bool
+is_flac(std::ifstream &file, unsigned *bits) {
+	char	head[10];
+	bool	flac = false;
 
-	const size_t SAMPLES = 4096;
+	if (file.read(head, 4) && std::equal(head, head + 3, "ID3") &&
+	    file.read(head + 4, 6)) {
+		// syncsafe size, then maybe a footer
+		std::streamoff size = 10 + ((head[6] & 0x7f) << 21 |
+		    (head[7] & 0x7f) << 14 | (head[8] & 0x7f) << 7 |
+		    (head[9] & 0x7f));
+		if (head[5] & 0x10)
+			size += 10;
+		file.seekg(size, std::ios_base::beg);
+		file.read(head, 4);
+	}
+	if (file && (flac = std::equal(head, head + 4, "fLaC"))) {
+		unsigned char	info[18];
 
-	if (argc != 2) {
-		std::cerr << "Usage: " << *argv << " FILE\n";
-		return 1;
+		// STREAMINFO comes first: its header, block sizes, frame
+		// sizes, then 20 bits of rate, 3 of channels, 5 of width
+		*bits = 0;
+		if (file.read(reinterpret_cast<char *>(info), sizeof(info)))
+			*bits = ((info[16] & 1) << 4 | info[17] >> 4) + 1;
+	}
+	file.clear();
+	file.seekg(0, std::ios_base::beg);
+	return flac;
+}
+
+/** Print the gain and loudness of a file */
+void
+report_file(const Sample &sample, const R128_sample &loudness) {
+	std::cout << "gain: " << sample.adjustment() << " dB\n";
+	try {
+		std::cout << "loudness: " << loudness.integrated()
+		    << " LUFS\nrange: " << loudness.range() << " LU\n";
+	} catch (const Not_enough_samples &) {
+		std::cout << "loudness: too short to measure\n";
 	}
+}
 
-	std::string path = argv[1];
-	std::ifstream file;
+/** Report the gain and loudness of a whole file, from the cache if it is
+ * found there
+ *
+ * \param mpg123	Decode MPEG audio with libmpg123, as floating point,
+ *	instead of LAME */
+int
+analyze_file(const char *prog, const std::string &path, Result_cache *cache,
+    bool mpg123) {
+	std::ifstream	file;
+	File_identity	id;
+	Sample		sample;
+	R128_sample	loudness;
 
 	file.open(path.c_str(), std::ios::in | std::ios::binary);
 	if (!file) {
-		std::cerr << *argv << ": failed to open file\n";
+		std::cerr << prog << ": failed to open file\n";
 		return 1;
 	}
 
-	Mpeg_decoder		decoder(file);
-	Audio_buffer		audio_buf(SAMPLES);
-	std::unique_ptr<Analyzer>	analyzer;
-	uint16_t		frequency;
+	if (cache) {
+		try {
+			// unchanged, or else the same audio under new tags
+			id = identify_file(path);
+			bool found = cache->find(id, &sample, &loudness);
+			if (!found) {
+				id.audio_hash = audio_hash(file);
+				found = cache->find(id, &sample, &loudness);
+			}
+			if (found) {
+				report_file(sample, loudness);
+				return 0;
+			}
+		} catch (const Disk_error &e) {
+			std::cerr << prog << ": " << e.what() << '\n';
+			return 1;
+		}
+	}
 
-	std::unique_ptr<double> dbuf(new double[2 * SAMPLES]);
-	double *ldbuf = dbuf.get();
-	double *rdbuf = dbuf.get() + SAMPLES;
+	std::unique_ptr<Decoder>	decoder;
+	auto format = Audio_buffer::format_type::S16;
+	unsigned flac_bits;
+	if (is_flac(file, &flac_bits)) {
+		FILE *fp = std::fopen(path.c_str(), "rb");
+		if (!fp) {
+			std::cerr << prog << ": failed to open file\n";
+			return 1;
+		}
+		decoder = std::make_unique<Flac_decoder>(fp);
+		// whole, where 16 bits would lose some
+		if (flac_bits > 16)
+			format = Audio_buffer::format_type::F32;
+	} else if (mpg123) {
+		decoder = std::make_unique<Mpg123_decoder>(file);
+		format = Audio_buffer::format_type::F32;
+	} else
+		decoder = std::make_unique<Mpeg_decoder>(file);
+
+	Audio_buffer		audio_buf(SAMPLES, format);
+	std::unique_ptr<Analyzer>	analyzer;
+	std::unique_ptr<R128_analyzer>	r128;
+	R128_sample_accum	loudness_sum;
+	uint32_t		frequency;
+	uint8_t			channels;
 
 	uint32_t total = 0;
 
 	for (;;) {
-		auto [bytes, samples] = decoder.decode(&audio_buf);
-		uint16_t freq = audio_buf.frequency();
+		auto [bytes, samples] = decoder->decode(&audio_buf);
+		uint32_t freq = audio_buf.frequency();
 		if (!samples)
 			break;
 		else if (!analyzer) {
 			frequency = freq;
+			channels = audio_buf.channels();
 			analyzer = std::make_unique<Analyzer>(freq);
-		} else if (frequency != freq) {
-			frequency = freq;
-			analyzer->reset_sample_frequency(frequency);
+			r128 = std::make_unique<R128_analyzer>(freq, channels);
+		} else if (frequency != freq ||
+		    channels != audio_buf.channels()) {
+			// R128 filters are made for one layout; keep what the
+			// old one measured
+			R128_sample part;
+			r128->pop(&part);
+			loudness_sum += part;
+			if (frequency != freq) {
+				frequency = freq;
+				analyzer->reset_sample_frequency(frequency);
+			}
+			channels = audio_buf.channels();
+			r128 = std::make_unique<R128_analyzer>(freq, channels);
 		}
 
 		total += samples;
 
-		uint8_t channels = audio_buf.channels();
-		const int16_t *lsamp = audio_buf.samples()[0];
-		const int16_t *rsamp = channels == 1 ?
-		    audio_buf.samples()[0] : audio_buf.samples()[1];
-
-		// convert to doubles
-		for (size_t i = 0; i < samples; i++)
-			ldbuf[i] = sample_i2d(lsamp[i]);
-		if (channels != 1)
-			for (size_t i = 0; i < samples; i++)
-				rdbuf[i] = sample_i2d(rsamp[i]);
-
-		if (!analyzer->add(ldbuf, rdbuf, samples, channels)) {
+		bool ok;
+		if (format == Audio_buffer::format_type::F32) {
+			ok = analyzer->add(audio_buf.float_samples(), samples,
+			    audio_buf.channels());
+			r128->add(audio_buf.float_samples(), samples);
+		} else {
+			ok = analyzer->add(audio_buf.samples(), samples,
+			    audio_buf.channels());
+			r128->add(audio_buf.samples(), samples);
+		}
+		if (!ok) {
 			std::cerr << "what\n";
 			return 1;
 		}
@@ -105,9 +199,190 @@ main(int argc, char **argv) {
 		return 1;
 	}
 
-	Sample sample;
 	analyzer->pop(&sample);
-	std::cout << "gain: " << sample.adjustment() << " dB\n";
+	R128_sample part;
+	r128->pop(&part);
+	loudness_sum += part;
+	// the parts of a file whose layout changed, as one
+	std::vector<uint8_t> sum = loudness_sum.save();
+	loudness.load(sum.data(), sum.size());
+	if (cache) {
+		try {
+			cache->store(id, sample, loudness);
+		} catch (const Disk_error &e) {
+			std::cerr << prog << ": " << e.what() << '\n';
+			return 1;
+		}
+	}
+	report_file(sample, loudness);
+	return 0;
+}
+
+void
+report_gain(const Analyzer &analyzer) {
+	try {
+		std::cout << "gain: " << analyzer.running_adjustment()
+		    << " dB" << std::endl;
+	} catch (const Not_enough_samples &) {
+		std::cout << "gain: too short to measure" << std::endl;
+	}
+}
+
+/** Report the gain of a never-ending stream of raw 16-bit frames on stdin,
+ * over the last horizon_ms of it, every update_ms of it.  Input is taken
+ * as it arrives, so a report is late by no more than a read. */
+int
+analyze_live(const char *prog, long freq, int channels,
+    unsigned long horizon_ms, unsigned long update_ms) {
+	std::unique_ptr<Analyzer>	analyzer;
 
+	try {
+		analyzer = std::make_unique<Analyzer>(freq);
+	} catch (const Bad_samplefreq &) {
+		std::cerr << prog << ": bad sample frequency\n";
+		return 1;
+	}
+	analyzer->horizon(horizon_ms);
+
+	std::vector<int16_t>	frames(SAMPLES * channels);
+	char		*buf = reinterpret_cast<char *>(frames.data());
+	size_t		frame_bytes = channels * sizeof(int16_t);
+	size_t		have = 0;
+	uint64_t	every = std::max<uint64_t>(1, freq * update_ms / 1000);
+	uint64_t	since = 0;
+
+	for (;;) {
+		ssize_t n = read(STDIN_FILENO, buf + have,
+		    frames.size() * sizeof(int16_t) - have);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << prog << ": read error\n";
+			return 1;
+		}
+		if (!n)
+			break;
+		have += n;
+
+		// whole frames, cut where the reports fall
+		size_t count = have / frame_bytes;
+		for (size_t done = 0; done < count;) {
+			size_t len = std::min<uint64_t>(count - done,
+			    every - since);
+
+			if (!analyzer->add_interleaved(
+			    frames.data() + done * channels, len, channels)) {
+				std::cerr << "what\n";
+				return 1;
+			}
+			done += len;
+			if ((since += len) == every) {
+				report_gain(*analyzer);
+				since = 0;
+			}
+		}
+		// keep a partial frame for the next read
+		have -= count * frame_bytes;
+		std::memmove(buf, buf + count * frame_bytes, have);
+	}
 	return 0;
 }
+
+void
+usage(const char *prog) {
+	std::cerr << "Usage: " << prog << " [-C CACHE] [-d DECODER] FILE...\n"
+	    "       " << prog << " -l [-r RATE] [-c CHANNELS] [-w SECONDS] "
+	    "[-u SECONDS]\n"
+	    "\n"
+	    "  -C  keep the gains of files in CACHE, and report only the gain\n"
+	    "      of a file found there unchanged, without decoding it\n"
+	    "  -d  decode MPEG audio with DECODER: lame (the default), or\n"
+	    "      mpg123, which is faster\n"
+	    "  -l  read a live stream of raw signed 16-bit native-endian\n"
+	    "      interleaved frames from stdin, reporting its gain as it\n"
+	    "      goes\n"
+	    "  -r  its sample rate (44100)\n"
+	    "  -c  its channels (2)\n"
+	    "  -w  the gain is of the last SECONDS (180)\n"
+	    "  -u  report every SECONDS of the stream (1)\n";
+}
+
+} // end anon
+
+int
+main(int argc, char **argv) {
+	const char	*cache_path = 0;
+	bool	mpg123 = false;
+	long	freq = 44100;
+	long	channels = 2;
+	double	horizon = 180;
+	double	update = 1;
+	bool	live = false;
+	int	opt;
+
+	while ((opt = getopt(argc, argv, "C:d:lr:c:w:u:")) != -1)
+		switch (opt) {
+		case 'C':
+			cache_path = optarg;
+			break;
+		case 'd':
+			if (!std::strcmp(optarg, "mpg123"))
+				mpg123 = true;
+			else if (std::strcmp(optarg, "lame")) {
+				usage(*argv);
+				return 1;
+			}
+			break;
+		case 'l':
+			live = true;
+			break;
+		case 'r':
+			freq = std::strtol(optarg, 0, 10);
+			break;
+		case 'c':
+			channels = std::strtol(optarg, 0, 10);
+			break;
+		case 'w':
+			horizon = std::strtod(optarg, 0);
+			break;
+		case 'u':
+			update = std::strtod(optarg, 0);
+			break;
+		default:
+			usage(*argv);
+			return 1;
+		}
+
+	if (!live) {
+		std::unique_ptr<Result_cache>	cache;
+		int				status = 0;
+
+		if (optind == argc) {
+			usage(*argv);
+			return 1;
+		}
+		if (cache_path)
+			try {
+				cache = std::make_unique<Result_cache>(
+				    cache_path);
+			} catch (const Disk_error &e) {
+				std::cerr << *argv << ": " << e.what() << '\n';
+				return 1;
+			}
+		for (int i = optind; i < argc; i++) {
+			if (argc - optind > 1)
+				std::cout << argv[i] << ":\n";
+			if (analyze_file(*argv, argv[i], cache.get(), mpg123))
+				status = 1;
+		}
+		return status;
+	}
+	if (optind != argc || channels < 1 ||
+	    channels > (long)REPLAYGAIN_MAX_CHANNELS ||
+	    !(horizon > 0) || !(update > 0)) {
+		usage(*argv);
+		return 1;
+	}
+	return analyze_live(*argv, freq, channels, horizon * 1000,
+	    update * 1000);
+}
@@ -0,0 +1,567 @@
+/* Copyright (C) 2010 Markus Peloquin <markus@cs.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+
+/*
+ * The K-weighting filter is a high shelf (the "pre-filter") followed by a
+ * high pass (the "RLB" filter).  BS.1770 only tabulates the coefficients for
+ * 48 kHz; these are designed for any rate from the analog prototypes that
+ * reproduce that table.
+ *
+ * Mean squares are kept per 100 ms; a gating block is four of them (400 ms,
+ * 75% overlap) and a short-term block thirty (3 s), taken every ten (one
+ * second apart), as EBU Tech 3342 does for the loudness range.  Block
+ * loudness is binned in 0.01 LU steps, so the results are within 0.005 LU of
+ * those computed from the exact block values.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <multigain/r128_analysis.h>
+
+#ifndef M_PI
+#	define M_PI		3.14159265358979323846
+#endif
+
+/* sub-blocks in a gating block and in a short-term block, and between
+ * short-term blocks */
+#define BLOCK_SUBS		4
+#define SHORT_TERM_SUBS		30
+#define SHORT_TERM_HOP		10
+
+/* below the absolute gate, a block is ignored */
+#define ABSOLUTE_GATE		-70.0
+/* relative gates [LU] of the integrated loudness and the loudness range */
+#define INTEGRATED_GATE		-10.0
+#define RANGE_GATE		-20.0
+
+/* the samples' full scale */
+#define FULL_SCALE		32768.0
+
+/* samples per channel converted at a time by the typed entry points */
+#define STAGE_SAMPLES		1024
+
+struct channel {
+	double		weight;
+	/* previous input, pre-filter output, and RLB output */
+	double		x1, x2;
+	double		y1, y2;
+	double		z1, z2;
+	/* sum of squares over the current sub-block */
+	double		sum;
+};
+
+struct r128_ctx {
+	int		channels;
+	size_t		sub_samples;
+	size_t		sub_pos;
+
+	/* pre-filter, then RLB filter; a[0] is 1 */
+	double		pb[3];
+	double		pa[3];
+	double		ra[3];
+
+	struct channel	channel[R128_MAX_CHANNELS];
+
+	/* weighted mean square of the last sub-blocks, a ring */
+	double		sub[SHORT_TERM_SUBS];
+	unsigned	sub_next;
+	/* sub-blocks since the last pop, up to SHORT_TERM_SUBS + hop */
+	unsigned	sub_seen;
+
+	struct r128_value value;
+};
+
+static void
+design_filters(struct r128_ctx *ctx, long freq) {
+	double	f0;
+	double	g;
+	double	q;
+	double	k;
+	double	vh;
+	double	vb;
+	double	a0;
+
+	f0 = 1681.974450955533;
+	g = 3.999843853973347;
+	q = 0.7071752369554196;
+	k = tan(M_PI * f0 / freq);
+	vh = pow(10.0, g / 20.0);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1.0 + k / q + k * k;
+	ctx->pb[0] = (vh + vb * k / q + k * k) / a0;
+	ctx->pb[1] = 2.0 * (k * k - vh) / a0;
+	ctx->pb[2] = (vh - vb * k / q + k * k) / a0;
+	ctx->pa[0] = 1.0;
+	ctx->pa[1] = 2.0 * (k * k - 1.0) / a0;
+	ctx->pa[2] = (1.0 - k / q + k * k) / a0;
+
+	/* numerator 1, -2, 1 */
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / freq);
+	a0 = 1.0 + k / q + k * k;
+	ctx->ra[0] = 1.0;
+	ctx->ra[1] = 2.0 * (k * k - 1.0) / a0;
+	ctx->ra[2] = (1.0 - k / q + k * k) / a0;
+}
+
+/* forget the samples analyzed so far */
+static void
+clear_state(struct r128_ctx *ctx) {
+	int	i;
+
+	for (i = 0; i < ctx->channels; i++) {
+		struct channel	*ch = ctx->channel + i;
+
+		ch->x1 = ch->x2 = ch->y1 = ch->y2 = ch->z1 = ch->z2 = 0.0;
+		ch->sum = 0.0;
+	}
+	ctx->sub_pos = 0;
+	ctx->sub_next = 0;
+	ctx->sub_seen = 0;
+	memset(&ctx->value, 0, sizeof(ctx->value));
+}
+
+struct r128_ctx *
+r128_alloc(long freq, int channels, enum replaygain_status *out_status) {
+	struct r128_ctx	*ctx;
+	int		i;
+
+	if (freq < 8000 || freq > 384000) {
+		if (out_status) *out_status = REPLAYGAIN_ERR_SAMPLEFREQ;
+		return 0;
+	}
+	if (channels < 1 || channels > (int)R128_MAX_CHANNELS) {
+		if (out_status) *out_status = REPLAYGAIN_ERROR;
+		return 0;
+	}
+	if (!(ctx = malloc(sizeof(struct r128_ctx)))) {
+		if (out_status) *out_status = REPLAYGAIN_ERR_MEM;
+		return 0;
+	}
+
+	ctx->channels = channels;
+	ctx->sub_samples = (freq + 5) / 10;
+	design_filters(ctx, freq);
+	for (i = 0; i < channels; i++)
+		ctx->channel[i].weight = 1.0;
+	if (channels == 5) {
+		ctx->channel[3].weight = 1.41;
+		ctx->channel[4].weight = 1.41;
+	} else if (channels == 6) {
+		ctx->channel[3].weight = 0.0;
+		ctx->channel[4].weight = 1.41;
+		ctx->channel[5].weight = 1.41;
+	} else if (channels == 8) {
+		/* L R C LFE Lb Rb Ls Rs */
+		ctx->channel[3].weight = 0.0;
+		ctx->channel[6].weight = 1.41;
+		ctx->channel[7].weight = 1.41;
+	}
+	clear_state(ctx);
+
+	if (out_status) *out_status = REPLAYGAIN_OK;
+	return ctx;
+}
+
+void
+r128_free(struct r128_ctx *ctx) {
+	free(ctx);
+}
+
+enum replaygain_status
+r128_set_weight(struct r128_ctx *ctx, int channel, double weight) {
+	if (channel < 0 || channel >= ctx->channels)
+		return REPLAYGAIN_ERROR;
+	ctx->channel[channel].weight = weight;
+	return REPLAYGAIN_OK;
+}
+
+/* K-weight the next samples of a channel, summing the squares */
+static void
+filter_channel(const struct r128_ctx *ctx, struct channel *ch,
+    const double *in, size_t nSamples) {
+	double	x1 = ch->x1, x2 = ch->x2;
+	double	y1 = ch->y1, y2 = ch->y2;
+	double	z1 = ch->z1, z2 = ch->z2;
+	double	sum = ch->sum;
+	double	x, y, z;
+	size_t	i;
+
+	for (i = 0; i < nSamples; i++) {
+		x = in[i];
+		y = ctx->pb[0] * x + ctx->pb[1] * x1 + ctx->pb[2] * x2 -
+		    ctx->pa[1] * y1 - ctx->pa[2] * y2;
+		z = (y - 2.0 * y1 + y2) - ctx->ra[1] * z1 - ctx->ra[2] * z2;
+		sum += z * z;
+		x2 = x1; x1 = x;
+		y2 = y1; y1 = y;
+		z2 = z1; z1 = z;
+	}
+
+	/* after silence, let the state reach zero rather than denormals */
+	if (fabs(y1) + fabs(y2) + fabs(z1) + fabs(z2) < 1e-20)
+		y1 = y2 = z1 = z2 = 0.0;
+
+	ch->x1 = x1; ch->x2 = x2;
+	ch->y1 = y1; ch->y2 = y2;
+	ch->z1 = z1; ch->z2 = z2;
+	ch->sum = sum;
+}
+
+/* bin a block of the given mean square, if it passes the absolute gate */
+static void
+count_block(uint32_t *hist, double mean) {
+	double	lufs;
+	size_t	bin;
+
+	if (mean <= 0.0)
+		return;
+	lufs = -0.691 + 10.0 * log10(mean);
+	if (lufs < ABSOLUTE_GATE)
+		return;
+	bin = (lufs - ABSOLUTE_GATE) * R128_STEPS_PER_LU;
+	hist[bin < R128_SIZE ? bin : R128_SIZE - 1]++;
+}
+
+/* the mean of the last n sub-blocks */
+static double
+mean_of_subs(const struct r128_ctx *ctx, unsigned n) {
+	double		sum = 0.0;
+	unsigned	i;
+
+	for (i = 1; i <= n; i++)
+		sum += ctx->sub[(ctx->sub_next + SHORT_TERM_SUBS - i) %
+		    SHORT_TERM_SUBS];
+	return sum / n;
+}
+
+static void
+end_sub_block(struct r128_ctx *ctx) {
+	double	mean = 0.0;
+	int	i;
+
+	for (i = 0; i < ctx->channels; i++) {
+		mean += ctx->channel[i].weight * ctx->channel[i].sum;
+		ctx->channel[i].sum = 0.0;
+	}
+	mean /= ctx->sub_samples * FULL_SCALE * FULL_SCALE;
+
+	ctx->sub[ctx->sub_next] = mean;
+	ctx->sub_next = (ctx->sub_next + 1) % SHORT_TERM_SUBS;
+	ctx->sub_pos = 0;
+	if (++ctx->sub_seen == SHORT_TERM_SUBS + SHORT_TERM_HOP)
+		ctx->sub_seen = SHORT_TERM_SUBS;
+
+	if (ctx->sub_seen >= BLOCK_SUBS)
+		count_block(ctx->value.block, mean_of_subs(ctx, BLOCK_SUBS));
+	if (ctx->sub_seen == SHORT_TERM_SUBS)
+		count_block(ctx->value.short_term,
+		    mean_of_subs(ctx, SHORT_TERM_SUBS));
+}
+
+/* the entry points; convert is null for double samples */
+static void
+analyze(struct r128_ctx *ctx, const void *const *samples, size_t num_samples,
+    void (*convert)(double *, const void *, size_t), size_t size) {
+	double	stage[STAGE_SAMPLES];
+	size_t	done;
+	size_t	n;
+	int	i;
+
+	for (done = 0; done < num_samples; done += n) {
+		n = ctx->sub_samples - ctx->sub_pos;
+		if (n > num_samples - done)
+			n = num_samples - done;
+		if (convert && n > STAGE_SAMPLES)
+			n = STAGE_SAMPLES;
+
+		for (i = 0; i < ctx->channels; i++) {
+			const char	*in = samples[i];
+
+			if (!convert) {
+				filter_channel(ctx, ctx->channel + i,
+				    (const double *)in + done, n);
+				continue;
+			}
+			convert(stage, in + done * size, n);
+			filter_channel(ctx, ctx->channel + i, stage, n);
+		}
+
+		ctx->sub_pos += n;
+		if (ctx->sub_pos == ctx->sub_samples)
+			end_sub_block(ctx);
+	}
+}
+
+static void
+convert_s16(double *out, const void *in, size_t n) {
+	const int16_t	*samples = in;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		out[i] = samples[i];
+}
+
+static void
+convert_s32(double *out, const void *in, size_t n) {
+	const int32_t	*samples = in;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		out[i] = samples[i] * (1.0 / 65536);
+}
+
+static void
+convert_f32(double *out, const void *in, size_t n) {
+	const float	*samples = in;
+	size_t		i;
+
+	for (i = 0; i < n; i++)
+		out[i] = samples[i] * 32768.0;
+}
+
+void
+r128_analyze(struct r128_ctx *ctx, const double *const *samples,
+    size_t num_samples) {
+	analyze(ctx, (const void *const *)samples, num_samples, 0,
+	    sizeof(double));
+}
+
+void
+r128_analyze_s16(struct r128_ctx *ctx, const int16_t *const *samples,
+    size_t num_samples) {
+	analyze(ctx, (const void *const *)samples, num_samples, convert_s16,
+	    sizeof(int16_t));
+}
+
+void
+r128_analyze_s32(struct r128_ctx *ctx, const int32_t *const *samples,
+    size_t num_samples) {
+	analyze(ctx, (const void *const *)samples, num_samples, convert_s32,
+	    sizeof(int32_t));
+}
+
+void
+r128_analyze_f32(struct r128_ctx *ctx, const float *const *samples,
+    size_t num_samples) {
+	analyze(ctx, (const void *const *)samples, num_samples, convert_f32,
+	    sizeof(float));
+}
+
+void
+r128_pop(struct r128_ctx *ctx, struct r128_value *out) {
+	memcpy(out, &ctx->value, sizeof(ctx->value));
+	clear_state(ctx);
+}
+
+void
+r128_accum(struct r128_value *sum, const struct r128_value *addition) {
+	size_t	i;
+
+	for (i = 0; i < R128_SIZE; i++) {
+		sum->block[i] += addition->block[i];
+		sum->short_term[i] += addition->short_term[i];
+	}
+}
+
+/* the loudness at the middle of a bin, and its mean square */
+static double
+bin_lufs(size_t bin) {
+	return ABSOLUTE_GATE + (bin + 0.5) / R128_STEPS_PER_LU;
+}
+
+static double
+bin_mean(size_t bin) {
+	return pow(10.0, (bin_lufs(bin) + 0.691) / 10.0);
+}
+
+/* the first bin that passes the relative gate */
+static size_t
+relative_gate(const uint32_t *hist, double gate) {
+	double	energy = 0.0;
+	double	count = 0.0;
+	double	lufs;
+	size_t	i;
+
+	for (i = 0; i < R128_SIZE; i++)
+		if (hist[i]) {
+			energy += hist[i] * bin_mean(i);
+			count += hist[i];
+		}
+	if (!count)
+		return R128_SIZE;
+
+	lufs = -0.691 + 10.0 * log10(energy / count) + gate;
+	if (lufs < ABSOLUTE_GATE)
+		return 0;
+	i = ceil((lufs - ABSOLUTE_GATE) * R128_STEPS_PER_LU - 0.5);
+	return i < R128_SIZE ? i : R128_SIZE;
+}
+
+double
+r128_integrated(const struct r128_value *value) {
+	double	energy = 0.0;
+	double	count = 0.0;
+	size_t	i;
+
+	for (i = relative_gate(value->block, INTEGRATED_GATE); i < R128_SIZE;
+	    i++)
+		if (value->block[i]) {
+			energy += value->block[i] * bin_mean(i);
+			count += value->block[i];
+		}
+	if (!count)
+		return GAIN_NOT_ENOUGH_SAMPLES;
+	return -0.691 + 10.0 * log10(energy / count);
+}
+
+/* the bin of the element at a rank of the histogram from 'first' up */
+static size_t
+rank_bin(const uint32_t *hist, size_t first, uint32_t rank) {
+	size_t	i;
+
+	for (i = first; i < R128_SIZE; i++) {
+		if (rank < hist[i])
+			break;
+		rank -= hist[i];
+	}
+	return i;
+}
+
+double
+r128_range(const struct r128_value *value) {
+	uint32_t	count = 0;
+	size_t		first;
+	size_t		i;
+
+	first = relative_gate(value->short_term, RANGE_GATE);
+	for (i = first; i < R128_SIZE; i++)
+		count += value->short_term[i];
+	if (!count)
+		return GAIN_NOT_ENOUGH_SAMPLES;
+
+	/* the 10th and 95th percentiles, as EBU Tech 3342 rounds them */
+	return bin_lufs(rank_bin(value->short_term, first,
+	    (count - 1) * 0.95 + 0.5)) -
+	    bin_lufs(rank_bin(value->short_term, first,
+	    (count - 1) * 0.10 + 0.5));
+}
+
+/* The encoding is SERIAL_MAGIC, the version, then for the block and the
+ * short-term histograms in turn, the number of counted bins, and for each
+ * the distance from the last (or from -1) and the count, all as unsigned
+ * LEB128 varints */
+static const uint8_t	SERIAL_MAGIC[4] = { 'M', 'G', 'L', 'U' };
+#define SERIAL_VERSION	1
+
+static size_t
+put_varint(uint8_t *out, size_t pos, uint64_t v) {
+	do {
+		if (out)
+			out[pos] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		pos++;
+		v >>= 7;
+	} while (v);
+	return pos;
+}
+
+static bool
+get_varint(const uint8_t *data, size_t len, size_t *pos, uint64_t *out) {
+	uint64_t	v = 0;
+	int		shift;
+
+	for (shift = 0; shift < 64 && *pos < len; shift += 7) {
+		uint8_t	byte = data[(*pos)++];
+
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*out = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+static size_t
+put_hist(uint8_t *out, size_t pos, const uint32_t *hist) {
+	size_t	count = 0;
+	size_t	last = -1;
+	size_t	i;
+
+	for (i = 0; i < R128_SIZE; i++)
+		count += hist[i] != 0;
+	pos = put_varint(out, pos, count);
+	for (i = 0; i < R128_SIZE; i++)
+		if (hist[i]) {
+			pos = put_varint(out, pos, i - last);
+			pos = put_varint(out, pos, hist[i]);
+			last = i;
+		}
+	return pos;
+}
+
+static bool
+get_hist(const uint8_t *data, size_t len, size_t *pos, uint32_t *hist) {
+	uint64_t	count;
+	uint64_t	gap;
+	uint64_t	v;
+	size_t		bin = -1;
+
+	if (!get_varint(data, len, pos, &count) || count > R128_SIZE)
+		return false;
+	while (count--) {
+		if (!get_varint(data, len, pos, &gap) || !gap ||
+		    gap > R128_SIZE - (bin + 1) ||
+		    !get_varint(data, len, pos, &v) || !v || v > UINT32_MAX)
+			return false;
+		bin += gap;
+		hist[bin] = v;
+	}
+	return true;
+}
+
+size_t
+r128_serialize(const struct r128_value *value, uint8_t *out) {
+	size_t	pos = 0;
+
+	if (out)
+		memcpy(out, SERIAL_MAGIC, sizeof(SERIAL_MAGIC));
+	pos += sizeof(SERIAL_MAGIC);
+	pos = put_varint(out, pos, SERIAL_VERSION);
+	pos = put_hist(out, pos, value->block);
+	return put_hist(out, pos, value->short_term);
+}
+
+enum replaygain_status
+r128_deserialize(const uint8_t *data, size_t len, struct r128_value *value) {
+	uint64_t	version;
+	size_t		pos = sizeof(SERIAL_MAGIC);
+
+	memset(value, 0, sizeof(*value));
+	if (len < sizeof(SERIAL_MAGIC) ||
+	    memcmp(data, SERIAL_MAGIC, sizeof(SERIAL_MAGIC)) ||
+	    !get_varint(data, len, &pos, &version) ||
+	    version != SERIAL_VERSION ||
+	    !get_hist(data, len, &pos, value->block) ||
+	    !get_hist(data, len, &pos, value->short_term) || pos != len) {
+		memset(value, 0, sizeof(*value));
+		return REPLAYGAIN_ERROR;
+	}
+	return REPLAYGAIN_OK;
+}
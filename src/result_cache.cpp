@@ -0,0 +1,369 @@
+/* Copyright (C) 2010 Markus Peloquin <markus@cs.wisc.edu>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <list>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <multigain/result_cache.hpp>
+#include <multigain/tag_locate.hpp>
+
+namespace multigain {
+namespace {
+
+/* The file is MAGIC, then records, all integers little-endian:
+ *
+ *	uint32_t	length of the body
+ *	uint64_t	FNV-1a hash of the body
+ *	body:
+ *		uint64_t	device, inode, size, mtime, audio_hash
+ *		uint32_t	length of the Sample
+ *		uint8_t[]	Sample::save()
+ *		uint8_t[]	R128_sample::save()
+ *
+ * The last byte of MAGIC is the version.
+ */
+const uint8_t MAGIC[8] = { 'M', 'G', 'C', 'A', 'C', 'H', 'E', 2 };
+const size_t RECORD_HEADER = 4 + 8;
+const size_t IDENTITY_SIZE = 5 * 8;
+const size_t BODY_HEADER = IDENTITY_SIZE + 4;
+
+/** Records worth keeping before the log is rewritten without the dead */
+const size_t COMPACT_MIN = 1024;
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+uint64_t
+fnv1a(uint64_t hash, const uint8_t *data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+void
+put_le(std::vector<uint8_t> &out, uint64_t v, int bytes) {
+	for (int i = 0; i < bytes; i++)
+		out.push_back(v >> 8*i);
+}
+
+uint64_t
+get_le(const uint8_t *in, int bytes) {
+	uint64_t	v = 0;
+
+	for (int i = 0; i < bytes; i++)
+		v |= (uint64_t)in[i] << 8*i;
+	return v;
+}
+
+Disk_error
+errno_error(const std::string &what) {
+	return Disk_error(what + ": " + std::strerror(errno));
+}
+
+void
+write_all(int fd, const uint8_t *data, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw errno_error("cache write");
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+} // end anon
+} // end multigain
+
+multigain::File_identity
+multigain::identify_file(const std::string &path) {
+	struct stat	st;
+
+	if (stat(path.c_str(), &st))
+		throw errno_error(path);
+
+	File_identity id;
+	id.device = st.st_dev;
+	id.inode = st.st_ino;
+	id.size = st.st_size;
+	id.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 +
+	    st.st_mtim.tv_nsec;
+	id.audio_hash = 0;
+	return id;
+}
+
+uint64_t
+multigain::audio_hash(std::ifstream &in) {
+	std::list<tag_info>	tags;
+	char			buf[65536];
+	uint64_t		hash = FNV_OFFSET;
+
+	try {
+		find_tags(in, tags);
+	} catch (const Unsupported_tag &) {
+		in.clear();
+		return 0;
+	}
+
+	for (const tag_info &tag : tags) {
+		if (tag.type != tag_type::MPEG)
+			continue;
+		if (!in.seekg(tag.start, std::ios_base::beg))
+			throw Disk_error("seek error");
+		for (size_t left = tag.size; left;) {
+			size_t len = std::min(left, sizeof(buf));
+
+			if (!in.read(buf, len))
+				throw Disk_error("read error");
+			hash = fnv1a(hash, reinterpret_cast<uint8_t *>(buf),
+			    len);
+			left -= len;
+		}
+	}
+	in.clear();
+	if (!in.seekg(0, std::ios_base::beg))
+		throw Disk_error("seek error");
+	// 0 is for a hash not known
+	return hash ? hash : 1;
+}
+
+multigain::Result_cache::Result_cache(const std::string &path) :
+	_path(path),
+	_fd(-1),
+	_records(0)
+{
+	_fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+	    0666);
+	if (_fd < 0)
+		throw errno_error(path);
+	try {
+		if (flock(_fd, LOCK_EX | LOCK_NB))
+			throw errno_error(path);
+		load();
+		if (_records >= COMPACT_MIN && _records > 2 * size())
+			compact();
+	} catch (...) {
+		close(_fd);
+		throw;
+	}
+}
+
+multigain::Result_cache::~Result_cache() noexcept {
+	close(_fd);
+}
+
+bool
+multigain::Result_cache::find(const File_identity &id, Sample *out,
+    R128_sample *loudness) {
+	const Entry	*found = 0;
+
+	auto i = _by_inode.find(Inode(id.device, id.inode));
+	if (i != _by_inode.end()) {
+		const File_identity &had = i->second.id;
+
+		if (had.size == id.size && had.mtime == id.mtime &&
+		    (!had.audio_hash || !id.audio_hash ||
+		    had.audio_hash == id.audio_hash))
+			found = &i->second;
+	}
+	if (!found && id.audio_hash) {
+		auto j = _by_audio.find(id.audio_hash);
+		if (j != _by_audio.end())
+			found = &_by_inode.at(j->second);
+	}
+	if (!found)
+		return false;
+
+	try {
+		out->load(found->sample.data(), found->sample.size());
+		loudness->load(found->loudness.data(), found->loudness.size());
+	} catch (const Bad_format &) {
+		return false;
+	}
+	if (found->id.device != id.device || found->id.inode != id.inode ||
+	    (id.audio_hash && found->id.audio_hash != id.audio_hash))
+		store(id, *out, *loudness);
+	return true;
+}
+
+void
+multigain::Result_cache::store(const File_identity &id,
+    const Sample &sample, const R128_sample &loudness) {
+	Entry	entry;
+
+	entry.id = id;
+	entry.sample = sample.save();
+	entry.loudness = loudness.save();
+	append(entry);
+	insert(std::move(entry));
+}
+
+void
+multigain::Result_cache::load() {
+	struct stat	st;
+
+	if (fstat(_fd, &st))
+		throw errno_error(_path);
+
+	std::vector<uint8_t> data(st.st_size);
+	for (size_t have = 0; have < data.size();) {
+		ssize_t n = pread(_fd, data.data() + have,
+		    data.size() - have, have);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw errno_error(_path);
+		}
+		if (!n) {
+			data.resize(have);
+			break;
+		}
+		have += n;
+	}
+
+	// new, torn before the first record, or of an older version
+	if ((data.size() < sizeof(MAGIC) &&
+	    std::equal(data.begin(), data.end(), MAGIC)) ||
+	    (data.size() >= sizeof(MAGIC) &&
+	    std::equal(MAGIC, MAGIC + sizeof(MAGIC) - 1, data.begin()) &&
+	    data[sizeof(MAGIC) - 1] < MAGIC[sizeof(MAGIC) - 1])) {
+		if (ftruncate(_fd, 0))
+			throw errno_error(_path);
+		write_all(_fd, MAGIC, sizeof(MAGIC));
+		return;
+	}
+	if (data.size() < sizeof(MAGIC) ||
+	    !std::equal(MAGIC, MAGIC + sizeof(MAGIC), data.begin()))
+		throw Disk_error(_path + ": not a cache file");
+
+	size_t pos = sizeof(MAGIC);
+	while (data.size() - pos >= RECORD_HEADER) {
+		const uint8_t *rec = data.data() + pos;
+		size_t len = get_le(rec, 4);
+		const uint8_t *body = rec + RECORD_HEADER;
+
+		if (len < BODY_HEADER ||
+		    data.size() - pos - RECORD_HEADER < len ||
+		    get_le(rec + 4, 8) != fnv1a(FNV_OFFSET, body, len))
+			break;
+		size_t sample_len = get_le(body + IDENTITY_SIZE, 4);
+		if (sample_len > len - BODY_HEADER)
+			break;
+
+		Entry entry;
+		entry.id.device = get_le(body, 8);
+		entry.id.inode = get_le(body + 8, 8);
+		entry.id.size = get_le(body + 16, 8);
+		entry.id.mtime = get_le(body + 24, 8);
+		entry.id.audio_hash = get_le(body + 32, 8);
+		entry.sample.assign(body + BODY_HEADER,
+		    body + BODY_HEADER + sample_len);
+		entry.loudness.assign(body + BODY_HEADER + sample_len,
+		    body + len);
+		insert(std::move(entry));
+		pos += RECORD_HEADER + len;
+	}
+
+	// a torn append
+	if (pos != data.size() && ftruncate(_fd, pos))
+		throw errno_error(_path);
+}
+
+void
+multigain::Result_cache::append(const Entry &entry) {
+	std::vector<uint8_t>	rec;
+	uint64_t		hash;
+
+	rec.reserve(RECORD_HEADER + BODY_HEADER + entry.sample.size() +
+	    entry.loudness.size());
+	put_le(rec, BODY_HEADER + entry.sample.size() +
+	    entry.loudness.size(), 4);
+	put_le(rec, 0, 8);
+	put_le(rec, entry.id.device, 8);
+	put_le(rec, entry.id.inode, 8);
+	put_le(rec, entry.id.size, 8);
+	put_le(rec, entry.id.mtime, 8);
+	put_le(rec, entry.id.audio_hash, 8);
+	put_le(rec, entry.sample.size(), 4);
+	rec.insert(rec.end(), entry.sample.begin(), entry.sample.end());
+	rec.insert(rec.end(), entry.loudness.begin(), entry.loudness.end());
+
+	hash = fnv1a(FNV_OFFSET, rec.data() + RECORD_HEADER,
+	    rec.size() - RECORD_HEADER);
+	for (int i = 0; i < 8; i++)
+		rec[4 + i] = hash >> 8*i;
+
+	// one write, so a crash tears no more than this record
+	write_all(_fd, rec.data(), rec.size());
+}
+
+void
+multigain::Result_cache::insert(Entry &&entry) {
+	Inode	inode(entry.id.device, entry.id.inode);
+
+	auto i = _by_inode.find(inode);
+	if (i != _by_inode.end()) {
+		auto j = _by_audio.find(i->second.id.audio_hash);
+		if (j != _by_audio.end() && j->second == inode)
+			_by_audio.erase(j);
+		i->second = std::move(entry);
+	} else
+		i = _by_inode.emplace(inode, std::move(entry)).first;
+	if (i->second.id.audio_hash)
+		_by_audio[i->second.id.audio_hash] = inode;
+	_records++;
+}
+
+/* Write the live records to a new file and put it in place of the old */
+void
+multigain::Result_cache::compact() {
+	std::string	tmp = _path + ".tmp";
+	int		fd;
+
+	fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0666);
+	if (fd < 0)
+		throw errno_error(tmp);
+	std::swap(fd, _fd);
+	try {
+		write_all(_fd, MAGIC, sizeof(MAGIC));
+		for (const auto &i : _by_inode)
+			append(i.second);
+		if (fsync(_fd) || rename(tmp.c_str(), _path.c_str()))
+			throw errno_error(tmp);
+	} catch (...) {
+		close(_fd);
+		unlink(tmp.c_str());
+		_fd = fd;
+		throw;
+	}
+	// the lock stays with the old file until it closes
+	close(fd);
+	close(_fd);
+	_fd = open(_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+	if (_fd < 0 || flock(_fd, LOCK_EX | LOCK_NB))
+		throw errno_error(_path);
+	_records = size();
+}